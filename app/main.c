@@ -1,7 +1,639 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
 
-int main(void)
+#include "../src/lab.h"
+
+/**
+ * Load generator for soak testing the buddy allocator. Worker threads
+ * allocate objects with sizes and lifetimes drawn from configurable
+ * distributions and free them when they expire, while the main thread
+ * prints live throughput and pool stats. Latency percentiles for malloc
+ * and free are printed at the end.
+ */
+
+#define WHEEL_SIZE 65536      /*Longest lifetime in ticks, must be a power of two*/
+#define ZIPF_MAX_RANKS 65536  /*Most distinct sizes a zipf distribution uses*/
+#define HIST_BUCKETS (64 * 16) /*Log-linear latency buckets, 16 per power of two*/
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  -t threads   worker threads (default 4)\n"
+          "  -k kval      pool size is 2^kval bytes (default %d)\n"
+          "  -e engine    list or tree (default list)\n"
+          "  -s dist      object sizes in bytes (default loguniform:16:65536)\n"
+          "                 uniform:MIN:MAX\n"
+          "                 loguniform:MIN:MAX\n"
+          "                 zipf:S:MIN:MAX   smaller sizes are more likely\n"
+          "                 hist:FILE        lines of \"size weight\"\n"
+          "  -l dist      object lifetime counted in allocations by the same\n"
+          "               thread (default exp:1000)\n"
+          "                 fixed:N | uniform:MIN:MAX | exp:MEAN\n"
+          "  -o order     which object to free early when a thread reaches its\n"
+          "               live limit or the pool is exhausted: fifo, lifo or\n"
+          "               random (default fifo)\n"
+          "  -n count     live objects per thread limit (default 4096)\n"
+          "  -d seconds   run duration (default 10)\n"
+          "  -i seconds   report interval (default 1)\n"
+          "  -w ms        when the pool is exhausted wait up to ms for memory\n"
+          "               with buddy_malloc_wait before freeing early\n",
+          prog, DEFAULT_K);
+}
+
+/*
+ * Random numbers and distributions
+ */
+
+static inline uint64_t next_rand(uint64_t *state)
+{
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+/**
+ * @brief Uniform double in (0, 1]
+ */
+static inline double next_unit(uint64_t *state)
+{
+  return ((next_rand(state) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+#define DIST_FIXED 0
+#define DIST_UNIFORM 1
+#define DIST_LOGUNIFORM 2
+#define DIST_EXP 3
+#define DIST_TABLE 4  /*zipf and histograms, sampled from a cdf*/
+
+struct dist
+{
+  int kind;           /*One of DIST_* */
+  double a;           /*First parameter, min or mean*/
+  double b;           /*Second parameter, max*/
+  size_t n;           /*Entries in the table*/
+  double *cdf;        /*Cumulative weights for DIST_TABLE*/
+  size_t *values;     /*Value of each table entry*/
+};
+
+static size_t dist_sample(const struct dist *d, uint64_t *rng)
+{
+  switch (d->kind)
+    {
+    case DIST_FIXED:
+      return (size_t)d->a;
+    case DIST_UNIFORM:
+      return (size_t)d->a + next_rand(rng) % ((size_t)d->b - (size_t)d->a + 1);
+    case DIST_LOGUNIFORM:
+      return (size_t)exp(log(d->a) + (log(d->b) - log(d->a)) * next_unit(rng));
+    case DIST_EXP:
+      return (size_t)(-log(next_unit(rng)) * d->a);
+    default:
+      {
+        double u = next_unit(rng) * d->cdf[d->n - 1];
+        size_t lo = 0, hi = d->n - 1;
+        while (lo < hi)
+          {
+            size_t mid = (lo + hi) / 2;
+            if (d->cdf[mid] < u)
+              lo = mid + 1;
+            else
+              hi = mid;
+          }
+        return d->values[lo];
+      }
+    }
+}
+
+static bool table_alloc(struct dist *d, size_t n)
+{
+  d->kind = DIST_TABLE;
+  d->n = n;
+  d->cdf = malloc(n * sizeof(double));
+  d->values = malloc(n * sizeof(size_t));
+  return d->cdf && d->values;
+}
+
+static bool load_histogram(struct dist *d, const char *path)
+{
+  FILE *f = fopen(path, "r");
+  if (f == NULL)
+    {
+      perror(path);
+      return false;
+    }
+  size_t cap = 64, n = 0;
+  if (!table_alloc(d, cap))
+    {
+      fclose(f);
+      return false;
+    }
+  char line[256];
+  double total = 0;
+  while (fgets(line, sizeof(line), f))
+    {
+      unsigned long size;
+      double weight = 1;
+      if (line[0] == '#' || sscanf(line, "%lu %lf", &size, &weight) < 1 || size == 0)
+        continue;
+      if (n == cap)
+        {
+          //On failure the old tables stay in d so nothing leaks
+          double *cdf = realloc(d->cdf, cap * 2 * sizeof(double));
+          if (cdf != NULL)
+            d->cdf = cdf;
+          size_t *values = realloc(d->values, cap * 2 * sizeof(size_t));
+          if (values != NULL)
+            d->values = values;
+          if (cdf == NULL || values == NULL)
+            {
+              fclose(f);
+              return false;
+            }
+          cap *= 2;
+        }
+      total += weight;
+      d->values[n] = size;
+      d->cdf[n++] = total;
+    }
+  fclose(f);
+  d->n = n;
+  if (n == 0)
+    fprintf(stderr, "%s: no sizes found\n", path);
+  return n > 0;
+}
+
+/**
+ * @brief Parse a distribution spec such as "zipf:1.1:16:4096"
+ */
+static bool parse_dist(struct dist *d, const char *spec, bool sizes)
+{
+  memset(d, 0, sizeof(struct dist));
+  double s, a, b;
+  if (sizes && strncmp(spec, "hist:", 5) == 0)
+    return load_histogram(d, spec + 5);
+  if (sizes && sscanf(spec, "zipf:%lf:%lf:%lf", &s, &a, &b) == 3 && a >= 1 && b >= a && s > 0)
+    {
+      size_t span = (size_t)(b - a) + 1;
+      size_t step = (span + ZIPF_MAX_RANKS - 1) / ZIPF_MAX_RANKS;
+      size_t ranks = (span + step - 1) / step;
+      if (!table_alloc(d, ranks))
+        return false;
+      double total = 0;
+      for (size_t r = 0; r < ranks; r++)
+        {
+          total += 1.0 / pow((double)(r + 1), s);
+          d->cdf[r] = total;
+          d->values[r] = (size_t)a + r * step;
+        }
+      return true;
+    }
+  if (sscanf(spec, "uniform:%lf:%lf", &a, &b) == 2 && b >= a && a >= 1)
+    {
+      d->kind = DIST_UNIFORM;
+      d->a = a;
+      d->b = b;
+      return true;
+    }
+  if (sizes && sscanf(spec, "loguniform:%lf:%lf", &a, &b) == 2 && b >= a && a >= 1)
+    {
+      d->kind = DIST_LOGUNIFORM;
+      d->a = a;
+      d->b = b;
+      return true;
+    }
+  if (!sizes && sscanf(spec, "fixed:%lf", &a) == 1 && a >= 1)
+    {
+      d->kind = DIST_FIXED;
+      d->a = a;
+      return true;
+    }
+  if (!sizes && sscanf(spec, "exp:%lf", &a) == 1 && a > 0)
+    {
+      d->kind = DIST_EXP;
+      d->a = a;
+      return true;
+    }
+  fprintf(stderr, "bad %s distribution: %s\n", sizes ? "size" : "lifetime", spec);
+  return false;
+}
+
+/*
+ * Latency histograms
+ */
+
+struct histogram
+{
+  uint64_t count[HIST_BUCKETS];   /*Samples in each bucket*/
+  uint64_t max;                   /*Largest sample*/
+};
+
+static inline size_t hist_bucket(uint64_t ns)
+{
+  if (ns < 16)
+    return (size_t)ns;
+  int msb = 63 - __builtin_clzll(ns);
+  return (size_t)(msb - 3) * 16 + ((ns >> (msb - 4)) & 15);
+}
+
+/**
+ * @brief Smallest value that lands in bucket b
+ */
+static uint64_t hist_value(size_t b)
+{
+  if (b < 16)
+    return b;
+  size_t msb = b / 16 + 3;
+  return (UINT64_C(1) << msb) | ((uint64_t)(b % 16) << (msb - 4));
+}
+
+static inline void hist_add(struct histogram *h, uint64_t ns)
+{
+  h->count[hist_bucket(ns)]++;
+  if (ns > h->max)
+    h->max = ns;
+}
+
+static void hist_merge(struct histogram *into, const struct histogram *h)
+{
+  for (size_t b = 0; b < HIST_BUCKETS; b++)
+    into->count[b] += h->count[b];
+  if (h->max > into->max)
+    into->max = h->max;
+}
+
+static uint64_t hist_percentile(const struct histogram *h, double p)
+{
+  uint64_t total = 0;
+  for (size_t b = 0; b < HIST_BUCKETS; b++)
+    total += h->count[b];
+  uint64_t want = (uint64_t)ceil(total * p / 100.0), seen = 0;
+  for (size_t b = 0; b < HIST_BUCKETS; b++)
+    {
+      seen += h->count[b];
+      if (seen >= want && h->count[b])
+        return hist_value(b);
+    }
+  return h->max;
+}
+
+static void hist_print(const char *name, const struct histogram *h)
 {
-  printf("hello world\n");
+  printf("%-6s p50 %6lu ns  p90 %6lu ns  p99 %6lu ns  p99.9 %7lu ns  max %8lu ns\n", name,
+         (unsigned long)hist_percentile(h, 50), (unsigned long)hist_percentile(h, 90),
+         (unsigned long)hist_percentile(h, 99), (unsigned long)hist_percentile(h, 99.9),
+         (unsigned long)h->max);
+}
+
+/*
+ * Workers
+ */
+
+#define ORDER_FIFO 0
+#define ORDER_LIFO 1
+#define ORDER_RANDOM 2
+
+/**
+ * Settings shared by every worker.
+ */
+struct config
+{
+  struct buddy_pool pool;     /*The pool under test*/
+  struct dist sizes;          /*Object sizes*/
+  struct dist lifetimes;      /*Object lifetimes in ticks*/
+  int order;                  /*Which object to free early, ORDER_* */
+  size_t max_live;            /*Live objects per thread*/
+  int wait_ms;                /*buddy_malloc_wait timeout, 0 to not wait*/
+  atomic_bool stop;           /*Set when the run is over*/
+};
+
+/**
+ * A live object. Objects are linked twice by slot index, once in
+ * allocation order and once into the timing wheel slot they expire in.
+ */
+struct object
+{
+  void *ptr;                  /*The allocation, NULL if the slot is free*/
+  uint32_t prev, next;        /*Allocation order list*/
+  uint32_t wprev, wnext;      /*Timing wheel list*/
+  uint32_t wslot;             /*Wheel slot the object expires in*/
+};
+
+#define NIL UINT32_MAX
+
+struct worker
+{
+  pthread_t tid;
+  struct config *cfg;
+  uint64_t rng;
+  struct object *obj;         /*max_live slots*/
+  uint32_t *free_slots;       /*Stack of unused slots*/
+  size_t nfree_slots;
+  uint32_t oldest, newest;    /*Ends of the allocation order list*/
+  uint32_t *wheel;            /*First object expiring in each tick*/
+  uint64_t tick;
+  size_t live;
+  struct histogram malloc_ns;
+  struct histogram free_ns;
+  atomic_uint_fast64_t ops;       /*Mallocs and frees done*/
+  atomic_uint_fast64_t failures;  /*Mallocs that returned NULL*/
+};
+
+static inline uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+static void release(struct worker *w, uint32_t s)
+{
+  struct object *o = &w->obj[s];
+  uint64_t start = now_ns();
+  buddy_free(&w->cfg->pool, o->ptr);
+  hist_add(&w->free_ns, now_ns() - start);
+  atomic_fetch_add_explicit(&w->ops, 1, memory_order_relaxed);
+
+  //Unlink from the allocation order list
+  if (o->prev != NIL)
+    w->obj[o->prev].next = o->next;
+  else
+    w->oldest = o->next;
+  if (o->next != NIL)
+    w->obj[o->next].prev = o->prev;
+  else
+    w->newest = o->prev;
+
+  //Unlink from the timing wheel
+  if (o->wprev != NIL)
+    w->obj[o->wprev].wnext = o->wnext;
+  else
+    w->wheel[o->wslot] = o->wnext;
+  if (o->wnext != NIL)
+    w->obj[o->wnext].wprev = o->wprev;
+
+  o->ptr = NULL;
+  w->free_slots[w->nfree_slots++] = s;
+  w->live--;
+}
+
+/**
+ * @brief Free one object before its time according to the free order.
+ */
+static void evict(struct worker *w)
+{
+  uint32_t s = w->oldest;
+  if (w->cfg->order == ORDER_LIFO)
+    {
+      s = w->newest;
+    }
+  else if (w->cfg->order == ORDER_RANDOM)
+    {
+      for (int tries = 0; tries < 64; tries++)
+        {
+          uint32_t r = (uint32_t)(next_rand(&w->rng) % w->cfg->max_live);
+          if (w->obj[r].ptr)
+            {
+              s = r;
+              break;
+            }
+        }
+    }
+  release(w, s);
+}
+
+static void *worker_main(void *arg)
+{
+  struct worker *w = arg;
+  struct config *cfg = w->cfg;
+  while (!atomic_load_explicit(&cfg->stop, memory_order_relaxed))
+    {
+      //Everything that expires this tick goes first
+      uint32_t *head = &w->wheel[w->tick & (WHEEL_SIZE - 1)];
+      while (*head != NIL)
+        release(w, *head);
+      w->tick++;
+
+      if (w->live == cfg->max_live)
+        evict(w);
+
+      size_t size = dist_sample(&cfg->sizes, &w->rng);
+      void *ptr = NULL;
+      for (;;)
+        {
+          uint64_t start = now_ns();
+          ptr = buddy_malloc_wait(&cfg->pool, size ? size : 1, cfg->wait_ms);
+          hist_add(&w->malloc_ns, now_ns() - start);
+          atomic_fetch_add_explicit(&w->ops, 1, memory_order_relaxed);
+          if (ptr != NULL)
+            break;
+          atomic_fetch_add_explicit(&w->failures, 1, memory_order_relaxed);
+          //Exhausted, make room the same way as at the live limit
+          if (w->live == 0)
+            break;
+          evict(w);
+        }
+      if (ptr == NULL)
+        continue;
+
+      uint32_t s = w->free_slots[--w->nfree_slots];
+      struct object *o = &w->obj[s];
+      o->ptr = ptr;
+      o->next = NIL;
+      o->prev = w->newest;
+      if (w->newest != NIL)
+        w->obj[w->newest].next = s;
+      else
+        w->oldest = s;
+      w->newest = s;
+
+      size_t life = dist_sample(&cfg->lifetimes, &w->rng);
+      if (life < 1)
+        life = 1;
+      if (life >= WHEEL_SIZE)
+        life = WHEEL_SIZE - 1;
+      o->wslot = (uint32_t)((w->tick + life - 1) & (WHEEL_SIZE - 1));
+      uint32_t *slot = &w->wheel[o->wslot];
+      o->wprev = NIL;
+      o->wnext = *slot;
+      if (*slot != NIL)
+        w->obj[*slot].wprev = s;
+      *slot = s;
+      w->live++;
+    }
+
+  while (w->live)
+    evict(w);
+  return NULL;
+}
+
+static bool worker_init(struct worker *w, struct config *cfg, uint64_t seed)
+{
+  memset(w, 0, sizeof(struct worker));
+  w->cfg = cfg;
+  w->rng = seed * UINT64_C(0x9E3779B97F4A7C15) | 1;
+  w->obj = calloc(cfg->max_live, sizeof(struct object));
+  w->free_slots = malloc(cfg->max_live * sizeof(uint32_t));
+  w->wheel = malloc(WHEEL_SIZE * sizeof(uint32_t));
+  if (!w->obj || !w->free_slots || !w->wheel)
+    return false;
+  for (size_t i = 0; i < cfg->max_live; i++)
+    w->free_slots[i] = (uint32_t)(cfg->max_live - 1 - i);
+  w->nfree_slots = cfg->max_live;
+  for (size_t t = 0; t < WHEEL_SIZE; t++)
+    w->wheel[t] = NIL;
+  w->oldest = w->newest = NIL;
+  return true;
+}
+
+static void print_pool(struct config *cfg)
+{
+  struct buddy_stats st;
+  buddy_stats(&cfg->pool, &st);
+  printf("free %6.1f%% (%zu MiB)  largest free 2^%zu",
+         100.0 * st.free_bytes / st.numbytes, st.free_bytes >> 20, st.largest_free_k);
+}
+
+int myMain(int argc, char **argv)
+{
+  static struct config cfg;
+  size_t threads = 4, kval = DEFAULT_K;
+  double duration = 10, interval = 1;
+  const char *size_spec = "loguniform:16:65536", *life_spec = "exp:1000";
+  struct buddy_opts opts = {0};
+  cfg.max_live = 4096;
+
+  int c;
+  while ((c = getopt(argc, argv, "t:k:e:s:l:o:n:d:i:w:h")) != -1)
+    {
+      switch (c)
+        {
+        case 't': threads = strtoul(optarg, NULL, 10); break;
+        case 'k': kval = strtoul(optarg, NULL, 10); break;
+        case 's': size_spec = optarg; break;
+        case 'l': life_spec = optarg; break;
+        case 'n': cfg.max_live = strtoul(optarg, NULL, 10); break;
+        case 'd': duration = atof(optarg); break;
+        case 'i': interval = atof(optarg); break;
+        case 'w': cfg.wait_ms = atoi(optarg); break;
+        case 'e':
+          if (strcmp(optarg, "list") == 0)
+            opts.engine = BUDDY_ENGINE_LIST;
+          else if (strcmp(optarg, "tree") == 0)
+            opts.engine = BUDDY_ENGINE_TREE;
+          else
+            {
+              usage(argv[0]);
+              return 1;
+            }
+          break;
+        case 'o':
+          if (strcmp(optarg, "fifo") == 0)
+            cfg.order = ORDER_FIFO;
+          else if (strcmp(optarg, "lifo") == 0)
+            cfg.order = ORDER_LIFO;
+          else if (strcmp(optarg, "random") == 0)
+            cfg.order = ORDER_RANDOM;
+          else
+            {
+              usage(argv[0]);
+              return 1;
+            }
+          break;
+        default:
+          usage(argv[0]);
+          return c == 'h' ? 0 : 1;
+        }
+    }
+  if (threads == 0 || cfg.max_live == 0 || cfg.max_live >= NIL || interval <= 0 || kval < MIN_K || kval >= MAX_K)
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  if (!parse_dist(&cfg.sizes, size_spec, true) || !parse_dist(&cfg.lifetimes, life_spec, false))
+    return 1;
+  if (buddy_init_opts(&cfg.pool, UINT64_C(1) << kval, &opts) == -1)
+    {
+      perror("buddy_init_opts");
+      return 1;
+    }
+
+  struct worker *workers = calloc(threads, sizeof(struct worker));
+  if (workers == NULL)
+    return 1;
+  for (size_t i = 0; i < threads; i++)
+    {
+      if (!worker_init(&workers[i], &cfg, i + 1) ||
+          pthread_create(&workers[i].tid, NULL, worker_main, &workers[i]) != 0)
+        {
+          fprintf(stderr, "could not start worker %zu\n", i);
+          return 1;
+        }
+    }
+
+  printf("%zu threads, 2^%zu byte %s pool, sizes %s, lifetimes %s\n", threads, kval,
+         opts.engine == BUDDY_ENGINE_TREE ? "tree" : "list", size_spec, life_spec);
+  uint64_t start = now_ns(), last = start, last_ops = 0, last_fail = 0;
+  while ((now_ns() - start) / 1e9 < duration)
+    {
+      usleep((useconds_t)(interval * 1e6));
+      uint64_t now = now_ns(), ops = 0, fail = 0;
+      for (size_t i = 0; i < threads; i++)
+        {
+          ops += atomic_load_explicit(&workers[i].ops, memory_order_relaxed);
+          fail += atomic_load_explicit(&workers[i].failures, memory_order_relaxed);
+        }
+      printf("[%6.1fs] %10.0f ops/s  %8lu failed  ", (now - start) / 1e9,
+             (ops - last_ops) / ((now - last) / 1e9), (unsigned long)(fail - last_fail));
+      print_pool(&cfg);
+      printf("\n");
+      fflush(stdout);
+      last = now;
+      last_ops = ops;
+      last_fail = fail;
+    }
+
+  atomic_store(&cfg.stop, true);
+  struct histogram malloc_ns = {0}, free_ns = {0};
+  uint64_t ops = 0, fail = 0;
+  for (size_t i = 0; i < threads; i++)
+    {
+      pthread_join(workers[i].tid, NULL);
+      hist_merge(&malloc_ns, &workers[i].malloc_ns);
+      hist_merge(&free_ns, &workers[i].free_ns);
+      ops += workers[i].ops;
+      fail += workers[i].failures;
+      free(workers[i].obj);
+      free(workers[i].free_slots);
+      free(workers[i].wheel);
+    }
+  double secs = (now_ns() - start) / 1e9;
+  printf("\n%lu ops in %.1fs (%.0f ops/s), %lu failed mallocs\n", (unsigned long)ops, secs,
+         ops / secs, (unsigned long)fail);
+  hist_print("malloc", &malloc_ns);
+  hist_print("free", &free_ns);
+  print_pool(&cfg);
+  printf("\n");
+
+  free(workers);
+  free(cfg.sizes.cdf);
+  free(cfg.sizes.values);
+  buddy_destroy(&cfg.pool);
   return 0;
 }
+
+int main(int argc, char **argv)
+{
+  return myMain(argc, argv);
+}
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "../src/lab.h"
+
+/**
+ * Per item cost of buddy_malloc_batch and buddy_free_batch against the
+ * same number of buddy_malloc and buddy_free calls, for descriptor sized
+ * blocks at a range of batch sizes. Each round allocates a batch, shuffles
+ * it like a pipeline would, and frees it.
+ *
+ * usage: bench-batch [items]
+ */
+
+#define MAX_BATCH 256
+#define DESC_SIZE 200
+
+static void shuffle(void **ptrs, size_t n, uint64_t *seed)
+{
+  for (size_t i = n; i > 1; i--)
+    {
+      size_t j = bench_rand(seed) % i;
+      void *tmp = ptrs[i - 1];
+      ptrs[i - 1] = ptrs[j];
+      ptrs[j] = tmp;
+    }
+}
+
+static double run_single(struct buddy_pool *pool, size_t batch, size_t items)
+{
+  void *ptrs[MAX_BATCH];
+  uint64_t seed = 7;
+  uint64_t start = bench_now_ns();
+  for (size_t done = 0; done < items; done += batch)
+    {
+      for (size_t i = 0; i < batch; i++)
+        ptrs[i] = buddy_malloc(pool, DESC_SIZE);
+      shuffle(ptrs, batch, &seed);
+      for (size_t i = 0; i < batch; i++)
+        buddy_free(pool, ptrs[i]);
+    }
+  return (double)(bench_now_ns() - start) / items;
+}
+
+static double run_batch(struct buddy_pool *pool, size_t batch, size_t items)
+{
+  void *ptrs[MAX_BATCH];
+  uint64_t seed = 7;
+  uint64_t start = bench_now_ns();
+  for (size_t done = 0; done < items; done += batch)
+    {
+      if (buddy_malloc_batch(pool, DESC_SIZE, batch, ptrs) != batch)
+        {
+          fprintf(stderr, "batch allocation failed\n");
+          exit(1);
+        }
+      shuffle(ptrs, batch, &seed);
+      buddy_free_batch(pool, ptrs, batch);
+    }
+  return (double)(bench_now_ns() - start) / items;
+}
+
+int main(int argc, char **argv)
+{
+  size_t items = 4000000;
+  if (argc > 1)
+    items = strtoul(argv[1], NULL, 10);
+
+  static const size_t batches[] = {1, 8, 32, 64, 128, 256};
+  static const char *names[] = {"list", "tree"};
+  printf("%-6s %6s %14s %14s\n", "engine", "batch", "single ns/item", "batch ns/item");
+  for (int engine = BUDDY_ENGINE_LIST; engine <= BUDDY_ENGINE_TREE; engine++)
+    {
+      struct buddy_opts opts = {.engine = engine};
+      struct buddy_pool pool;
+      if (buddy_init_opts(&pool, UINT64_C(1) << 30, &opts) == -1)
+        {
+          perror("buddy_init_opts");
+          return 1;
+        }
+      //Keep some long lived blocks around so the pool is not pristine
+      static void *background[4096];
+      uint64_t seed = 1;
+      for (size_t i = 0; i < 4096; i++)
+        background[i] = buddy_malloc(&pool, 16 + bench_rand(&seed) % 4096);
+      for (size_t i = 0; i < 4096; i += 2)
+        buddy_free(&pool, background[i]);
+
+      for (size_t b = 0; b < sizeof(batches) / sizeof(batches[0]); b++)
+        {
+          double single = run_single(&pool, batches[b], items);
+          double batch = run_batch(&pool, batches[b], items);
+          printf("%-6s %6zu %14.1f %14.1f\n", names[engine], batches[b], single, batch);
+        }
+      buddy_destroy(&pool);
+    }
+  return 0;
+}
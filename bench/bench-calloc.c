@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "../src/lab.h"
+
+/**
+ * Throughput of buddy_calloc against buddy_malloc followed by memset for
+ * large buffers. Each size is measured on memory that was never handed
+ * out, on memory that was written and freed, and on freed memory that was
+ * purged with buddy_purge. Only the call that hands out zeroed memory is
+ * timed.
+ *
+ * usage: bench-calloc [bytes per measurement]
+ */
+
+enum scenario
+{
+  FRESH,
+  DIRTY,
+  PURGED,
+};
+
+static void *zeroed(struct buddy_pool *pool, size_t size, bool use_calloc)
+{
+  if (use_calloc)
+    return buddy_calloc(pool, 1, size);
+  void *ptr = buddy_malloc(pool, size);
+  if (ptr != NULL)
+    memset(ptr, 0, size);
+  return ptr;
+}
+
+/**
+ * @brief GB/s of handing out zeroed buffers of size bytes
+ */
+static double run(int engine, enum scenario sc, size_t size, bool use_calloc, size_t total)
+{
+  struct buddy_opts opts = {.engine = engine};
+  struct buddy_pool pool;
+  size_t reps = total / size < 4 ? 4 : total / size;
+  uint64_t ns = 0;
+  for (size_t r = 0; r < reps; r++)
+    {
+      //A fresh pool for every round of the fresh case, one pool otherwise
+      if (r == 0 || sc == FRESH)
+        {
+          if (r > 0)
+            buddy_destroy(&pool);
+          if (buddy_init_opts(&pool, UINT64_C(1) << 30, &opts) == -1)
+            {
+              perror("buddy_init_opts");
+              exit(1);
+            }
+        }
+      if (sc != FRESH)
+        {
+          void *old = buddy_malloc(&pool, size);
+          memset(old, 0x5A, size);
+          buddy_free(&pool, old);
+          if (sc == PURGED)
+            buddy_purge(&pool);
+        }
+      uint64_t start = bench_now_ns();
+      void *ptr = zeroed(&pool, size, use_calloc);
+      ns += bench_now_ns() - start;
+      if (ptr == NULL)
+        {
+          fprintf(stderr, "allocation of %zu bytes failed\n", size);
+          exit(1);
+        }
+      buddy_free(&pool, ptr);
+    }
+  buddy_destroy(&pool);
+  return (double)(reps * size) / ns;
+}
+
+int main(int argc, char **argv)
+{
+  size_t total = UINT64_C(1) << 31;
+  if (argc > 1)
+    total = strtoul(argv[1], NULL, 10);
+
+  static const size_t sizes[] = {UINT64_C(1) << 16, UINT64_C(1) << 20, UINT64_C(1) << 24,
+                                 UINT64_C(1) << 26, UINT64_C(1) << 27, UINT64_C(1) << 28};
+  static const char *engines[] = {"list", "tree"};
+  static const char *scenarios[] = {"fresh", "dirty", "purged"};
+  printf("%-6s %-7s %10s %14s %14s\n", "engine", "memory", "size KiB", "memset GB/s",
+         "calloc GB/s");
+  for (int engine = BUDDY_ENGINE_LIST; engine <= BUDDY_ENGINE_TREE; engine++)
+    for (int sc = FRESH; sc <= PURGED; sc++)
+      for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+        {
+          //Minus the header so the block is exactly the power of two
+          size_t size = sizes[s] - BUDDY_HEADER;
+          double naive = run(engine, sc, size, false, total);
+          double calloc = run(engine, sc, size, true, total);
+          printf("%-6s %-7s %10zu %14.1f %14.1f\n", engines[engine], scenarios[sc],
+                 sizes[s] >> 10, naive, calloc);
+        }
+  return 0;
+}
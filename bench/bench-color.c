@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "../src/lab.h"
+
+/**
+ * Walks the first cache line of many same sized objects over and over,
+ * the way a scan over object headers does, with and without cache
+ * coloring. Without it every object starts at the same offset from a
+ * power of two boundary so the lines pile into a few cache sets and evict
+ * each other long before the cache is full.
+ *
+ * usage: bench-color [visits]
+ */
+
+/**
+ * @brief Nanoseconds per object visited
+ */
+static double run(bool color, size_t size, size_t n, size_t visits)
+{
+  struct buddy_opts opts = {.color = color};
+  struct buddy_pool pool;
+  if (buddy_init_opts(&pool, UINT64_C(1) << 28, &opts) == -1)
+    {
+      perror("buddy_init_opts");
+      exit(1);
+    }
+  uint64_t **obj = malloc(n * sizeof(uint64_t *));
+  for (size_t i = 0; i < n; i++)
+    {
+      obj[i] = buddy_malloc(&pool, size);
+      if (obj[i] == NULL)
+        {
+          fprintf(stderr, "allocation of %zu bytes failed\n", size);
+          exit(1);
+        }
+      obj[i][0] = i;
+    }
+
+  size_t rounds = visits / n;
+  volatile uint64_t sink = 0;
+  uint64_t sum = 0;
+  uint64_t start = bench_now_ns();
+  for (size_t r = 0; r < rounds; r++)
+    for (size_t i = 0; i < n; i++)
+      sum += obj[i][0];
+  uint64_t ns = bench_now_ns() - start;
+  sink = sum;
+  (void)sink;
+
+  free(obj);
+  buddy_destroy(&pool);
+  return (double)ns / (double)(rounds * n);
+}
+
+int main(int argc, char **argv)
+{
+  size_t visits = 50000000;
+  if (argc > 1)
+    visits = strtoul(argv[1], NULL, 10);
+
+  static const size_t sizes[] = {600, 3000, 5000};
+  static const size_t counts[] = {64, 256, 1024, 4096};
+  printf("%8s %8s %12s %12s\n", "size", "objects", "plain ns", "colored ns");
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++)
+      {
+        double plain = run(false, sizes[s], counts[c], visits);
+        double colored = run(true, sizes[s], counts[c], visits);
+        printf("%8zu %8zu %12.2f %12.2f\n", sizes[s], counts[c], plain, colored);
+      }
+  return 0;
+}
@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "../src/lab.h"
+
+/**
+ * Compares the list and tree engines on the same allocation traces.
+ *
+ * usage: bench-engines [ops]
+ */
+
+#define SLOTS 4096
+
+/**
+ * Random frees and allocations over a fixed set of slots with sizes spread
+ * log-uniformly from 16 bytes to 16KiB.
+ */
+static uint64_t run_random(struct buddy_pool *pool, size_t ops)
+{
+  static void *slot[SLOTS];
+  uint64_t seed = 42;
+  uint64_t start = bench_now_ns();
+  for (size_t n = 0; n < ops; n++)
+    {
+      size_t i = bench_rand(&seed) % SLOTS;
+      if (slot[i])
+        {
+          buddy_free(pool, slot[i]);
+          slot[i] = NULL;
+        }
+      else
+        {
+          size_t shift = 4 + bench_rand(&seed) % 10;
+          slot[i] = buddy_malloc(pool, (UINT64_C(1) << shift) + bench_rand(&seed) % (UINT64_C(1) << shift));
+        }
+    }
+  uint64_t ns = bench_now_ns() - start;
+  for (size_t i = 0; i < SLOTS; i++)
+    {
+      buddy_free(pool, slot[i]);
+      slot[i] = NULL;
+    }
+  return ns;
+}
+
+/**
+ * Allocate a batch of small blocks and free them in reverse order.
+ */
+static uint64_t run_lifo(struct buddy_pool *pool, size_t ops)
+{
+  static void *slot[SLOTS];
+  uint64_t start = bench_now_ns();
+  for (size_t n = 0; n < ops; n += 2 * SLOTS)
+    {
+      for (size_t i = 0; i < SLOTS; i++)
+        slot[i] = buddy_malloc(pool, 40);
+      for (size_t i = SLOTS; i-- > 0;)
+        buddy_free(pool, slot[i]);
+    }
+  return bench_now_ns() - start;
+}
+
+int main(int argc, char **argv)
+{
+  size_t ops = 4000000;
+  if (argc > 1)
+    ops = strtoul(argv[1], NULL, 10);
+
+  static const char *names[] = {"list", "tree"};
+  printf("%-6s %-8s %10s\n", "engine", "trace", "ns/op");
+  for (int engine = BUDDY_ENGINE_LIST; engine <= BUDDY_ENGINE_TREE; engine++)
+    {
+      struct buddy_opts opts = {.engine = engine};
+      struct buddy_pool pool;
+      if (buddy_init_opts(&pool, UINT64_C(1) << 30, &opts) == -1)
+        {
+          perror("buddy_init_opts");
+          return 1;
+        }
+      printf("%-6s %-8s %10.1f\n", names[engine], "random", (double)run_random(&pool, ops) / ops);
+      printf("%-6s %-8s %10.1f\n", names[engine], "lifo", (double)run_lifo(&pool, ops) / ops);
+      buddy_destroy(&pool);
+    }
+  return 0;
+}
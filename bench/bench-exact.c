@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "../src/lab.h"
+
+/**
+ * Large buffers of sizes spread evenly on a log scale from 1MiB to 256MiB,
+ * the way tensors, frames or file chunks come in. A pool with exact fit is
+ * compared with one that rounds every request up to its block. Both are
+ * filled until a request fails, then a fresh pool holding the same number
+ * of buffers in both is churned with random frees and allocations.
+ * Waste is the share of allocated bytes nobody asked for. Nothing is
+ * written so the pools cost no memory.
+ *
+ * usage: bench-exact [churn ops]
+ */
+
+#define POOL_K 34
+#define LIVE 4096
+#define CHURN_LIVE 220
+
+static size_t trace_size(uint64_t *seed)
+{
+  //2^20 to 2^28 with a random fraction of a power of two on top
+  size_t shift = 20 + bench_rand(seed) % 8;
+  return ((size_t)1 << shift) + bench_rand(seed) % ((size_t)1 << shift);
+}
+
+static void pool_init(struct buddy_pool *pool, size_t exact_fit)
+{
+  struct buddy_opts opts = {.engine = BUDDY_ENGINE_TREE, .exact_fit = exact_fit};
+  if (buddy_init_opts(pool, UINT64_C(1) << POOL_K, &opts) == -1)
+    {
+      perror("buddy_init_opts");
+      exit(1);
+    }
+}
+
+static double waste(struct buddy_pool *pool, size_t asked)
+{
+  struct buddy_stats st;
+  buddy_stats(pool, &st);
+  size_t used = pool->numbytes - st.free_bytes;
+  return (double)(used - asked) / (double)used;
+}
+
+static void run(const char *name, size_t exact_fit, size_t ops)
+{
+  static void *live[LIVE];
+  static size_t size[LIVE];
+  struct buddy_pool pool;
+  uint64_t seed = 21;
+
+  //Fill until a request fails
+  pool_init(&pool, exact_fit);
+  size_t n = 0, asked = 0;
+  while (n < LIVE)
+    {
+      size[n] = trace_size(&seed);
+      live[n] = buddy_malloc(&pool, size[n]);
+      if (live[n] == NULL)
+        break;
+      asked += size[n++];
+    }
+  printf("%-8s %8zu %10.1f %9.2f%%", name, n, (double)asked / (1 << 30), 100.0 * waste(&pool, asked));
+  buddy_destroy(&pool);
+
+  //Churn the same number of buffers in both pools: free a random one and
+  //ask for a new one in its place
+  pool_init(&pool, exact_fit);
+  asked = 0;
+  for (n = 0; n < CHURN_LIVE; n++)
+    {
+      size[n] = trace_size(&seed);
+      live[n] = buddy_malloc(&pool, size[n]);
+      asked += live[n] ? size[n] : 0;
+    }
+  size_t fails = 0;
+  double sum = 0;
+  for (size_t i = 0; i < ops; i++)
+    {
+      size_t slot = bench_rand(&seed) % n;
+      buddy_free(&pool, live[slot]);
+      if (live[slot] != NULL)
+        asked -= size[slot];
+      size[slot] = trace_size(&seed);
+      live[slot] = buddy_malloc(&pool, size[slot]);
+      if (live[slot] == NULL)
+        fails++;
+      else
+        asked += size[slot];
+      sum += waste(&pool, asked);
+    }
+  printf(" %10zu %9.2f%%\n", fails, 100.0 * sum / (double)ops);
+  for (size_t i = 0; i < n; i++)
+    buddy_free(&pool, live[i]);
+  buddy_destroy(&pool);
+}
+
+int main(int argc, char **argv)
+{
+  size_t ops = 20000;
+  if (argc > 1)
+    ops = strtoul(argv[1], NULL, 10);
+
+  printf("%-8s %8s %10s %10s %10s %10s\n", "pool", "fit", "asked GiB", "waste", "churn fail",
+         "waste");
+  run("rounded", 0, ops);
+  run("exact", UINT64_C(1) << 20, ops);
+  return 0;
+}
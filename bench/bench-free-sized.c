@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "../src/lab.h"
+
+/**
+ * Frees objects whose cache lines are cold, as a long lived cache or
+ * a request that finishes long after its buffers were written does. The
+ * cache is flushed by walking a buffer much larger than it before every
+ * round of frees and the objects are freed in random order so the
+ * prefetcher can not help. Compares buddy_free, which has to read the
+ * header in front of each object, with buddy_free_sized.
+ *
+ * usage: bench-free-sized [objects] [rounds]
+ */
+
+#define FLUSH_BYTES (UINT64_C(64) << 20)
+#define SIZE 200
+
+static unsigned char *flush_buf;
+
+static void flush_cache(void)
+{
+  volatile unsigned char sink = 0;
+  for (size_t i = 0; i < FLUSH_BYTES; i += 64)
+    {
+      flush_buf[i]++;
+      sink += flush_buf[i];
+    }
+  (void)sink;
+}
+
+/**
+ * @brief Nanoseconds per free
+ */
+static double run(struct buddy_opts *opts, bool sized, size_t n, size_t rounds)
+{
+  struct buddy_pool pool;
+  if (buddy_init_opts(&pool, UINT64_C(1) << 30, opts) == -1)
+    {
+      perror("buddy_init_opts");
+      exit(1);
+    }
+  void **obj = malloc(n * sizeof(void *));
+  uint64_t seed = 5;
+  uint64_t ns = 0;
+  for (size_t r = 0; r < rounds; r++)
+    {
+      for (size_t i = 0; i < n; i++)
+        {
+          obj[i] = buddy_malloc(&pool, SIZE);
+          if (obj[i] == NULL)
+            {
+              fprintf(stderr, "allocation failed\n");
+              exit(1);
+            }
+          memset(obj[i], (int)i, SIZE);
+        }
+      for (size_t i = n - 1; i > 0; i--)
+        {
+          size_t j = bench_rand(&seed) % (i + 1);
+          void *t = obj[i];
+          obj[i] = obj[j];
+          obj[j] = t;
+        }
+      flush_cache();
+      uint64_t start = bench_now_ns();
+      if (sized)
+        for (size_t i = 0; i < n; i++)
+          buddy_free_sized(&pool, obj[i], SIZE);
+      else
+        for (size_t i = 0; i < n; i++)
+          buddy_free(&pool, obj[i]);
+      ns += bench_now_ns() - start;
+    }
+  free(obj);
+  buddy_destroy(&pool);
+  return (double)ns / (double)(n * rounds);
+}
+
+int main(int argc, char **argv)
+{
+  size_t n = 100000;
+  size_t rounds = 5;
+  if (argc > 1)
+    n = strtoul(argv[1], NULL, 10);
+  if (argc > 2)
+    rounds = strtoul(argv[2], NULL, 10);
+  flush_buf = calloc(1, FLUSH_BYTES);
+
+  struct buddy_opts list = {.engine = BUDDY_ENGINE_LIST};
+  struct buddy_opts tree = {.engine = BUDDY_ENGINE_TREE};
+  struct buddy_opts bare = {.engine = BUDDY_ENGINE_TREE, .headerless = true};
+  printf("%-16s %12s %12s\n", "pool", "free ns", "sized ns");
+  printf("%-16s %12.1f %12.1f\n", "list", run(&list, false, n, rounds), run(&list, true, n, rounds));
+  printf("%-16s %12.1f %12.1f\n", "tree", run(&tree, false, n, rounds), run(&tree, true, n, rounds));
+  printf("%-16s %12.1f %12.1f\n", "tree headerless", run(&bare, false, n, rounds),
+         run(&bare, true, n, rounds));
+  free(flush_buf);
+  return 0;
+}
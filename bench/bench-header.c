@@ -0,0 +1,47 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "../src/lab.h"
+
+/**
+ * Fills a pool with small objects of one size until it runs out and
+ * reports how many fit and what each one really costs, header and
+ * rounding included. Build it with make bench and make bench-compact to
+ * compare the full header with the 8 byte one.
+ *
+ * usage: bench-header [pool MiB]
+ */
+
+static void run(size_t size, size_t bytes)
+{
+  struct buddy_pool pool;
+  if (buddy_init_opts(&pool, bytes, NULL) == -1)
+    {
+      perror("buddy_init_opts");
+      exit(1);
+    }
+  size_t n = 0;
+  uint64_t start = bench_now_ns();
+  while (buddy_malloc(&pool, size) != NULL)
+    n++;
+  uint64_t ns = bench_now_ns() - start;
+  printf("%8zu %12zu %12.1f %11.1f%% %10.1f\n", size, n, (double)bytes / n,
+         100.0 * size * n / bytes, (double)ns / n);
+  buddy_destroy(&pool);
+}
+
+int main(int argc, char **argv)
+{
+  size_t mib = 64;
+  if (argc > 1)
+    mib = strtoul(argv[1], NULL, 10);
+
+  printf("header %zu bytes, smallest block %zu bytes\n", (size_t)BUDDY_HEADER,
+         (size_t)UINT64_C(1) << SMALLEST_K);
+  printf("%8s %12s %12s %12s %10s\n", "size", "objects", "bytes/obj", "payload", "ns/obj");
+  static const size_t sizes[] = {4, 8, 16, 24, 32, 40, 48, 56};
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    run(sizes[s], mib << 20);
+  return 0;
+}
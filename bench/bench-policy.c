@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "bench.h"
+#include "../src/lab.h"
+
+/**
+ * Compares the LIFO and address ordered policies of the list engine (and
+ * the tree engine for reference). The pool is filled, most of it is freed
+ * at random and a smaller live set is then churned, which is where the
+ * policies differ: LIFO keeps reusing holes all over the old footprint
+ * while address order pulls the live set down. Reports how far up the pool
+ * live data reaches, how many pages hold live data, how many pieces the
+ * free space is in and the cache misses of walking every live block.
+ *
+ * usage: bench-policy [ops]
+ */
+
+#define SLOTS 65536
+#define LIVE (SLOTS / 8)
+#define SCANS 20
+
+/**
+ * @brief Open a user space cache miss counter for this thread
+ * @return The fd or -1 if the kernel or the machine does not allow it
+ */
+static int open_cache_misses(void)
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_CACHE_MISSES;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+struct result
+{
+  double ns_per_op;       /*Cost of the churn phase*/
+  double extent;          /*Highest live byte as a fraction of the pool*/
+  size_t pages;           /*4KiB pages holding live data*/
+  size_t free_blocks;     /*Pieces the free space is in*/
+  double scan_ns;         /*Time to read every live block once*/
+  long long misses;       /*Cache misses per scan, -1 if unavailable*/
+};
+
+static size_t random_size(uint64_t *seed)
+{
+  size_t shift = 4 + bench_rand(seed) % 10;
+  return (UINT64_C(1) << shift) + bench_rand(seed) % (UINT64_C(1) << shift);
+}
+
+struct live_block
+{
+  unsigned char *ptr;
+  size_t size;
+};
+
+static int live_cmp(const void *a, const void *b)
+{
+  const struct live_block *x = a, *y = b;
+  return x->ptr < y->ptr ? -1 : x->ptr > y->ptr;
+}
+
+static void run(struct buddy_pool *pool, size_t ops, struct result *res)
+{
+  static unsigned char *slot[SLOTS];
+  static size_t size[SLOTS];
+  uint64_t seed = 42;
+  size_t live = 0;
+
+  //Grow to a large footprint then shrink it at random
+  for (size_t i = 0; i < SLOTS; i++)
+    {
+      size[i] = random_size(&seed);
+      slot[i] = buddy_malloc(pool, size[i]);
+      live += slot[i] != NULL;
+    }
+  for (size_t i = 0; i < SLOTS; i++)
+    {
+      if (slot[i] && bench_rand(&seed) % 8)
+        {
+          buddy_free(pool, slot[i]);
+          slot[i] = NULL;
+          live--;
+        }
+    }
+
+  //Churn a live set of about LIVE blocks
+  uint64_t start = bench_now_ns();
+  for (size_t n = 0; n < ops; n++)
+    {
+      size_t i = bench_rand(&seed) % SLOTS;
+      if (slot[i])
+        {
+          buddy_free(pool, slot[i]);
+          slot[i] = NULL;
+          live--;
+        }
+      else if (live < LIVE)
+        {
+          size[i] = random_size(&seed);
+          slot[i] = buddy_malloc(pool, size[i]);
+          live += slot[i] != NULL;
+        }
+    }
+  res->ns_per_op = (double)(bench_now_ns() - start) / ops;
+
+  static struct live_block sorted[SLOTS];
+  size_t n = 0;
+  for (size_t i = 0; i < SLOTS; i++)
+    {
+      if (slot[i])
+        {
+          sorted[n].ptr = slot[i];
+          sorted[n++].size = size[i];
+        }
+    }
+  qsort(sorted, n, sizeof(sorted[0]), live_cmp);
+  uintptr_t top = 0;
+  if (n > 0)
+    top = (uintptr_t)(sorted[n - 1].ptr - (unsigned char *)pool->base) + sorted[n - 1].size;
+  res->extent = (double)top / pool->numbytes;
+
+  //Count pages with live data, neighbours in address order may share one
+  res->pages = 0;
+  uintptr_t last = UINTPTR_MAX;
+  for (size_t i = 0; i < n; i++)
+    {
+      uintptr_t first = (uintptr_t)sorted[i].ptr >> 12;
+      uintptr_t end = ((uintptr_t)sorted[i].ptr + sorted[i].size - 1) >> 12;
+      res->pages += end - first + 1 - (first == last);
+      last = end;
+    }
+
+  struct buddy_stats st;
+  buddy_stats(pool, &st);
+  res->free_blocks = 0;
+  for (size_t k = 0; k < MAX_K; k++)
+    res->free_blocks += st.nfree[k];
+
+  //Walk the live blocks in address order like a sweep over the heap would
+  int fd = open_cache_misses();
+  volatile unsigned sum = 0;
+  start = bench_now_ns();
+  if (fd >= 0)
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  for (int s = 0; s < SCANS; s++)
+    for (size_t i = 0; i < n; i++)
+      sum += sorted[i].ptr[0];
+  if (fd >= 0)
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+  res->scan_ns = (double)(bench_now_ns() - start) / SCANS;
+  res->misses = -1;
+  if (fd >= 0)
+    {
+      long long count;
+      if (read(fd, &count, sizeof(count)) == sizeof(count))
+        res->misses = count / SCANS;
+      close(fd);
+    }
+
+  for (size_t i = 0; i < SLOTS; i++)
+    {
+      buddy_free(pool, slot[i]);
+      slot[i] = NULL;
+    }
+}
+
+int main(int argc, char **argv)
+{
+  size_t ops = 4000000;
+  if (argc > 1)
+    ops = strtoul(argv[1], NULL, 10);
+
+  static const struct
+  {
+    const char *name;
+    struct buddy_opts opts;
+  } configs[] = {
+    {"list lifo", {.engine = BUDDY_ENGINE_LIST, .policy = BUDDY_POLICY_LIFO}},
+    {"list address", {.engine = BUDDY_ENGINE_LIST, .policy = BUDDY_POLICY_ADDRESS}},
+    {"tree", {.engine = BUDDY_ENGINE_TREE}},
+  };
+  printf("%-13s %8s %8s %10s %12s %10s %12s\n", "config", "ns/op", "extent", "live pages",
+         "free blocks", "scan us", "misses/scan");
+  for (size_t c = 0; c < sizeof(configs) / sizeof(configs[0]); c++)
+    {
+      struct buddy_pool pool;
+      if (buddy_init_opts(&pool, UINT64_C(1) << 30, &configs[c].opts) == -1)
+        {
+          perror("buddy_init_opts");
+          return 1;
+        }
+      struct result res;
+      run(&pool, ops, &res);
+      printf("%-13s %8.1f %7.1f%% %10zu %12zu %10.1f ", configs[c].name, res.ns_per_op,
+             100 * res.extent, res.pages, res.free_blocks, res.scan_ns / 1000);
+      if (res.misses < 0)
+        printf("%12s\n", "n/a");
+      else
+        printf("%12lld\n", res.misses);
+      buddy_destroy(&pool);
+    }
+  return 0;
+}
@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "../src/lab.h"
+
+/**
+ * A request loop that needs zeroed buffers of 256KiB to 4MiB, fills them,
+ * keeps a few around and idles between requests. Reports the cost of
+ * buddy_calloc and how often it found its memory already zero, without the
+ * prezero thread and with it at a few cpu budgets.
+ *
+ * usage: bench-prezero [requests] [idle us]
+ */
+
+#define LIVE 16
+
+static int cmp_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void run(const char *name, unsigned int pct, size_t requests, unsigned int idle_us)
+{
+  struct buddy_pool pool;
+  if (buddy_init_opts(&pool, UINT64_C(1) << 30, NULL) == -1)
+    {
+      perror("buddy_init_opts");
+      exit(1);
+    }
+  if (pct > 0 && buddy_prezero_start(&pool, pct) == -1)
+    {
+      perror("buddy_prezero_start");
+      exit(1);
+    }
+
+  void *live[LIVE] = {0};
+  uint64_t *lat = malloc(requests * sizeof(uint64_t));
+  uint64_t seed = 99;
+  uint64_t total = 0;
+  for (size_t i = 0; i < requests; i++)
+    {
+      size_t slot = i % LIVE;
+      size_t size = (UINT64_C(256) << 10) << (bench_rand(&seed) % 5);
+      uint64_t start = bench_now_ns();
+      live[slot] = buddy_calloc(&pool, 1, size - 64);
+      lat[i] = bench_now_ns() - start;
+      total += lat[i];
+      memset(live[slot], 0x11, size - 64);
+      //Retire the oldest buffer before going idle
+      buddy_free(&pool, live[(slot + 1) % LIVE]);
+      live[(slot + 1) % LIVE] = NULL;
+      usleep(idle_us);
+    }
+
+  struct buddy_stats st;
+  buddy_stats(&pool, &st);
+  qsort(lat, requests, sizeof(uint64_t), cmp_u64);
+  printf("%-10s %10.1f %10.1f %10.1f %8.1f%% %12zu\n", name, (double)total / requests / 1000,
+         (double)lat[requests / 2] / 1000, (double)lat[requests * 99 / 100] / 1000,
+         100.0 * st.calloc_hits / st.calloc_calls, st.prezero_bytes >> 20);
+  free(lat);
+  for (size_t i = 0; i < LIVE; i++)
+    buddy_free(&pool, live[i]);
+  buddy_destroy(&pool);
+}
+
+int main(int argc, char **argv)
+{
+  size_t requests = 1000;
+  unsigned int idle_us = 2000;
+  if (argc > 1)
+    requests = strtoul(argv[1], NULL, 10);
+  if (argc > 2)
+    idle_us = (unsigned int)strtoul(argv[2], NULL, 10);
+
+  printf("%-10s %10s %10s %10s %9s %12s\n", "prezero", "mean us", "p50 us", "p99 us", "hits",
+         "zeroed MiB");
+  run("off", 0, requests, idle_us);
+  run("10% cpu", 10, requests, idle_us);
+  run("25% cpu", 25, requests, idle_us);
+  run("100% cpu", 100, requests, idle_us);
+  return 0;
+}
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "../src/lab.h"
+
+/**
+ * Measures what the sampling heap profiler costs on a malloc/free heavy
+ * trace, with sampling off and at a few sampling rates.
+ *
+ * usage: bench-prof [ops]
+ */
+
+#define SLOTS 4096
+
+static uint64_t run(struct buddy_pool *pool, size_t ops)
+{
+  static void *slot[SLOTS];
+  uint64_t seed = 7;
+  uint64_t start = bench_now_ns();
+  for (size_t n = 0; n < ops; n++)
+    {
+      size_t i = bench_rand(&seed) % SLOTS;
+      if (slot[i])
+        {
+          buddy_free(pool, slot[i]);
+          slot[i] = NULL;
+        }
+      else
+        {
+          slot[i] = buddy_malloc(pool, 16 + bench_rand(&seed) % 4096);
+        }
+    }
+  uint64_t ns = bench_now_ns() - start;
+  for (size_t i = 0; i < SLOTS; i++)
+    {
+      buddy_free(pool, slot[i]);
+      slot[i] = NULL;
+    }
+  return ns;
+}
+
+int main(int argc, char **argv)
+{
+  size_t ops = 10000000;
+  if (argc > 1)
+    ops = strtoul(argv[1], NULL, 10);
+
+  static const size_t rates[] = {0, 512 * 1024, 64 * 1024, 4096};
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << 30);
+
+  //Warm up the pool so every run starts from the same state
+  run(&pool, ops);
+  double base = 0;
+  printf("%-12s %10s %10s\n", "rate", "ns/op", "overhead");
+  for (size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++)
+    {
+      if (rates[r])
+        buddy_prof_start(&pool, rates[r]);
+      double ns = (double)run(&pool, ops) / ops;
+      if (r == 0)
+        base = ns;
+      buddy_prof_stop(&pool);
+      if (rates[r])
+        printf("%-12zu %10.2f %9.1f%%\n", rates[r], ns, 100.0 * (ns - base) / base);
+      else
+        printf("%-12s %10.2f %10s\n", "off", ns, "-");
+    }
+  buddy_destroy(&pool);
+  return 0;
+}
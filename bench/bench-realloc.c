@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "../src/lab.h"
+
+/**
+ * Grows two buffers from 1MiB to 1GiB by doubling them in turn. Each one
+ * always has the other in the way so every step has to move. Compares
+ * buddy_realloc, which moves large blocks by remapping pages, with
+ * allocating a new block, copying and freeing the old one. Buffers are
+ * filled after every step so all pages are really there, only the resize
+ * is timed.
+ *
+ * usage: bench-realloc
+ */
+
+#define MIN_SHIFT 20
+#define MAX_SHIFT 30
+
+static void *grow_copy(struct buddy_pool *pool, void *ptr, size_t old, size_t size)
+{
+  void *p = buddy_malloc(pool, size);
+  if (p != NULL)
+    {
+      memcpy(p, ptr, old);
+      buddy_free(pool, ptr);
+    }
+  return p;
+}
+
+/**
+ * @brief Time every doubling step, ns[i] is the step to 1 << (MIN_SHIFT + i)
+ */
+static void run(bool remap, uint64_t *ns)
+{
+  struct buddy_pool pool;
+  if (buddy_init_opts(&pool, UINT64_C(1) << (MAX_SHIFT + 2), NULL) == -1)
+    {
+      perror("buddy_init_opts");
+      exit(1);
+    }
+  //Minus the header so each buffer is exactly its block
+  size_t head = BUDDY_HEADER;
+  unsigned char *buf[2];
+  for (int b = 0; b < 2; b++)
+    {
+      buf[b] = buddy_malloc(&pool, (UINT64_C(1) << MIN_SHIFT) - head);
+      memset(buf[b], b + 1, (UINT64_C(1) << MIN_SHIFT) - head);
+    }
+  for (int s = MIN_SHIFT + 1; s <= MAX_SHIFT; s++)
+    {
+      ns[s - MIN_SHIFT] = 0;
+      for (int b = 0; b < 2; b++)
+        {
+          size_t old = (UINT64_C(1) << (s - 1)) - head;
+          size_t size = (UINT64_C(1) << s) - head;
+          uint64_t start = bench_now_ns();
+          unsigned char *p = remap ? buddy_realloc(&pool, buf[b], size)
+                                   : grow_copy(&pool, buf[b], old, size);
+          ns[s - MIN_SHIFT] += bench_now_ns() - start;
+          if (p == NULL)
+            {
+              fprintf(stderr, "growing to %zu bytes failed\n", size);
+              exit(1);
+            }
+          if (p[0] != b + 1 || p[old - 1] != b + 1)
+            {
+              fprintf(stderr, "data was lost growing to %zu bytes\n", size);
+              exit(1);
+            }
+          memset(p + old, b + 1, size - old);
+          buf[b] = p;
+        }
+    }
+  buddy_destroy(&pool);
+}
+
+int main(void)
+{
+  uint64_t remap[MAX_SHIFT - MIN_SHIFT + 1], copy[MAX_SHIFT - MIN_SHIFT + 1];
+  run(true, remap);
+  run(false, copy);
+  printf("%10s %16s %16s\n", "grow to", "realloc us", "copy us");
+  uint64_t total_remap = 0, total_copy = 0;
+  for (int s = MIN_SHIFT + 1; s <= MAX_SHIFT; s++)
+    {
+      printf("%7zu MiB %16.1f %16.1f\n", (UINT64_C(1) << s) >> 20,
+             (double)remap[s - MIN_SHIFT] / 2000, (double)copy[s - MIN_SHIFT] / 2000);
+      total_remap += remap[s - MIN_SHIFT];
+      total_copy += copy[s - MIN_SHIFT];
+    }
+  printf("%10s %16.1f %16.1f\n", "total ms", (double)total_remap / 1e6, (double)total_copy / 1e6);
+  return 0;
+}
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "../src/lab.h"
+
+/**
+ * Objects spread over many pools, freed without the caller remembering
+ * which pool each one came from. Compares the registry lookup with
+ * scanning the pool ranges, and buddy_free_any with buddy_free given the
+ * right pool.
+ *
+ * usage: bench-registry [pools] [objects]
+ */
+
+static struct buddy_pool *scan(struct buddy_pool *pools, size_t npools, void *ptr)
+{
+  for (size_t i = 0; i < npools; i++)
+    if ((uintptr_t)ptr - (uintptr_t)pools[i].base < pools[i].numbytes)
+      return &pools[i];
+  return NULL;
+}
+
+static void fill(struct buddy_pool *pools, size_t npools, void **obj, size_t *owner, size_t n)
+{
+  uint64_t seed = 3;
+  for (size_t i = 0; i < n; i++)
+    {
+      owner[i] = bench_rand(&seed) % npools;
+      obj[i] = buddy_malloc(&pools[owner[i]], 16 + bench_rand(&seed) % 500);
+      if (obj[i] == NULL)
+        {
+          fprintf(stderr, "allocation failed\n");
+          exit(1);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+  size_t npools = 32;
+  size_t n = 200000;
+  if (argc > 1)
+    npools = strtoul(argv[1], NULL, 10);
+  if (argc > 2)
+    n = strtoul(argv[2], NULL, 10);
+
+  struct buddy_pool *pools = calloc(npools, sizeof(struct buddy_pool));
+  for (size_t i = 0; i < npools; i++)
+    {
+      if (buddy_init_opts(&pools[i], UINT64_C(1) << 28, NULL) == -1)
+        {
+          perror("buddy_init_opts");
+          return 1;
+        }
+    }
+  void **obj = malloc(n * sizeof(void *));
+  size_t *owner = malloc(n * sizeof(size_t));
+  fill(pools, npools, obj, owner, n);
+
+  volatile uintptr_t sink = 0;
+  uint64_t start = bench_now_ns();
+  for (size_t i = 0; i < n; i++)
+    sink += (uintptr_t)buddy_owner(obj[i]);
+  double reg_ns = (double)(bench_now_ns() - start) / n;
+  start = bench_now_ns();
+  for (size_t i = 0; i < n; i++)
+    sink += (uintptr_t)scan(pools, npools, obj[i]);
+  double scan_ns = (double)(bench_now_ns() - start) / n;
+
+  start = bench_now_ns();
+  for (size_t i = 0; i < n; i++)
+    buddy_free(&pools[owner[i]], obj[i]);
+  double free_ns = (double)(bench_now_ns() - start) / n;
+  fill(pools, npools, obj, owner, n);
+  start = bench_now_ns();
+  for (size_t i = 0; i < n; i++)
+    buddy_free_any(obj[i]);
+  double any_ns = (double)(bench_now_ns() - start) / n;
+  (void)sink;
+
+  printf("%zu pools, %zu objects\n", npools, n);
+  printf("%-24s %8.1f ns\n", "buddy_owner", reg_ns);
+  printf("%-24s %8.1f ns\n", "scan of pool ranges", scan_ns);
+  printf("%-24s %8.1f ns\n", "buddy_free, pool known", free_ns);
+  printf("%-24s %8.1f ns\n", "buddy_free_any", any_ns);
+  for (size_t i = 0; i < npools; i++)
+    buddy_destroy(&pools[i]);
+  free(pools);
+  free(obj);
+  free(owner);
+  return 0;
+}
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "../src/lab.h"
+
+/**
+ * Large I/O buffers asked of a pool that small objects have fragmented.
+ * The pool is filled with objects of 1KiB to 64KiB and a random half of
+ * them is freed, leaving plenty of free memory but few large blocks. I/O
+ * buffers of 256KiB to 4MiB are then taken and given back one at a time,
+ * once as a single block with buddy_malloc and once as pieces with
+ * buddy_malloc_sg.
+ *
+ * usage: bench-sg [requests] [max pieces]
+ */
+
+#define POOL_K 28
+#define MAX_IOV 64
+
+static size_t fragment(struct buddy_pool *pool, void ***live)
+{
+  uint64_t seed = 17;
+  size_t cap = (UINT64_C(1) << POOL_K) >> 10;
+  void **obj = malloc(cap * sizeof(void *));
+  size_t n = 0;
+  while (n < cap && (obj[n] = buddy_malloc(pool, 1024 + bench_rand(&seed) % (63 * 1024))) != NULL)
+    n++;
+  for (size_t i = 0; i < n; i++)
+    {
+      if (bench_rand(&seed) & 1)
+        {
+          buddy_free(pool, obj[i]);
+          obj[i] = NULL;
+        }
+    }
+  *live = obj;
+  return n;
+}
+
+static void run(const char *name, bool sg, size_t ops, int max_iov)
+{
+  struct buddy_pool pool;
+  if (buddy_init_opts(&pool, UINT64_C(1) << POOL_K, NULL) == -1)
+    {
+      perror("buddy_init_opts");
+      exit(1);
+    }
+  void **live;
+  size_t nlive = fragment(&pool, &live);
+  struct buddy_stats st;
+  buddy_stats(&pool, &st);
+
+  struct iovec iov[MAX_IOV];
+  uint64_t seed = 29;
+  size_t served = 0, pieces = 0;
+  uint64_t start = bench_now_ns();
+  for (size_t i = 0; i < ops; i++)
+    {
+      size_t size = ((size_t)256 << 10) + bench_rand(&seed) % ((size_t)15 << 18);
+      if (sg)
+        {
+          int n = buddy_malloc_sg(&pool, size, iov, max_iov);
+          if (n > 0)
+            {
+              served++;
+              pieces += (size_t)n;
+              buddy_free_sg(&pool, iov, n);
+            }
+        }
+      else
+        {
+          void *p = buddy_malloc(&pool, size);
+          if (p != NULL)
+            {
+              served++;
+              pieces++;
+              buddy_free(&pool, p);
+            }
+        }
+    }
+  uint64_t ns = bench_now_ns() - start;
+  printf("%-10s %10.1f %12zu %10.1f%% %10.2f %10.1f\n", name, (double)st.free_bytes / (1 << 20),
+         st.largest_free_k, 100.0 * (double)served / (double)ops,
+         served ? (double)pieces / (double)served : 0.0, (double)ns / (double)ops);
+  for (size_t i = 0; i < nlive; i++)
+    buddy_free(&pool, live[i]);
+  free(live);
+  buddy_destroy(&pool);
+}
+
+int main(int argc, char **argv)
+{
+  size_t ops = 100000;
+  int max_iov = 16;
+  if (argc > 1)
+    ops = strtoul(argv[1], NULL, 10);
+  if (argc > 2)
+    max_iov = atoi(argv[2]);
+  if (max_iov < 1 || max_iov > MAX_IOV)
+    max_iov = MAX_IOV;
+
+  printf("%-10s %10s %12s %11s %10s %10s\n", "alloc", "free MiB", "largest k", "served",
+         "pieces", "ns per op");
+  run("malloc", false, ops, max_iov);
+  run("malloc_sg", true, ops, max_iov);
+  return 0;
+}
@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+#include "../src/lab.h"
+
+/**
+ * Measures how long buddy_init_opts takes and how much memory is resident
+ * afterwards for every prefault mode across pool sizes. Each measurement runs
+ * in a fresh child process so the RSS numbers do not leak between runs and a
+ * mapping the machine can not provide is reported instead of ending the run.
+ *
+ * usage: bench-startup [max prefault k]
+ *
+ * Prefault modes really commit the memory so they stop at the given k
+ * (default 30). The lazy mode always runs up to MAX_K-1.
+ */
+
+struct result
+{
+  int ok;             /*1 if init succeeded*/
+  int err;            /*errno from init*/
+  uint64_t ns;        /*Time spent in buddy_init_opts*/
+  size_t rss;         /*Resident bytes added by init*/
+};
+
+static struct result measure(int mode, size_t k)
+{
+  struct result r = {0};
+  int fds[2];
+  if (pipe(fds) == -1)
+    {
+      perror("pipe");
+      exit(1);
+    }
+
+  pid_t pid = fork();
+  if (pid == 0)
+    {
+      close(fds[0]);
+      struct buddy_opts opts = {.prefault = mode};
+      struct buddy_pool pool;
+      size_t before = bench_rss_bytes();
+      uint64_t start = bench_now_ns();
+      int rval = buddy_init_opts(&pool, UINT64_C(1) << k, &opts);
+      r.ns = bench_now_ns() - start;
+      r.ok = rval == 0;
+      r.err = errno;
+      if (r.ok)
+        {
+          r.rss = bench_rss_bytes() - before;
+          buddy_destroy(&pool);
+        }
+      if (write(fds[1], &r, sizeof(r)) != sizeof(r))
+        _exit(1);
+      _exit(0);
+    }
+
+  close(fds[1]);
+  if (pid == -1 || read(fds[0], &r, sizeof(r)) != sizeof(r))
+    {
+      //The child died before reporting, most likely the OOM killer
+      r.ok = 0;
+      r.err = ENOMEM;
+    }
+  close(fds[0]);
+  if (pid > 0)
+    waitpid(pid, NULL, 0);
+  return r;
+}
+
+int main(int argc, char **argv)
+{
+  size_t max_prefault = 30;
+  if (argc > 1)
+    max_prefault = strtoul(argv[1], NULL, 10);
+
+  static const char *names[] = {"lazy", "populate", "touch"};
+  printf("%-9s %4s %14s %14s\n", "mode", "k", "init (us)", "rss (KiB)");
+  for (int mode = BUDDY_PREFAULT_NONE; mode <= BUDDY_PREFAULT_TOUCH; mode++)
+    {
+      size_t max_k = mode == BUDDY_PREFAULT_NONE ? MAX_K - 1 : max_prefault;
+      for (size_t k = MIN_K; k <= max_k; k++)
+        {
+          struct result r = measure(mode, k);
+          if (r.ok)
+            printf("%-9s %4zu %14.1f %14zu\n", names[mode], k, r.ns / 1000.0, r.rss / 1024);
+          else
+            printf("%-9s %4zu %14s %14s (%s)\n", names[mode], k, "-", "-", strerror(r.err));
+        }
+    }
+  return 0;
+}
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "../src/lab.h"
+
+/**
+ * A string builder appending short pieces to many strings, the way a
+ * serializer or a log formatter does. Each string doubles its capacity
+ * when it runs out. One builder only knows the capacity it asked for, the
+ * other takes the usable size buddy_malloc_at_least reports and so uses
+ * the slack of every block before it has to grow.
+ *
+ * usage: bench-strbuf [strings] [length]
+ */
+
+struct strbuf
+{
+  char *data;
+  size_t len;
+  size_t cap;
+};
+
+static size_t grows;
+
+static void sb_grow(struct buddy_pool *pool, struct strbuf *sb, size_t need, bool at_least)
+{
+  size_t cap = sb->cap ? sb->cap : 16;
+  while (cap < need)
+    cap *= 2;
+  char *p = at_least ? buddy_malloc_at_least(pool, cap, &cap) : buddy_malloc(pool, cap);
+  if (p == NULL)
+    {
+      fprintf(stderr, "allocation of %zu bytes failed\n", cap);
+      exit(1);
+    }
+  memcpy(p, sb->data, sb->len);
+  buddy_free(pool, sb->data);
+  sb->data = p;
+  sb->cap = cap;
+  grows++;
+}
+
+static void sb_append(struct buddy_pool *pool, struct strbuf *sb, const char *s, size_t n,
+                      bool at_least)
+{
+  if (sb->len + n > sb->cap)
+    sb_grow(pool, sb, sb->len + n, at_least);
+  memcpy(sb->data + sb->len, s, n);
+  sb->len += n;
+}
+
+static void run(const char *name, bool at_least, size_t nstr, size_t length)
+{
+  struct buddy_pool pool;
+  if (buddy_init_opts(&pool, UINT64_C(1) << 32, NULL) == -1)
+    {
+      perror("buddy_init_opts");
+      exit(1);
+    }
+  static const char piece[] = "key=value, another_key=\"a longer quoted value\"; ";
+  struct strbuf *sb = calloc(nstr, sizeof(struct strbuf));
+  uint64_t seed = 11;
+  grows = 0;
+  uint64_t start = bench_now_ns();
+  for (size_t s = 0; s < nstr; s++)
+    {
+      size_t target = length / 2 + bench_rand(&seed) % length;
+      while (sb[s].len < target)
+        sb_append(&pool, &sb[s], piece, 1 + bench_rand(&seed) % (sizeof(piece) - 1), at_least);
+    }
+  uint64_t ns = bench_now_ns() - start;
+  size_t bytes = 0;
+  for (size_t s = 0; s < nstr; s++)
+    {
+      bytes += sb[s].len;
+      buddy_free(&pool, sb[s].data);
+    }
+  printf("%-12s %12zu %14.2f %12.1f %14.1f\n", name, grows, (double)grows / nstr,
+         (double)ns / 1e6, (double)ns / bytes * 1000);
+  free(sb);
+  buddy_destroy(&pool);
+}
+
+int main(int argc, char **argv)
+{
+  size_t nstr = 100000;
+  size_t length = 2000;
+  if (argc > 1)
+    nstr = strtoul(argv[1], NULL, 10);
+  if (argc > 2)
+    length = strtoul(argv[2], NULL, 10);
+
+  printf("%-12s %12s %14s %12s %14s\n", "capacity", "reallocs", "per string", "total ms",
+         "ps per byte");
+  run("asked", false, nstr, length);
+  run("at least", true, nstr, length);
+  return 0;
+}
@@ -0,0 +1,200 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "bench.h"
+#include "../src/lab.h"
+
+/**
+ * Random reads from a local file through io_uring into blocks of a pool,
+ * once with plain IORING_OP_READ, where the kernel pins and unpins the
+ * pages of every buffer, and once with IORING_OP_READ_FIXED after the
+ * pool was registered with buddy_uring_register. The file is opened with
+ * O_DIRECT so the reads go to the device and not the page cache, it falls
+ * back to buffered reads where O_DIRECT is not supported, on tmpfs say.
+ * A headerless pool hands out block starts, so buffers are aligned for
+ * O_DIRECT. The ring is set up with raw syscalls, no liburing needed.
+ *
+ * usage: bench-uring [file] [reads] [block bytes]
+ */
+
+#define FILE_BYTES (UINT64_C(64) << 20)
+#define DEPTH 32
+
+struct ring
+{
+  int fd;
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+};
+
+static void *ring_map(int fd, size_t len, off_t off)
+{
+  void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, off);
+  if (p == MAP_FAILED)
+    {
+      perror("mmap ring");
+      exit(1);
+    }
+  return p;
+}
+
+static void ring_init(struct ring *r)
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  r->fd = (int)syscall(__NR_io_uring_setup, DEPTH, &p);
+  if (r->fd < 0)
+    {
+      perror("io_uring_setup");
+      exit(1);
+    }
+  char *sq = ring_map(r->fd, p.sq_off.array + p.sq_entries * sizeof(unsigned), IORING_OFF_SQ_RING);
+  char *cq = ring_map(r->fd, p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe),
+                      IORING_OFF_CQ_RING);
+  r->sqes = ring_map(r->fd, p.sq_entries * sizeof(struct io_uring_sqe), IORING_OFF_SQES);
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+}
+
+/**
+ * @brief Read DEPTH blocks at random offsets and wait for all of them
+ */
+static void read_round(struct buddy_pool *pool, struct ring *r, int fd, char **buf, size_t bs,
+                       bool fixed, uint64_t *seed)
+{
+  unsigned tail = *r->sq_tail;
+  for (unsigned i = 0; i < DEPTH; i++)
+    {
+      unsigned idx = (tail + i) & *r->sq_mask;
+      struct io_uring_sqe *sqe = &r->sqes[idx];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+      sqe->fd = fd;
+      sqe->addr = (uintptr_t)buf[i];
+      sqe->len = (unsigned)bs;
+      sqe->off = bench_rand(seed) % (FILE_BYTES / bs) * bs;
+      sqe->user_data = i;
+      if (fixed)
+        sqe->buf_index = (unsigned short)buddy_uring_index(pool, buf[i], bs, NULL);
+      r->sq_array[idx] = idx;
+    }
+  __atomic_store_n(r->sq_tail, tail + DEPTH, __ATOMIC_RELEASE);
+  if (syscall(__NR_io_uring_enter, r->fd, DEPTH, DEPTH, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+    {
+      perror("io_uring_enter");
+      exit(1);
+    }
+  unsigned head = *r->cq_head;
+  unsigned done = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != done; head++)
+    {
+      struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+      if (cqe->res != (int)bs)
+        {
+          fprintf(stderr, "read %llu returned %d\n", (unsigned long long)cqe->user_data, cqe->res);
+          exit(1);
+        }
+    }
+  __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static double run(struct buddy_pool *pool, int fd, char **buf, size_t bs, size_t reads, bool fixed)
+{
+  struct ring r;
+  ring_init(&r);
+  if (fixed && buddy_uring_register(pool, r.fd, 0) == -1)
+    {
+      perror("buddy_uring_register");
+      exit(1);
+    }
+  uint64_t seed = 13;
+  uint64_t start = bench_now_ns();
+  for (size_t done = 0; done < reads; done += DEPTH)
+    read_round(pool, &r, fd, buf, bs, fixed, &seed);
+  uint64_t ns = bench_now_ns() - start;
+  if (fixed)
+    buddy_uring_unregister(pool);
+  close(r.fd);
+  return (double)ns / (double)reads;
+}
+
+int main(int argc, char **argv)
+{
+  const char *path = "bench-uring.dat";
+  size_t reads = 200000;
+  size_t bs = 16384;
+  if (argc > 1)
+    path = argv[1];
+  if (argc > 2)
+    reads = strtoul(argv[2], NULL, 10);
+  if (argc > 3)
+    bs = strtoul(argv[3], NULL, 10);
+
+  struct buddy_pool pool;
+  struct buddy_opts opts = {.engine = BUDDY_ENGINE_TREE, .headerless = true};
+  if (buddy_init_opts(&pool, UINT64_C(1) << 26, &opts) == -1)
+    {
+      perror("buddy_init_opts");
+      return 1;
+    }
+  char *buf[DEPTH];
+  for (int i = 0; i < DEPTH; i++)
+    {
+      buf[i] = buddy_malloc(&pool, bs);
+      if (buf[i] == NULL)
+        {
+          fprintf(stderr, "allocation failed\n");
+          return 1;
+        }
+    }
+
+  //Write the file through the pool too
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1)
+    {
+      perror(path);
+      return 1;
+    }
+  for (uint64_t off = 0; off < FILE_BYTES; off += bs)
+    {
+      memset(buf[0], (int)(off / bs), bs);
+      if (pwrite(fd, buf[0], bs, (off_t)off) != (ssize_t)bs)
+        {
+          perror("pwrite");
+          return 1;
+        }
+    }
+  fsync(fd);
+  close(fd);
+  const char *mode = "O_DIRECT";
+  fd = open(path, O_RDONLY | O_DIRECT);
+  if (fd == -1)
+    {
+      mode = "buffered";
+      fd = open(path, O_RDONLY);
+    }
+
+  printf("%s reads of %zu bytes, %d in flight\n", mode, bs, DEPTH);
+  printf("%-12s %12s\n", "buffers", "ns per read");
+  printf("%-12s %12.1f\n", "unregistered", run(&pool, fd, buf, bs, reads, false));
+  printf("%-12s %12.1f\n", "fixed", run(&pool, fd, buf, bs, reads, true));
+  close(fd);
+  unlink(path);
+  for (int i = 0; i < DEPTH; i++)
+    buddy_free(&pool, buf[i]);
+  buddy_destroy(&pool);
+  return 0;
+}
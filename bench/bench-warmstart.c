@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "../src/lab.h"
+
+/**
+ * Latency of the first requests a freshly started pool sees. A service
+ * style mix of mostly small requests with a few larger ones is run on a
+ * cold pool, on a pool presplit from the profile the cold run saved, and
+ * once more on the cold pool after everything was freed for steady state.
+ *
+ * usage: bench-warmstart [requests]
+ */
+
+#define LIVE 4096
+
+static int cmp_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static size_t request_size(uint64_t *seed)
+{
+  uint64_t r = bench_rand(seed) % 100;
+  if (r < 70)
+    return 16 + bench_rand(seed) % 240;
+  if (r < 95)
+    return 256 + bench_rand(seed) % 3840;
+  return 4096 + bench_rand(seed) % 61440;
+}
+
+static void run(const char *name, struct buddy_pool *pool, size_t requests)
+{
+  static void *live[LIVE];
+  uint64_t *lat = malloc(requests * sizeof(uint64_t));
+  uint64_t seed = 17;
+  uint64_t total = 0;
+  for (size_t i = 0; i < requests; i++)
+    {
+      size_t slot = bench_rand(&seed) % LIVE;
+      buddy_free(pool, live[slot]);
+      size_t size = request_size(&seed);
+      uint64_t start = bench_now_ns();
+      live[slot] = buddy_malloc(pool, size);
+      lat[i] = bench_now_ns() - start;
+      total += lat[i];
+    }
+  for (size_t i = 0; i < LIVE; i++)
+    {
+      buddy_free(pool, live[i]);
+      live[i] = NULL;
+    }
+  qsort(lat, requests, sizeof(uint64_t), cmp_u64);
+  printf("%-8s %10.0f %10lu %10lu %10lu\n", name, (double)total / requests,
+         (unsigned long)lat[requests / 2], (unsigned long)lat[requests * 99 / 100],
+         (unsigned long)lat[requests - 1]);
+  free(lat);
+}
+
+int main(int argc, char **argv)
+{
+  size_t requests = 5000;
+  if (argc > 1)
+    requests = strtoul(argv[1], NULL, 10);
+
+  struct buddy_pool cold, warm;
+  if (buddy_init_opts(&cold, UINT64_C(1) << 30, NULL) == -1)
+    {
+      perror("buddy_init_opts");
+      return 1;
+    }
+  printf("%-8s %10s %10s %10s %10s\n", "pool", "mean ns", "p50 ns", "p99 ns", "max ns");
+  run("cold", &cold, requests);
+
+  FILE *profile = tmpfile();
+  struct buddy_opts opts = {0};
+  if (profile == NULL || buddy_profile_save(&cold, profile) == -1)
+    {
+      perror("buddy_profile_save");
+      return 1;
+    }
+  rewind(profile);
+  if (buddy_profile_load(profile, &opts) == -1)
+    {
+      perror("buddy_profile_load");
+      return 1;
+    }
+  fclose(profile);
+  uint64_t start = bench_now_ns();
+  if (buddy_init_opts(&warm, UINT64_C(1) << 30, &opts) == -1)
+    {
+      perror("buddy_init_opts");
+      return 1;
+    }
+  uint64_t init_ns = bench_now_ns() - start;
+  run("warm", &warm, requests);
+  run("steady", &cold, requests);
+  printf("presplit init took %.1f us\n", (double)init_ns / 1000);
+  buddy_destroy(&warm);
+  buddy_destroy(&cold);
+  return 0;
+}
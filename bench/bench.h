@@ -0,0 +1,52 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Small helpers shared by the benchmark programs. Everything is static so
+ * each benchmark stays a single translation unit.
+ */
+
+/**
+ * @brief Monotonic clock in nanoseconds
+ */
+static inline uint64_t bench_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Resident set size of this process in bytes, 0 if unknown
+ */
+static inline size_t bench_rss_bytes(void)
+{
+  unsigned long size = 0, resident = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f == NULL)
+    return 0;
+  if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+    resident = 0;
+  fclose(f);
+  return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * @brief Small xorshift generator so benchmarks are repeatable and do not
+ * pay for rand() locking.
+ */
+static inline uint64_t bench_rand(uint64_t *state)
+{
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdbool.h>
 #include <sys/mman.h>
@@ -8,6 +9,11 @@
 #include <execinfo.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #ifdef __APPLE__
 #include <sys/errno.h>
 #else
@@ -16,6 +22,35 @@
 
 #include "lab.h"
 
+#ifdef BUDDY_HAVE_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#define BLOCK_F_SAMPLED 0x1  /*Allocated block has a heap profile sample*/
+#define BLOCK_F_EXACT   0x2  /*Allocated block was trimmed to its request, next is its end*/
+
+#define MALLOC_WHOLE 0x100   /*malloc_locked: keep the whole block so it can be moved*/
+
+/*
+ * USDT probes for perf and bpftrace under the provider "buddy". Each probe
+ * is a nop plus an ELF note so they cost nothing until traced. Without
+ * <sys/sdt.h> (see BUDDY_HAVE_SDT) they compile to nothing.
+ */
+#ifdef BUDDY_HAVE_SDT
+#include <sys/sdt.h>
+#define buddy_probe1(name, a) DTRACE_PROBE1(buddy, name, a)
+#define buddy_probe2(name, a, b) DTRACE_PROBE2(buddy, name, a, b)
+#define buddy_probe3(name, a, b, c) DTRACE_PROBE3(buddy, name, a, b, c)
+#define buddy_probe4(name, a, b, c, d) DTRACE_PROBE4(buddy, name, a, b, c, d)
+#else
+//sizeof keeps the arguments "used" without evaluating them
+#define buddy_probe1(name, a) ((void)sizeof(a))
+#define buddy_probe2(name, a, b) ((void)sizeof(a), (void)sizeof(b))
+#define buddy_probe3(name, a, b, c) ((void)sizeof(a), (void)sizeof(b), (void)sizeof(c))
+#define buddy_probe4(name, a, b, c, d) ((void)sizeof(a), (void)sizeof(b), (void)sizeof(c), (void)sizeof(d))
+#endif
+
 #define handle_error_and_die(msg) \
     do                            \
     {                             \
@@ -24,249 +59,3658 @@
     } while (0)
 
 /**
- * @brief Convert bytes to the correct K value
+ * @brief Take pool->lock. While the prezero thread runs it is told first
+ * so it gets out of the way.
+ */
+static inline void pool_lock(struct buddy_pool *pool)
+{
+    if (__builtin_expect(__atomic_load_n(&pool->prezero_on, __ATOMIC_RELAXED), 0))
+        __atomic_store_n(&pool->prezero_yield, true, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&pool->lock);
+}
+
+/**
+ * @brief Convert bytes to the correct K value
+ *
+ * @param bytes the number of bytes
+ * @return size_t the K value that will fit bytes
+ */
+size_t btok(size_t bytes)
+{
+    if(bytes <= 1) return 0;
+
+    //Smallest k with 2^k >= bytes
+    return (size_t)(64 - __builtin_clzll((unsigned long long)(bytes - 1)));
+}
+
+/**
+ * @brief Address of the buddy of a block of order k, or NULL for the top
+ * level block. Unlike buddy_calc this never writes to the buddy.
+ */
+static inline struct avail *buddy_of(struct buddy_pool *pool, void *block, size_t k)
+{
+    uintptr_t addr = (uintptr_t)((char *)block - (char *)pool->base);
+    uintptr_t buddy_addr = addr ^ (UINT64_C(1) << k);
+    if (buddy_addr >= (uintptr_t)pool->numbytes)
+        return NULL;
+    return (struct avail *)((char *)pool->base + buddy_addr);
+}
+
+struct avail *buddy_calc(struct buddy_pool *pool, struct avail *buddy)
+{
+    if (buddy == NULL)
+    {
+        fprintf(stderr, "buddy_calc: Buddy is NULL\n");
+        return NULL;
+    }
+
+    int k = buddy->kval;
+    struct avail *buddy_block = buddy_of(pool, buddy, k);
+    if (buddy_block == NULL)
+    {
+        return NULL; // The top level block has no buddy
+    }
+
+    buddy_block->tag = BLOCK_AVAIL;
+    buddy_block->kval = k;
+    return buddy_block;
+}
+
+/*
+ * Free block bitmaps for BUDDY_POLICY_ADDRESS. Order k has one bit for each
+ * of the 2^(kval_m - k) places a block of order k can start. Above the leaf
+ * bits sit summary levels where a bit is set when the 64 bit word below it
+ * is non zero, up to a single top word, so the lowest free block is found
+ * with one count trailing zeros per level. Levels are stored top first.
+ */
+#define BITS_MAX_LEVELS 8  /*Enough for 2^(MAX_K - SMALLEST_K) bits*/
+
+static inline size_t bits_levels(size_t m)
+{
+    return m <= 6 ? 1 : (m + 5) / 6;
+}
+
+/**
+ * @brief Words in level l of a bitmap with 2^m leaf bits and n levels
+ */
+static inline size_t bits_words(size_t m, size_t n, size_t l)
+{
+    size_t shift = 6 * (n - l);
+    return m > shift ? (size_t)1 << (m - shift) : 1;
+}
+
+/**
+ * @brief Words needed by the bitmap of an order with 2^m leaf bits
+ */
+static size_t bits_size(size_t m)
+{
+    size_t n = bits_levels(m), words = 0;
+    for (size_t l = 0; l < n; l++)
+        words += bits_words(m, n, l);
+    return words;
+}
+
+/**
+ * @brief Fill level with the first word of each level of order k
+ * @return The number of levels
+ */
+static inline size_t bits_level_ptrs(struct buddy_pool *pool, size_t k, uint64_t **level)
+{
+    size_t m = pool->kval_m - k, n = bits_levels(m);
+    uint64_t *w = pool->free_bits[k];
+    for (size_t l = 0; l < n; l++)
+    {
+        level[l] = w;
+        w += bits_words(m, n, l);
+    }
+    return n;
+}
+
+static void bits_set(struct buddy_pool *pool, struct avail *block, size_t k)
+{
+    uint64_t *level[BITS_MAX_LEVELS];
+    size_t l = bits_level_ptrs(pool, k, level);
+    uintptr_t i = (uintptr_t)((char *)block - (char *)pool->base) >> k;
+    while (l-- > 0)
+    {
+        uint64_t old = level[l][i >> 6];
+        level[l][i >> 6] = old | (UINT64_C(1) << (i & 63));
+        if (old != 0)
+            break;
+        i >>= 6;
+    }
+}
+
+static void bits_clear(struct buddy_pool *pool, struct avail *block, size_t k)
+{
+    uint64_t *level[BITS_MAX_LEVELS];
+    size_t l = bits_level_ptrs(pool, k, level);
+    uintptr_t i = (uintptr_t)((char *)block - (char *)pool->base) >> k;
+    while (l-- > 0)
+    {
+        level[l][i >> 6] &= ~(UINT64_C(1) << (i & 63));
+        if (level[l][i >> 6] != 0)
+            break;
+        i >>= 6;
+    }
+}
+
+/**
+ * @brief The lowest addressed free block of order k, which must have one
+ */
+static struct avail *bits_first(struct buddy_pool *pool, size_t k)
+{
+    uint64_t *level[BITS_MAX_LEVELS];
+    size_t n = bits_level_ptrs(pool, k, level);
+    uintptr_t i = 0;
+    for (size_t l = 0; l < n; l++)
+        i = (i << 6) + (uintptr_t)__builtin_ctzll(level[l][i]);
+    return (struct avail *)((char *)pool->base + (i << k));
+}
+
+/*
+ * List engine. Free blocks carry their own header and are threaded onto the
+ * circular list pool->avail[k] for their k value.
+ */
+
+/**
+ * @brief Push a block onto the head of the avail list for k.
+ */
+static inline void avail_push(struct buddy_pool *pool, struct avail *block, size_t k)
+{
+    struct avail *head = &pool->avail[k];
+    block->tag = BLOCK_AVAIL;
+    block->kval = k;
+    block->next = head->next;
+    block->prev = avail_to_link(pool, head);
+    avail_from_link(pool, head->next)->prev = avail_to_link(pool, block);
+    head->next = avail_to_link(pool, block);
+    pool->nfree[k]++;
+    if (pool->policy == BUDDY_POLICY_ADDRESS)
+        bits_set(pool, block, k);
+}
+
+/**
+ * @brief Is the avail list for k empty
+ */
+static inline bool avail_empty(struct buddy_pool *pool, size_t k)
+{
+    return avail_from_link(pool, pool->avail[k].next) == &pool->avail[k];
+}
+
+/**
+ * @brief Remove a block from whichever avail list it is on.
+ */
+static inline void avail_unlink(struct buddy_pool *pool, struct avail *block)
+{
+    avail_from_link(pool, block->prev)->next = block->next;
+    avail_from_link(pool, block->next)->prev = block->prev;
+    pool->nfree[block->kval]--;
+    if (pool->policy == BUDDY_POLICY_ADDRESS)
+        bits_clear(pool, block, block->kval);
+}
+
+static struct avail *list_alloc(struct buddy_pool *pool, size_t kval)
+{
+    //R1 Find the first available block that is >= kval
+    size_t j = kval;
+    while (j <= pool->kval_m && avail_empty(pool, j))
+        j++;
+    if (j > pool->kval_m)
+        return NULL;
+
+    //R2 Remove from list, the bitmap knows which one is lowest
+    struct avail *l = avail_from_link(pool, pool->avail[j].next);
+    if (pool->policy == BUDDY_POLICY_ADDRESS)
+        l = bits_first(pool, j);
+    avail_unlink(pool, l);
+
+    //R4 Split the block, keeping the lower half and freeing the upper
+    while (j > kval)
+    {
+        j--;
+        l->kval = j;
+        buddy_probe3(malloc_split, pool, l, j);
+        avail_push(pool, buddy_of(pool, l, j), j);
+    }
+    l->tag = BLOCK_RESERVED;
+    l->flags = 0;
+    return l;
+}
+
+static size_t list_free(struct buddy_pool *pool, struct avail *block, size_t k)
+{
+    //S1 Is buddy available?
+    while (k < pool->kval_m)
+    {
+        struct avail *buddy = buddy_of(pool, block, k);
+        if (buddy->tag != BLOCK_AVAIL || buddy->kval != k)
+            break;
+
+        //S2 Combine with buddy, the upper header ends up inside the merged
+        //block so zero it to keep a clean block clean for buddy_calloc
+        avail_unlink(pool, buddy);
+        struct avail *upper = buddy > block ? buddy : block;
+        if (buddy < block)
+            block = buddy;
+        memset(upper, 0, sizeof(struct avail));
+        k++;
+        block->kval = k;
+        buddy_probe3(free_merge, pool, block, k);
+    }
+
+    //S3 Put on list
+    buddy_probe3(free_done, pool, block, k);
+    avail_push(pool, block, k);
+    return k;
+}
+
+/*
+ * Tree engine. Free space is described by an implicit binary tree that lives
+ * in its own mapping, one byte per node with the root at index 1 and the
+ * children of node i at 2i and 2i+1. A node of order o stores o minus the
+ * largest free order in its subtree, so a zeroed mapping describes a
+ * completely free pool and only the nodes we walk are ever faulted in.
+ * Free blocks are never touched, only allocated blocks get a header.
+ */
+#define TREE_ALLOC 0xFE  /*Node was handed out as a whole block*/
+#define TREE_FULL  0xFF  /*Nothing is free below this node*/
+
+/**
+ * @brief Largest free order below a node, or -1 if nothing is free
+ */
+static inline int tree_largest(unsigned char v, size_t o)
+{
+    return v >= TREE_ALLOC ? -1 : (int)o - (int)v;
+}
+
+/**
+ * @brief The value of a node of order o given its two children
+ */
+static inline unsigned char tree_combine(unsigned char l, unsigned char r, size_t o)
+{
+    int ll = tree_largest(l, o - 1);
+    int lr = tree_largest(r, o - 1);
+    int m = ll > lr ? ll : lr;
+    return m < 0 ? TREE_FULL : (unsigned char)(o - m);
+}
+
+static inline size_t tree_index(struct buddy_pool *pool, uintptr_t off, size_t k)
+{
+    return (UINT64_C(1) << (pool->kval_m - k)) + (off >> k);
+}
+
+/**
+ * @brief Address of the block described by node i of order k
+ */
+static inline struct avail *tree_block(struct buddy_pool *pool, size_t i, size_t k)
+{
+    uintptr_t off = (uintptr_t)(i - (UINT64_C(1) << (pool->kval_m - k))) << k;
+    return (struct avail *)((char *)pool->base + off);
+}
+
+/**
+ * @brief Recompute the ancestors of node i (order k) after it changed,
+ * stopping as soon as a node keeps its old value.
+ * @return The order of the free block node i ended up in after merging
+ */
+static size_t tree_update(struct buddy_pool *pool, size_t i, size_t k)
+{
+    unsigned char *tree = pool->tree;
+    size_t merged = k;
+    for (size_t o = k + 1; i > 1; o++)
+    {
+        i >>= 1;
+        unsigned char l = tree[2 * i], r = tree[2 * i + 1];
+        unsigned char v;
+        if (l == 0 && r == 0)
+        {
+            //Both halves free so they merge into one block of order o
+            pool->nfree[o - 1] -= 2;
+            pool->nfree[o]++;
+            merged = o;
+            buddy_probe3(free_merge, pool, tree_block(pool, i, o), o);
+            v = 0;
+        }
+        else
+        {
+            v = tree_combine(l, r, o);
+        }
+        if (tree[i] == v)
+            break;
+        tree[i] = v;
+    }
+    return merged;
+}
+
+static struct avail *tree_alloc(struct buddy_pool *pool, size_t kval)
+{
+    unsigned char *tree = pool->tree;
+    if (tree_largest(tree[1], pool->kval_m) < (int)kval)
+        return NULL;
+
+    size_t i = 1;
+    for (size_t o = pool->kval_m; o > kval; o--)
+    {
+        if (tree[i] == 0)
+        {
+            //Splitting a free block, both children start out free
+            pool->nfree[o]--;
+            pool->nfree[o - 1] += 2;
+            buddy_probe3(malloc_split, pool, tree_block(pool, i, o), o - 1);
+        }
+        i = 2 * i;
+        if (tree_largest(tree[i], o - 1) < (int)kval)
+            i++;
+    }
+    tree[i] = TREE_ALLOC;
+    pool->nfree[kval]--;
+    tree_update(pool, i, kval);
+
+    struct avail *block = tree_block(pool, i, kval);
+    if (!pool->headerless)
+    {
+        block->tag = BLOCK_RESERVED;
+        block->kval = kval;
+        block->flags = 0;
+    }
+    return block;
+}
+
+static int tree_free(struct buddy_pool *pool, struct avail *block, size_t k)
+{
+    uintptr_t off = (uintptr_t)((char *)block - (char *)pool->base);
+    size_t i = tree_index(pool, off, k);
+    if (pool->tree[i] != TREE_ALLOC)
+        return -1;
+    pool->tree[i] = 0;
+    pool->nfree[k]++;
+    size_t merged = tree_update(pool, i, k);
+    buddy_probe3(free_done, pool, tree_block(pool, tree_index(pool, off, merged), merged), merged);
+    return (int)merged;
+}
+
+/*
+ * Sampling heap profiler. When enabled every allocation has a chance of
+ * being sampled proportional to its size, on average once every prof->rate
+ * bytes. A sample records the call stack of the allocation, it is counted
+ * towards its stack in the cumulative profile and kept in a live table
+ * until the block is freed.
+ */
+#define PROF_DEPTH 64       /*Deepest stack we record*/
+#define PROF_BUCKETS 1024   /*Hash heads for distinct stacks*/
+
+/**
+ * Everything sampled from one call stack.
+ */
+struct prof_bucket
+{
+    struct prof_bucket *next;   /*Next bucket in the hash chain*/
+    uint64_t hash;              /*Hash of the stack*/
+    int depth;                  /*Number of frames in pc*/
+    void *pc[PROF_DEPTH];       /*Return addresses, innermost first*/
+    size_t alloc_count;         /*Samples ever taken*/
+    size_t alloc_bytes;         /*Bytes of the samples ever taken*/
+    size_t live_count;          /*Samples not freed yet*/
+    size_t live_bytes;          /*Bytes of the samples not freed yet*/
+};
+
+/**
+ * A sampled block that has not been freed yet.
+ */
+struct prof_live
+{
+    struct prof_live *next;     /*Next sample in the hash chain*/
+    void *ptr;                  /*User pointer of the block*/
+    size_t size;                /*Requested size*/
+    struct prof_bucket *bucket; /*Stack the block was allocated from*/
+};
+
+struct buddy_prof
+{
+    size_t rate;                /*Mean bytes between samples*/
+    uint64_t rng;               /*State of the sampling generator*/
+    struct prof_bucket *buckets[PROF_BUCKETS]; /*Stacks by hash*/
+    struct prof_live **live;    /*Live samples by address*/
+    size_t nlive_heads;         /*Size of the live hash table, a power of two*/
+    size_t nlive;               /*Number of live samples*/
+};
+
+static inline size_t prof_ptr_hash(struct buddy_prof *prof, void *ptr)
+{
+    uint64_t x = (uint64_t)(uintptr_t)ptr * UINT64_C(0x9E3779B97F4A7C15);
+    return (size_t)(x >> 32) & (prof->nlive_heads - 1);
+}
+
+/**
+ * @brief Bytes until the next sample, exponentially distributed with mean
+ * prof->rate so that samples form a Poisson process over allocated bytes.
+ */
+static int64_t prof_next(struct buddy_prof *prof)
+{
+    uint64_t x = prof->rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    prof->rng = x;
+    //53 random bits as a double in (0, 1]
+    double u = ((x >> 11) + 1) * (1.0 / 9007199254740992.0);
+    double n = -log(u) * (double)prof->rate;
+    return n > (double)INT64_MAX / 2 ? INT64_MAX / 2 : (int64_t)n + 1;
+}
+
+static void prof_grow_live(struct buddy_prof *prof)
+{
+    size_t heads = prof->nlive_heads * 2;
+    struct prof_live **live = calloc(heads, sizeof(struct prof_live *));
+    if (live == NULL)
+        return; //Keep the longer chains
+    struct prof_live **old = prof->live;
+    size_t nold = prof->nlive_heads;
+    prof->live = live;
+    prof->nlive_heads = heads;
+    for (size_t i = 0; i < nold; i++)
+    {
+        while (old[i])
+        {
+            struct prof_live *l = old[i];
+            old[i] = l->next;
+            size_t h = prof_ptr_hash(prof, l->ptr);
+            l->next = live[h];
+            live[h] = l;
+        }
+    }
+    free(old);
+}
+
+#if defined(BUDDY_PROF_FRAME_POINTERS) && (defined(__x86_64__) || defined(__aarch64__))
+/**
+ * Bounds of the current thread's stack, looked up once per thread.
+ */
+static __thread uintptr_t stack_lo, stack_hi;
+
+/**
+ * @brief Walk the frame pointer chain. This is an order of magnitude faster
+ * than backtrace() but only sees callers built with frame pointers, so every
+ * frame is checked to stay inside our own stack and to move towards its
+ * base before it is read.
+ *
+ * @return The number of return addresses stored in pc
+ */
+static __attribute__((noinline)) int prof_unwind(void **pc, int max)
+{
+    if (stack_hi == 0)
+    {
+        pthread_attr_t attr;
+        void *addr;
+        size_t len;
+        if (pthread_getattr_np(pthread_self(), &attr) != 0)
+            return backtrace(pc, max);
+        pthread_attr_getstack(&attr, &addr, &len);
+        pthread_attr_destroy(&attr);
+        stack_lo = (uintptr_t)addr;
+        stack_hi = (uintptr_t)addr + len;
+    }
+
+    //Each frame holds the caller's frame pointer followed by the return address
+    uintptr_t *fp = __builtin_frame_address(0);
+    int depth = 0;
+    while (depth < max)
+    {
+        uintptr_t f = (uintptr_t)fp;
+        if (f < stack_lo || f + 2 * sizeof(uintptr_t) > stack_hi || (f & (sizeof(uintptr_t) - 1)))
+            break;
+        uintptr_t ret = fp[1];
+        uintptr_t next = fp[0];
+        if (ret == 0)
+            break;
+        pc[depth++] = (void *)ret;
+        if (next <= f)
+            break;
+        fp = (uintptr_t *)next;
+    }
+    return depth;
+}
+#else
+#define prof_unwind(pc, max) backtrace(pc, max)
+#endif
+
+/**
+ * @brief Record a sample for ptr. Kept out of line so the common path of
+ * buddy_malloc stays small, and so we know how many frames to skip.
+ */
+static __attribute__((noinline)) void prof_sample(struct buddy_pool *pool, void *ptr, size_t size)
+{
+    struct buddy_prof *prof = pool->prof;
+    void *pc[PROF_DEPTH + 2];
+    int depth = prof_unwind(pc, PROF_DEPTH + 2);
+    //Drop prof_sample and buddy_malloc themselves
+    int skip = depth > 2 ? 2 : 0;
+    depth -= skip;
+
+    uint64_t hash = UINT64_C(1469598103934665603);
+    for (int i = 0; i < depth; i++)
+        hash = (hash ^ (uint64_t)(uintptr_t)pc[skip + i]) * UINT64_C(1099511628211);
+
+    struct prof_bucket **head = &prof->buckets[hash % PROF_BUCKETS];
+    struct prof_bucket *b = *head;
+    while (b && (b->hash != hash || b->depth != depth || memcmp(b->pc, pc + skip, depth * sizeof(void *))))
+        b = b->next;
+    if (b == NULL)
+    {
+        b = calloc(1, sizeof(struct prof_bucket));
+        if (b == NULL)
+            return;
+        b->hash = hash;
+        b->depth = depth;
+        memcpy(b->pc, pc + skip, depth * sizeof(void *));
+        b->next = *head;
+        *head = b;
+    }
+
+    struct prof_live *l = malloc(sizeof(struct prof_live));
+    if (l == NULL)
+        return;
+    b->alloc_count++;
+    b->alloc_bytes += size;
+    b->live_count++;
+    b->live_bytes += size;
+    l->ptr = ptr;
+    l->size = size;
+    l->bucket = b;
+    size_t h = prof_ptr_hash(prof, ptr);
+    l->next = prof->live[h];
+    prof->live[h] = l;
+    if (++prof->nlive > 2 * prof->nlive_heads)
+        prof_grow_live(prof);
+}
+
+/**
+ * @brief Find the live sample for ptr and unlink it from the live table.
+ * @return The sample or NULL if ptr was not sampled
+ */
+static struct prof_live *prof_take(struct buddy_prof *prof, void *ptr)
+{
+    struct prof_live **l = &prof->live[prof_ptr_hash(prof, ptr)];
+    while (*l && (*l)->ptr != ptr)
+        l = &(*l)->next;
+    struct prof_live *found = *l;
+    if (found)
+    {
+        *l = found->next;
+        prof->nlive--;
+    }
+    return found;
+}
+
+/**
+ * @brief A block is being freed, drop its sample if it has one.
+ */
+static void prof_drop(struct buddy_pool *pool, void *ptr)
+{
+    struct prof_live *l = prof_take(pool->prof, ptr);
+    if (l == NULL)
+        return;
+    l->bucket->live_count--;
+    l->bucket->live_bytes -= l->size;
+    free(l);
+}
+
+/**
+ * @brief A sampled block moved from old to ptr, keep tracking it.
+ */
+static void prof_move(struct buddy_pool *pool, void *old, void *ptr)
+{
+    struct buddy_prof *prof = pool->prof;
+    struct prof_live *l = prof_take(prof, old);
+    if (l == NULL)
+        return;
+    l->ptr = ptr;
+    size_t h = prof_ptr_hash(prof, ptr);
+    l->next = prof->live[h];
+    prof->live[h] = l;
+    prof->nlive++;
+}
+
+/**
+ * @brief Release everything a profiler recorded
+ */
+static void prof_free(struct buddy_prof *prof)
+{
+    if (prof == NULL)
+        return;
+    for (size_t i = 0; i < prof->nlive_heads; i++)
+    {
+        while (prof->live[i])
+        {
+            struct prof_live *l = prof->live[i];
+            prof->live[i] = l->next;
+            free(l);
+        }
+    }
+    for (size_t i = 0; i < PROF_BUCKETS; i++)
+    {
+        while (prof->buckets[i])
+        {
+            struct prof_bucket *b = prof->buckets[i];
+            prof->buckets[i] = b->next;
+            free(b);
+        }
+    }
+    free(prof->live);
+    free(prof);
+}
+
+int buddy_prof_start(struct buddy_pool *pool, size_t rate)
+{
+    if (pool == NULL || rate == 0 || pool->headerless)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct buddy_prof *prof = calloc(1, sizeof(struct buddy_prof));
+    if (prof == NULL)
+        return -1;
+    prof->nlive_heads = 1024;
+    prof->live = calloc(prof->nlive_heads, sizeof(struct prof_live *));
+    if (prof->live == NULL)
+    {
+        free(prof);
+        return -1;
+    }
+    prof->rate = rate;
+    prof->rng = (uint64_t)(uintptr_t)pool ^ (uint64_t)time(NULL) ^ UINT64_C(0x2545F4914F6CDD1D);
+    if (prof->rng == 0)
+        prof->rng = 1;
+
+    //The first backtrace loads the unwinder, do not pay that in buddy_malloc
+    void *pc[1];
+    prof_unwind(pc, 1);
+
+    //Restarting throws away the old profile
+    pool_lock(pool);
+    struct buddy_prof *old = pool->prof;
+    pool->prof_left = prof_next(prof);
+    pool->prof = prof;
+    pthread_mutex_unlock(&pool->lock);
+    prof_free(old);
+    return 0;
+}
+
+void buddy_prof_stop(struct buddy_pool *pool)
+{
+    pool_lock(pool);
+    struct buddy_prof *prof = pool->prof;
+    pool->prof = NULL;
+    pthread_mutex_unlock(&pool->lock);
+    prof_free(prof);
+}
+
+int buddy_prof_dump(struct buddy_pool *pool, FILE *out)
+{
+    if (out == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    pool_lock(pool);
+    struct buddy_prof *prof = pool->prof;
+    if (prof == NULL)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t live_count = 0, live_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+    for (size_t i = 0; i < PROF_BUCKETS; i++)
+    {
+        for (struct prof_bucket *b = prof->buckets[i]; b; b = b->next)
+        {
+            live_count += b->live_count;
+            live_bytes += b->live_bytes;
+            alloc_count += b->alloc_count;
+            alloc_bytes += b->alloc_bytes;
+        }
+    }
+
+    //Legacy gperftools heap profile. heap_v2 tells pprof the counts are
+    //raw samples taken at the given rate so it can scale them back up.
+    fprintf(out, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+            live_count, live_bytes, alloc_count, alloc_bytes, prof->rate);
+    for (size_t i = 0; i < PROF_BUCKETS; i++)
+    {
+        for (struct prof_bucket *b = prof->buckets[i]; b; b = b->next)
+        {
+            fprintf(out, "%zu: %zu [%zu: %zu] @", b->live_count, b->live_bytes,
+                    b->alloc_count, b->alloc_bytes);
+            for (int f = 0; f < b->depth; f++)
+                fprintf(out, " %p", b->pc[f]);
+            fputc('\n', out);
+        }
+    }
+
+    //pprof needs the mappings to symbolize the addresses
+    fprintf(out, "\nMAPPED_LIBRARIES:\n");
+    FILE *maps = fopen("/proc/self/maps", "r");
+    if (maps != NULL)
+    {
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), maps)) > 0)
+            fwrite(buf, 1, n, out);
+        fclose(maps);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return ferror(out) ? -1 : 0;
+}
+
+/*
+ * Zero page tracking for buddy_calloc. A bit per page of the pool is set
+ * when a block on that page is given back, since the user may have left
+ * data behind. Pages that were never handed out or were purged read as
+ * zero and keep their bit clear. The bit says nothing about pages that are
+ * allocated right now, it is only looked at when a block is handed out.
+ *
+ * The list engine writes headers into free blocks. A header only ever sits
+ * at the start of a free block and is zeroed when the block merges into its
+ * buddy, so a clean block handed out has nothing but its own header in it.
+ */
+
+/**
+ * @brief Set or clear the dirty bits of pages first to last inclusive
+ */
+static void dirty_range(struct buddy_pool *pool, size_t first, size_t last, bool set)
+{
+    uint64_t *map = pool->dirty;
+    size_t w = first >> 6, lw = last >> 6;
+    uint64_t fm = ~UINT64_C(0) << (first & 63);
+    uint64_t lm = ~UINT64_C(0) >> (63 - (last & 63));
+    if (w == lw)
+        fm &= lm;
+    map[w] = set ? map[w] | fm : map[w] & ~fm;
+    if (w == lw)
+        return;
+    for (w++; w < lw; w++)
+        map[w] = set ? ~UINT64_C(0) : 0;
+    map[lw] = set ? map[lw] | lm : map[lw] & ~lm;
+}
+
+/**
+ * @brief Number of dirty pages from first to last inclusive
+ */
+static size_t dirty_count(struct buddy_pool *pool, size_t first, size_t last)
+{
+    uint64_t *map = pool->dirty;
+    size_t w = first >> 6, lw = last >> 6;
+    uint64_t fm = ~UINT64_C(0) << (first & 63);
+    uint64_t lm = ~UINT64_C(0) >> (63 - (last & 63));
+    if (w == lw)
+        return (size_t)__builtin_popcountll(map[w] & fm & lm);
+    size_t n = (size_t)__builtin_popcountll(map[w] & fm);
+    for (w++; w < lw; w++)
+        n += (size_t)__builtin_popcountll(map[w]);
+    return n + (size_t)__builtin_popcountll(map[lw] & lm);
+}
+
+/**
+ * @brief Mark the pages of a block of order k that is being given back
+ */
+static inline void dirty_mark(struct buddy_pool *pool, struct avail *block, size_t k)
+{
+    size_t first = (size_t)((char *)block - (char *)pool->base) >> pool->page_shift;
+    if (k <= pool->page_shift)
+        pool->dirty[first >> 6] |= UINT64_C(1) << (first & 63);
+    else
+        dirty_range(pool, first, first + ((size_t)1 << (k - pool->page_shift)) - 1, true);
+}
+
+/*
+ * Engine independent block operations. Everything above malloc and free
+ * goes through these so it works the same on every engine.
+ */
+
+/**
+ * @brief Count n more allocated blocks of order k for the size profile
+ */
+static inline void live_add(struct buddy_pool *pool, size_t k, size_t n)
+{
+    pool->live[k] += n;
+    if (pool->live[k] > pool->live_peak[k])
+        pool->live_peak[k] = pool->live[k];
+}
+
+/**
+ * @brief Merge every pair of free buddies that presplitting left on the
+ * free lists, smallest order first so merged blocks can merge again.
+ * @return true if anything was merged
+ */
+static bool list_coalesce(struct buddy_pool *pool)
+{
+    bool merged = false;
+    for (size_t k = SMALLEST_K; k < pool->kval_m; k++)
+    {
+        struct avail *head = &pool->avail[k];
+        for (struct avail *block = avail_from_link(pool, head->next), *next; block != head; block = next)
+        {
+            next = avail_from_link(pool, block->next);
+            struct avail *buddy = buddy_of(pool, block, k);
+            if (buddy->tag != BLOCK_AVAIL || buddy->kval != k)
+                continue;
+            if (next == buddy)
+                next = avail_from_link(pool, buddy->next);
+            avail_unlink(pool, block);
+            avail_unlink(pool, buddy);
+            struct avail *upper = buddy > block ? buddy : block;
+            if (buddy < block)
+                block = buddy;
+            memset(upper, 0, sizeof(struct avail));
+            buddy_probe3(free_merge, pool, block, k + 1);
+            avail_push(pool, block, k + 1);
+            merged = true;
+        }
+    }
+    pool->split_free = false;
+    return merged;
+}
+
+/**
+ * @brief Split the smallest free block above order k all the way down so
+ * the free list of k gains two blocks.
+ * @return false if there is no bigger free block
+ */
+static bool presplit_one(struct buddy_pool *pool, size_t k)
+{
+    size_t j = k + 1;
+    while (j <= pool->kval_m && avail_empty(pool, j))
+        j++;
+    if (j > pool->kval_m)
+        return false;
+    struct avail *l = avail_from_link(pool, pool->avail[j].next);
+    if (pool->policy == BUDDY_POLICY_ADDRESS)
+        l = bits_first(pool, j);
+    avail_unlink(pool, l);
+    while (j > k)
+    {
+        j--;
+        buddy_probe3(malloc_split, pool, l, j);
+        avail_push(pool, buddy_of(pool, l, j), j);
+    }
+    avail_push(pool, l, k);
+    pool->split_free = true;
+    return true;
+}
+
+/**
+ * @brief Take a free block of exactly order kval, splitting as needed.
+ * @return The reserved block with its header filled in, NULL if none
+ */
+static struct avail *block_alloc(struct buddy_pool *pool, size_t kval)
+{
+    struct avail *block;
+    if (pool->engine == BUDDY_ENGINE_TREE)
+        block = tree_alloc(pool, kval);
+    else
+    {
+        block = list_alloc(pool, kval);
+        //Presplit buddies may add up to what we need
+        if (__builtin_expect(block == NULL && pool->split_free, 0) && list_coalesce(pool))
+            block = list_alloc(pool, kval);
+    }
+    if (block != NULL)
+    {
+        pool->free_bytes -= UINT64_C(1) << kval;
+        live_add(pool, kval, 1);
+    }
+    return block;
+}
+
+/**
+ * @brief Give a reserved block of order k back, merging it with free
+ * buddies. The header of the block itself is never read.
+ * @return The k value of the free block it merged into, -1 if the block
+ * was not allocated
+ */
+static int block_release_k(struct buddy_pool *pool, struct avail *block, size_t k)
+{
+    dirty_mark(pool, block, k);
+    int merged;
+    if (pool->engine == BUDDY_ENGINE_TREE)
+        merged = tree_free(pool, block, k);
+    else
+        merged = (int)list_free(pool, block, k);
+    if (merged >= 0)
+    {
+        pool->free_bytes += UINT64_C(1) << k;
+        pool->live[k]--;
+    }
+    return merged;
+}
+
+/**
+ * @brief block_release_k with the size taken from the header, merging
+ * rewrites headers so it is read first
+ */
+static inline int block_release(struct buddy_pool *pool, struct avail *block)
+{
+    return block_release_k(pool, block, block->kval);
+}
+
+/**
+ * @brief Take the smallest emergency reserve block of order kval or more.
+ */
+static struct avail *reserve_take(struct buddy_pool *pool, size_t kval)
+{
+    for (size_t k = kval; k <= pool->kval_m; k++)
+    {
+        struct avail *block = pool->reserve[k];
+        if (block == NULL)
+            continue;
+        pool->reserve[k] = avail_from_link(pool, block->next);
+        pool->reserve_have[k]--;
+        pool->reserve_mask |= UINT64_C(1) << k;
+        block->flags = 0;
+        return block;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Top the emergency reserve back up as far as free memory allows.
+ */
+static void reserve_refill(struct buddy_pool *pool)
+{
+    uint64_t mask = pool->reserve_mask;
+    while (mask)
+    {
+        size_t k = (size_t)__builtin_ctzll(mask);
+        mask &= mask - 1;
+        while (pool->reserve_have[k] < pool->reserve_want[k])
+        {
+            struct avail *block = block_alloc(pool, k);
+            if (block == NULL)
+                break;
+            block->next = avail_to_link(pool, pool->reserve[k]);
+            pool->reserve[k] = block;
+            pool->reserve_have[k]++;
+        }
+        if (pool->reserve_have[k] == pool->reserve_want[k])
+            pool->reserve_mask &= ~(UINT64_C(1) << k);
+    }
+}
+
+/**
+ * @brief Wake the buddy_malloc_wait callers that a free block of order k
+ * could satisfy. Must hold pool->lock.
+ */
+static inline void wake_waiters(struct buddy_pool *pool, size_t k)
+{
+    uint64_t mask = pool->wait_mask & ((UINT64_C(2) << k) - 1);
+    while (mask)
+    {
+        pthread_cond_broadcast(&pool->wait_cv[__builtin_ctzll(mask)]);
+        mask &= mask - 1;
+    }
+}
+
+/**
+ * @brief Reserve one specific free block of order k without splitting.
+ */
+static void block_claim(struct buddy_pool *pool, struct avail *block, size_t k)
+{
+    if (pool->engine == BUDDY_ENGINE_TREE)
+    {
+        uintptr_t off = (uintptr_t)((char *)block - (char *)pool->base);
+        size_t i = tree_index(pool, off, k);
+        pool->tree[i] = TREE_ALLOC;
+        pool->nfree[k]--;
+        tree_update(pool, i, k);
+    }
+    else
+    {
+        avail_unlink(pool, block);
+    }
+    pool->free_bytes -= UINT64_C(1) << k;
+    live_add(pool, k, 1);
+    block->tag = BLOCK_RESERVED;
+    block->kval = k;
+    block->flags = 0;
+}
+
+/**
+ * @brief Describe the block that starts at offset off.
+ *
+ * @param pool The memory pool
+ * @param off Offset of a block start from pool->base
+ * @param k Set to the k value of the block
+ * @return true if the block is free, false if it is allocated
+ */
+static bool block_at(struct buddy_pool *pool, uintptr_t off, size_t *k)
+{
+    if (pool->engine == BUDDY_ENGINE_TREE)
+    {
+        size_t i = 1;
+        size_t o = pool->kval_m;
+        while (pool->tree[i] != 0 && pool->tree[i] != TREE_ALLOC)
+        {
+            o--;
+            i = 2 * i + ((off >> o) & 1);
+        }
+        *k = o;
+        return pool->tree[i] == 0;
+    }
+    struct avail *block = (struct avail *)((char *)pool->base + off);
+    *k = block->kval;
+    return block->tag == BLOCK_AVAIL;
+}
+
+/**
+ * @brief Does the header in front of a user pointer describe an allocated
+ * block. A header zeroed by a merge or a purge reads as reserved with a k
+ * value of 0 so the k value is checked too.
+ */
+static inline bool block_reserved(struct buddy_pool *pool, struct avail *block)
+{
+    return block->tag == BLOCK_RESERVED && block->kval >= SMALLEST_K && block->kval <= pool->kval_m;
+}
+
+#define CACHE_LINE_SHIFT 6  /*log2 of the cache line size*/
+#define COLOR_LINES 64      /*Most colors per order, enough to cover a page worth of cache sets*/
+
+/**
+ * @brief The block a user pointer belongs to. A colored pointer has a
+ * stand in header in front of it that holds its offset into the block.
+ */
+static inline struct avail *ptr_block(void *ptr)
+{
+    struct avail *block = (struct avail *)((char *)ptr - BUDDY_HEADER);
+    if (__builtin_expect(block->tag == BLOCK_COLORED, 0))
+        block = (struct avail *)((char *)block - ((size_t)block->kval << CACHE_LINE_SHIFT));
+    return block;
+}
+
+/**
+ * @brief Hand out the next color of order kval for a request of size
+ * bytes, staying inside the slack of the block. Must hold pool->lock.
+ * @return The user pointer
+ */
+static void *block_color(struct buddy_pool *pool, struct avail *block, size_t size, size_t kval)
+{
+    size_t lines = ((UINT64_C(1) << kval) - BUDDY_HEADER - size) >> CACHE_LINE_SHIFT;
+    if (lines >= COLOR_LINES)
+        lines = COLOR_LINES - 1;
+    size_t c = pool->color_next[kval]++ % (lines + 1);
+    if (c == 0)
+        return (char *)block + BUDDY_HEADER;
+    struct avail *stand_in = (struct avail *)((char *)block + (c << CACHE_LINE_SHIFT));
+    stand_in->tag = BLOCK_COLORED;
+    stand_in->kval = (unsigned short)c;
+    stand_in->flags = 0;
+    return (char *)stand_in + BUDDY_HEADER;
+}
+
+/**
+ * @brief The k value needed to serve a request of size bytes
+ * @return The k value or 0 if the pool can never serve it
+ */
+static size_t size_to_k(struct buddy_pool *pool, size_t size)
+{
+    if (size > pool->numbytes)
+        return 0;
+    //get the kval for the requested size with enough room for the tag
+    size_t kval = btok(size + (pool->headerless ? 0 : BUDDY_HEADER)); //BUDDY_HEADER is the size of the metadata
+    if (kval < SMALLEST_K)
+        kval = SMALLEST_K;
+    return kval > pool->kval_m ? 0 : kval;
+}
+
+/**
+ * @brief Serve whoever was waiting for memory after blocks were released
+ * and merged into a free block of order merged. Must hold pool->lock.
+ */
+static inline void released(struct buddy_pool *pool, size_t merged)
+{
+    //Rarely anyone is waiting or the reserve is short, test both at once
+    if (__builtin_expect((pool->wait_mask | pool->reserve_mask) != 0, 0))
+    {
+        if (pool->reserve_mask & ((UINT64_C(2) << merged) - 1))
+            reserve_refill(pool);
+        wake_waiters(pool, merged);
+    }
+}
+
+/**
+ * @brief K value of the largest free block, 0 if there is none
+ */
+static size_t largest_free_k(struct buddy_pool *pool)
+{
+    for (size_t k = pool->kval_m; k > 0; k--)
+        if (pool->nfree[k])
+            return k;
+    return 0;
+}
+
+static inline uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Decide whether the watermark callback is due. Must hold pool->lock.
+ * @return The BUDDY_PRESSURE_* level to report, -1 for none
+ */
+static int pressure_check(struct buddy_pool *pool)
+{
+    const struct buddy_watermarks *wm = &pool->wm;
+    int level;
+    if (pool->pressure == BUDDY_PRESSURE_OK)
+    {
+        if (pool->free_bytes >= wm->low_bytes &&
+            (wm->low_k == 0 || largest_free_k(pool) >= wm->low_k))
+            return -1;
+        level = BUDDY_PRESSURE_LOW;
+    }
+    else
+    {
+        if (pool->free_bytes < wm->high_bytes ||
+            (wm->high_k != 0 && largest_free_k(pool) < wm->high_k))
+            return -1;
+        level = BUDDY_PRESSURE_OK;
+    }
+
+    //Too soon, stay in the old state so a later call reports it
+    uint64_t now = monotonic_ns();
+    if (pool->pressure_ns != 0 && now - pool->pressure_ns < wm->min_interval_ms * UINT64_C(1000000))
+        return -1;
+    pool->pressure = level;
+    pool->pressure_ns = now;
+    return level;
+}
+
+/**
+ * @brief Drop pool->lock and then call the watermark callback if it is due.
+ */
+static __attribute__((noinline)) void unlock_and_check(struct buddy_pool *pool)
+{
+    int level = pressure_check(pool);
+    buddy_pressure_fn fn = pool->pressure_fn;
+    void *arg = pool->pressure_arg;
+    pthread_mutex_unlock(&pool->lock);
+    if (level >= 0)
+    {
+        //A failed malloc has already set errno for its caller
+        int err = errno;
+        fn(pool, level, arg);
+        errno = err;
+    }
+}
+
+/**
+ * @brief Drop pool->lock after an operation that may have crossed a
+ * watermark, the check itself is kept off the common path.
+ */
+static inline void unlock_and_notify(struct buddy_pool *pool)
+{
+    if (__builtin_expect(pool->pressure_fn != NULL, 0))
+        unlock_and_check(pool);
+    else
+        pthread_mutex_unlock(&pool->lock);
+}
+
+int buddy_set_watermarks(struct buddy_pool *pool, const struct buddy_watermarks *wm,
+                         buddy_pressure_fn fn, void *arg)
+{
+    if (fn != NULL && (wm == NULL || wm->low_bytes > wm->high_bytes || wm->low_k > wm->high_k))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    pool_lock(pool);
+    pool->pressure_fn = fn;
+    pool->pressure_arg = arg;
+    if (wm != NULL)
+        pool->wm = *wm;
+    pool->pressure = BUDDY_PRESSURE_OK;
+    pool->pressure_ns = 0;
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+/*
+ * Exact fit. A request of at least pool->exact_fit bytes takes its block as
+ * usual, then the block is cut down to the pages it needs: it is split in
+ * halves, keeping a lower half whole while the request reaches past it and
+ * handing back an upper half once it does not. What is kept is a run of
+ * allocated blocks of falling orders, one per set bit of the length, and
+ * only the first has a header. The header keeps the order of that first
+ * block and, in next, where the run ends. Only the tree engine can do this
+ * since the list engine looks for free buddies at their headers and the
+ * blocks past the first are the caller's memory.
+ */
+
+/**
+ * @brief Cut the allocated block of order k down to need bytes rounded
+ * up to whole pages and hand the rest back. Must hold pool->lock.
+ */
+static void block_trim(struct buddy_pool *pool, struct avail *block, size_t k, size_t need)
+{
+    size_t page = (size_t)1 << pool->page_shift;
+    size_t len = (need + page - 1) & ~(page - 1);
+    if (len >= (UINT64_C(1) << k))
+        return;
+
+    unsigned char *tree = pool->tree;
+    uintptr_t off = (uintptr_t)((char *)block - (char *)pool->base);
+    size_t path[MAX_K];
+    size_t depth = 0;
+    size_t i = tree_index(pool, off, k);
+    size_t left = len;
+    size_t first = 0, merged = 0;
+    //Below an allocated node every node is zero, that is free
+    for (size_t o = k - 1; left != 0; o--)
+    {
+        size_t half = UINT64_C(1) << o;
+        bool give_back = true;
+        path[depth++] = i;
+        if (left >= half)
+        {
+            tree[2 * i] = TREE_ALLOC;
+            live_add(pool, o, 1);
+            if (first == 0)
+                first = o;
+            left -= half;
+            give_back = left == 0;
+            i = 2 * i + 1;
+        }
+        else
+        {
+            i = 2 * i;
+        }
+        if (give_back)
+        {
+            //The upper half is not needed
+            pool->nfree[o]++;
+            pool->free_bytes += half;
+            if (o > merged)
+                merged = o;
+        }
+    }
+    for (size_t d = depth; d-- > 0;)
+        tree[path[d]] = tree_combine(tree[2 * path[d]], tree[2 * path[d] + 1], k - d);
+    tree_update(pool, path[0], k);
+    pool->live[k]--;
+
+    block->kval = first;
+    block->flags |= BLOCK_F_EXACT;
+    block->next = avail_to_link(pool, (struct avail *)((char *)block + len));
+    released(pool, merged);
+}
+
+/**
+ * @brief Give back every block of a trimmed allocation. Must hold
+ * pool->lock.
+ * @return The largest k value they merged into, -1 if one was not allocated
+ */
+static int exact_release(struct buddy_pool *pool, struct avail *block)
+{
+    char *end = (char *)avail_from_link(pool, block->next);
+    size_t len = (size_t)(end - (char *)block);
+    int merged = -1;
+    for (char *p = (char *)block; len != 0;)
+    {
+        size_t o = 63 - (size_t)__builtin_clzll(len);
+        int m = block_release_k(pool, (struct avail *)p, o);
+        if (m < 0)
+            return -1;
+        if (m > merged)
+            merged = m;
+        p += UINT64_C(1) << o;
+        len -= UINT64_C(1) << o;
+    }
+    return merged;
+}
+
+/**
+ * @brief Release an allocated block whatever its shape. Must hold
+ * pool->lock.
+ */
+static inline int block_free(struct buddy_pool *pool, struct avail *block)
+{
+    if (__builtin_expect(block->flags & BLOCK_F_EXACT, 0))
+        return exact_release(pool, block);
+    return block_release(pool, block);
+}
+
+/**
+ * @brief buddy_malloc without the argument checks, must hold pool->lock.
+ * Always inlined so prof_sample sees the same frames from every caller.
+ */
+static inline __attribute__((always_inline)) void *malloc_locked(struct buddy_pool *pool, size_t size, int flags)
+{
+    size_t kval = size_to_k(pool, size);
+    struct avail *block = kval ? block_alloc(pool, kval) : NULL;
+    if (block == NULL && (flags & BUDDY_CRITICAL) && kval)
+        block = reserve_take(pool, kval);
+    if (block == NULL)
+    {
+        buddy_probe3(malloc_failure, pool, size, kval);
+        errno = ENOMEM;
+        return NULL; //Not enough memory
+    }
+
+    // Return the memory address just after the block's metadata
+    void *ptr = (void *)((char *)block + (pool->headerless ? 0 : BUDDY_HEADER));
+    if (__builtin_expect(pool->exact_fit != 0, 0) && size >= pool->exact_fit && !(flags & MALLOC_WHOLE))
+        block_trim(pool, block, block->kval, size + BUDDY_HEADER);
+    else if (__builtin_expect(pool->color, 0))
+        ptr = block_color(pool, block, size, kval);
+    if (__builtin_expect(pool->prof != NULL, 0) && (pool->prof_left -= (int64_t)size) < 0)
+    {
+        prof_sample(pool, ptr, size);
+        block->flags |= BLOCK_F_SAMPLED;
+        pool->prof_left = prof_next(pool->prof);
+    }
+    buddy_probe4(malloc_success, pool, ptr, size, kval);
+    return ptr;
+}
+
+/**
+ * @brief buddy_free without the argument checks, must hold pool->lock
+ */
+static void free_locked(struct buddy_pool *pool, void *ptr)
+{
+    int merged;
+    if (__builtin_expect(pool->headerless, 0))
+    {
+        //Only the tree knows the size, the walk down stops at our node
+        size_t k;
+        uintptr_t off = (uintptr_t)((char *)ptr - (char *)pool->base);
+        if (block_at(pool, off, &k) || (off & ((UINT64_C(1) << k) - 1)) != 0)
+            merged = -1;
+        else
+            merged = block_release_k(pool, ptr, k);
+    }
+    else
+    {
+        struct avail *block = ptr_block(ptr);
+        if (__builtin_expect(block->flags & BLOCK_F_SAMPLED, 0) && pool->prof != NULL)
+            prof_drop(pool, ptr);
+        merged = block_reserved(pool, block) ? block_free(pool, block) : -1;
+    }
+    if (merged < 0)
+    {
+        fprintf(stderr, "buddy_free: Block %p is not reserved\n", ptr);
+        return; // Block is not reserved
+    }
+    released(pool, (size_t)merged);
+}
+
+/**
+ * A mapping handed out for a request above the mmap threshold. The header
+ * sits at the start of the mapping like it does in a pool block.
+ */
+struct buddy_direct
+{
+    struct avail *block;    /*Start of the mapping*/
+    size_t len;             /*Length of the mapping*/
+};
+
+/**
+ * @brief Is ptr inside the pool, anything else can only be a direct mapping
+ */
+static inline bool in_pool(struct buddy_pool *pool, void *ptr)
+{
+    return (uintptr_t)ptr - (uintptr_t)pool->base < pool->numbytes;
+}
+
+/**
+ * @brief Should a request of size bytes get a mapping of its own
+ */
+static inline bool wants_direct(struct buddy_pool *pool, size_t size)
+{
+    return pool->mmap_threshold != 0 && size > pool->mmap_threshold;
+}
+
+/**
+ * @brief Length of the mapping for a request of size bytes, 0 on overflow
+ */
+static size_t direct_len(struct buddy_pool *pool, size_t size)
+{
+    size_t page = (size_t)1 << pool->page_shift;
+    if (size > SIZE_MAX - BUDDY_HEADER - page)
+        return 0;
+    return (size + BUDDY_HEADER + page - 1) & ~(page - 1);
+}
+
+/**
+ * @brief Make sure one more mapping fits in the direct table without
+ * growing it and keep that slot. Must hold pool->lock.
+ * @return 0 on success, -1 with errno set to ENOMEM
+ */
+static int direct_hold(struct buddy_pool *pool)
+{
+    if (pool->ndirect + pool->direct_held == pool->direct_cap)
+    {
+        size_t cap = pool->direct_cap ? pool->direct_cap * 2 : 16;
+        struct buddy_direct *d = realloc(pool->direct, cap * sizeof(struct buddy_direct));
+        if (d == NULL)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        pool->direct = d;
+        pool->direct_cap = cap;
+    }
+    pool->direct_held++;
+    return 0;
+}
+
+/**
+ * @brief Put a mapping into a slot kept by direct_hold. Must hold pool->lock.
+ */
+static void direct_add(struct buddy_pool *pool, struct avail *block, size_t len)
+{
+    pool->direct_held--;
+    pool->direct[pool->ndirect].block = block;
+    pool->direct[pool->ndirect++].len = len;
+}
+
+/**
+ * @brief Take the mapping that starts at block out of the direct table.
+ * Must hold pool->lock. The table is scanned, there are few mappings since
+ * each one is bigger than the threshold.
+ * @return false if block is not a direct mapping
+ */
+static bool direct_take(struct buddy_pool *pool, struct avail *block, size_t *len)
+{
+    for (size_t i = pool->ndirect; i-- > 0;)
+    {
+        if (pool->direct[i].block == block)
+        {
+            *len = pool->direct[i].len;
+            pool->direct[i] = pool->direct[--pool->ndirect];
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Serve a request above the mmap threshold from a fresh mapping.
+ * The mapping is made without the lock. A fresh mapping reads as zero so
+ * a calloc counts as a hit.
+ */
+static void *direct_malloc(struct buddy_pool *pool, size_t size, bool zeroed)
+{
+    size_t len = direct_len(pool, size);
+    struct avail *block = len ? mmap(NULL, len, PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) : MAP_FAILED;
+    if (block == MAP_FAILED)
+    {
+        buddy_probe3(malloc_failure, pool, size, 0);
+        errno = ENOMEM;
+        return NULL;
+    }
+    block->tag = BLOCK_DIRECT;
+    block->kval = 0;
+    block->flags = 0;
+    void *ptr = (char *)block + BUDDY_HEADER;
+
+    pool_lock(pool);
+    if (direct_hold(pool) == -1)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        munmap(block, len);
+        return NULL;
+    }
+    direct_add(pool, block, len);
+    if (zeroed)
+    {
+        pool->calloc_calls++;
+        pool->calloc_hits++;
+    }
+    if (__builtin_expect(pool->prof != NULL, 0) && (pool->prof_left -= (int64_t)size) < 0)
+    {
+        prof_sample(pool, ptr, size);
+        block->flags |= BLOCK_F_SAMPLED;
+        pool->prof_left = prof_next(pool->prof);
+    }
+    buddy_probe4(malloc_success, pool, ptr, size, 0);
+    pthread_mutex_unlock(&pool->lock);
+    return ptr;
+}
+
+/**
+ * @brief Give a direct mapping back to the kernel. The unmap happens
+ * without the lock.
+ */
+static void direct_free(struct buddy_pool *pool, void *ptr)
+{
+    struct avail *block = (struct avail *)((char *)ptr - BUDDY_HEADER);
+    size_t len;
+    pool_lock(pool);
+    if (!direct_take(pool, block, &len))
+    {
+        pthread_mutex_unlock(&pool->lock);
+        fprintf(stderr, "buddy_free: Block %p is not reserved\n", ptr);
+        return; // Block is not reserved
+    }
+    if (__builtin_expect(block->flags & BLOCK_F_SAMPLED, 0) && pool->prof != NULL)
+        prof_drop(pool, ptr);
+    pthread_mutex_unlock(&pool->lock);
+    if (munmap(block, len) == -1)
+    {
+        handle_error_and_die("buddy_free munmap");
+    }
+}
+
+void *buddy_malloc(struct buddy_pool *pool, size_t size)
+{
+    buddy_probe2(malloc_entry, pool, size);
+    if (pool == NULL || size == 0)
+    {
+        return NULL; // Nothing to allocate
+    }
+    if (wants_direct(pool, size))
+        return direct_malloc(pool, size, false);
+    pool_lock(pool);
+    void *ptr = malloc_locked(pool, size, 0);
+    unlock_and_notify(pool);
+    return ptr;
+}
+
+void *buddy_malloc_flags(struct buddy_pool *pool, size_t size, int flags)
+{
+    buddy_probe2(malloc_entry, pool, size);
+    if (pool == NULL || size == 0)
+    {
+        return NULL; // Nothing to allocate
+    }
+    if (wants_direct(pool, size))
+        return direct_malloc(pool, size, false);
+    pool_lock(pool);
+    void *ptr = malloc_locked(pool, size, flags);
+    unlock_and_notify(pool);
+    return ptr;
+}
+
+void *buddy_malloc_at_least(struct buddy_pool *pool, size_t min_size, size_t *actual)
+{
+    buddy_probe2(malloc_entry, pool, min_size);
+    if (pool == NULL || min_size == 0)
+    {
+        return NULL; // Nothing to allocate
+    }
+    if (wants_direct(pool, min_size))
+    {
+        //The mapping is rounded up to whole pages
+        void *ptr = direct_malloc(pool, min_size, false);
+        if (ptr != NULL && actual != NULL)
+            *actual = direct_len(pool, min_size) - BUDDY_HEADER;
+        return ptr;
+    }
+    pool_lock(pool);
+    char *ptr = malloc_locked(pool, min_size, 0);
+    unlock_and_notify(pool);
+    if (ptr != NULL && actual != NULL && pool->exact_fit != 0 && (ptr_block(ptr)->flags & BLOCK_F_EXACT))
+    {
+        *actual = (size_t)((char *)avail_from_link(pool, ptr_block(ptr)->next) - ptr);
+    }
+    else if (ptr != NULL && actual != NULL)
+    {
+        //Blocks are aligned to their size from the base, whatever the
+        //header or color in front of ptr the block ends at the next boundary
+        uintptr_t off = (uintptr_t)(ptr - (char *)pool->base);
+        uintptr_t mask = (UINT64_C(1) << size_to_k(pool, min_size)) - 1;
+        *actual = (size_t)((off | mask) + 1 - off);
+    }
+    return ptr;
+}
+
+void *buddy_malloc_wait(struct buddy_pool *pool, size_t size, int timeout_ms)
+{
+    buddy_probe2(malloc_entry, pool, size);
+    if (pool == NULL || size == 0)
+    {
+        return NULL; // Nothing to allocate
+    }
+    if (wants_direct(pool, size))
+        return direct_malloc(pool, size, false); //The kernel does the waiting
+    size_t kval = size_to_k(pool, size);
+    if (kval == 0)
+    {
+        errno = ENOMEM;
+        return NULL; //Would wait forever
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    if (timeout_ms > 0)
+    {
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    pool_lock(pool);
+    void *ptr;
+    int rc = 0;
+    while ((ptr = malloc_locked(pool, size, 0)) == NULL && rc != ETIMEDOUT && timeout_ms != 0)
+    {
+        buddy_probe3(malloc_wait, pool, size, kval);
+        pool->waiters[kval]++;
+        pool->wait_mask |= UINT64_C(1) << kval;
+        if (timeout_ms < 0)
+            rc = pthread_cond_wait(&pool->wait_cv[kval], &pool->lock);
+        else
+            rc = pthread_cond_timedwait(&pool->wait_cv[kval], &pool->lock, &deadline);
+        if (--pool->waiters[kval] == 0)
+            pool->wait_mask &= ~(UINT64_C(1) << kval);
+    }
+    if (ptr == NULL)
+        errno = ETIMEDOUT;
+    unlock_and_notify(pool);
+    return ptr;
+}
+
+void buddy_free(struct buddy_pool *pool, void *ptr)
+{
+    buddy_probe2(free_entry, pool, ptr);
+    if (pool == NULL || ptr == NULL)
+    {
+        return; // Nothing to free
+    }
+    if (!in_pool(pool, ptr))
+    {
+        direct_free(pool, ptr);
+        return;
+    }
+    pool_lock(pool);
+    free_locked(pool, ptr);
+    unlock_and_notify(pool);
+}
+
+void buddy_free_sized(struct buddy_pool *pool, void *ptr, size_t size)
+{
+    buddy_probe2(free_entry, pool, ptr);
+    if (pool == NULL || ptr == NULL)
+    {
+        return; // Nothing to free
+    }
+    if (!in_pool(pool, ptr))
+    {
+        direct_free(pool, ptr);
+        return;
+    }
+    size_t kval = size_to_k(pool, size);
+    pool_lock(pool);
+    //Colored, sampled and trimmed pointers need their header anyway
+    if (__builtin_expect(kval == 0 || pool->color || pool->prof != NULL ||
+                         (pool->exact_fit != 0 && size >= pool->exact_fit), 0))
+    {
+        free_locked(pool, ptr);
+        unlock_and_notify(pool);
+        return;
+    }
+    struct avail *block = (struct avail *)((char *)ptr - (pool->headerless ? 0 : BUDDY_HEADER));
+    int merged = block_release_k(pool, block, kval);
+    if (merged < 0)
+        fprintf(stderr, "buddy_free: Block %p is not reserved\n", ptr);
+    else
+        released(pool, (size_t)merged);
+    unlock_and_notify(pool);
+}
+
+#define CALLOC_RUNS 16  /*Dirty runs buddy_calloc remembers*/
+#define CALLOC_STREAM_BYTES (UINT64_C(1) << 25) /*Stream threshold when the cache size is unknown*/
+
+/**
+ * @brief Zero n bytes at p with non temporal stores where we have them so
+ * the cache keeps what it had.
+ */
+static void zero_stream(char *p, size_t n)
+{
+#ifdef __SSE2__
+    size_t head = (size_t)(-(uintptr_t)p & 63);
+    if (head > n)
+        head = n;
+    memset(p, 0, head);
+    p += head;
+    n -= head;
+    __m128i z = _mm_setzero_si128();
+    for (; n >= 64; p += 64, n -= 64)
+    {
+        _mm_stream_si128((__m128i *)p, z);
+        _mm_stream_si128((__m128i *)(p + 16), z);
+        _mm_stream_si128((__m128i *)(p + 32), z);
+        _mm_stream_si128((__m128i *)(p + 48), z);
+    }
+    _mm_sfence();
+#endif
+    memset(p, 0, n);
+}
+
+/**
+ * @brief Zero n bytes at p. Runs that would not fit in the last level cache
+ * use non temporal stores, they are faster there and do not push everything
+ * else out of the cache. Smaller runs are faster through the cache.
+ */
+static void zero_bytes(struct buddy_pool *pool, char *p, size_t n)
+{
+    if (n >= pool->stream_bytes)
+        zero_stream(p, n);
+    else
+        memset(p, 0, n);
+}
+
+void *buddy_calloc(struct buddy_pool *pool, size_t nmemb, size_t size)
+{
+    size_t bytes;
+    if (__builtin_mul_overflow(nmemb, size, &bytes))
+    {
+        errno = ENOMEM;
+        return NULL; //Can never fit
+    }
+    buddy_probe2(malloc_entry, pool, bytes);
+    if (pool == NULL || bytes == 0)
+    {
+        return NULL; // Nothing to allocate
+    }
+    if (wants_direct(pool, bytes))
+        return direct_malloc(pool, bytes, true);
+    pool_lock(pool);
+    char *ptr = malloc_locked(pool, bytes, 0);
+    if (ptr == NULL)
+    {
+        unlock_and_notify(pool);
+        return NULL;
+    }
+
+    //Collect the dirty pages under the lock and clear them after dropping
+    //it. Only our own free can dirty the pages of our block from now on.
+    size_t run[CALLOC_RUNS][2];
+    size_t nrun = 0;
+    uintptr_t off = (uintptr_t)(ptr - (char *)pool->base);
+    size_t p = off >> pool->page_shift;
+    size_t last = (off + bytes - 1) >> pool->page_shift;
+    while (p <= last && nrun < CALLOC_RUNS)
+    {
+        //Skip clean pages a word at a time
+        uint64_t w = pool->dirty[p >> 6] >> (p & 63);
+        if (w == 0)
+        {
+            p = (p | 63) + 1;
+            continue;
+        }
+        p += (size_t)__builtin_ctzll(w);
+        if (p > last)
+            break;
+        size_t q = p;
+        while (q <= last && ((pool->dirty[q >> 6] >> (q & 63)) & 1))
+        {
+            uint64_t c = ~(pool->dirty[q >> 6] >> (q & 63));
+            q += c ? (size_t)__builtin_ctzll(c) : 64;
+        }
+        //Out of room, clear everything that is left
+        if (nrun == CALLOC_RUNS - 1)
+            q = last + 1;
+        run[nrun][0] = p;
+        run[nrun++][1] = q < last + 1 ? q : last + 1;
+        p = q;
+    }
+    pool->calloc_calls++;
+    pool->calloc_hits += nrun == 0;
+    unlock_and_notify(pool);
+
+#ifdef BUDDY_COMPACT_HEADER
+    //A compact header leaves the prev link of the free block behind in the
+    //first bytes we hand out, clean pages or not
+    size_t link = sizeof(struct avail) - BUDDY_HEADER;
+    memset(ptr, 0, bytes < link ? bytes : link);
+#endif
+
+    char *end = ptr + bytes;
+    for (size_t i = 0; i < nrun; i++)
+    {
+        char *from = (char *)pool->base + (run[i][0] << pool->page_shift);
+        char *to = (char *)pool->base + (run[i][1] << pool->page_shift);
+        if (from < ptr)
+            from = ptr;
+        if (to > end)
+            to = end;
+        zero_bytes(pool, from, (size_t)(to - from));
+    }
+    return ptr;
+}
+
+/**
+ * @brief Purge one free block of order k if it has dirty pages, must hold
+ * pool->lock.
+ * @return The number of dirty bytes given back
+ */
+static size_t purge_block(struct buddy_pool *pool, struct avail *block, size_t k)
+{
+    size_t first = (size_t)((char *)block - (char *)pool->base) >> pool->page_shift;
+    size_t last = first + ((size_t)1 << (k - pool->page_shift)) - 1;
+    size_t dirty = dirty_count(pool, first, last);
+    if (dirty == 0)
+        return 0;
+    //The list engine keeps its links in the header, put it back after
+    struct avail header;
+    if (pool->engine == BUDDY_ENGINE_LIST)
+        header = *block;
+    if (madvise(block, UINT64_C(1) << k, MADV_DONTNEED) == -1)
+        return 0;
+    if (pool->engine == BUDDY_ENGINE_LIST)
+        *block = header;
+    dirty_range(pool, first, last, false);
+    return dirty << pool->page_shift;
+}
+
+/**
+ * @brief Purge every free block of a page or more below node i of order o
+ */
+static size_t purge_tree(struct buddy_pool *pool, size_t i, size_t o)
+{
+    unsigned char v = pool->tree[i];
+    if (tree_largest(v, o) < (int)pool->page_shift)
+        return 0;
+    if (v == 0)
+        return purge_block(pool, tree_block(pool, i, o), o);
+    return purge_tree(pool, 2 * i, o - 1) + purge_tree(pool, 2 * i + 1, o - 1);
+}
+
+size_t buddy_purge(struct buddy_pool *pool)
+{
+    if (pool == NULL)
+    {
+        return 0; // Nothing to purge
+    }
+    size_t purged = 0;
+    pool_lock(pool);
+    //The kernel holds registered pages pinned, it would not see new ones
+    if (pool->uring_k != 0)
+        purged = 0;
+    else if (pool->engine == BUDDY_ENGINE_TREE)
+    {
+        purged = purge_tree(pool, 1, pool->kval_m);
+    }
+    else
+    {
+        for (size_t k = pool->page_shift; k <= pool->kval_m; k++)
+            for (struct avail *b = avail_from_link(pool, pool->avail[k].next); b != &pool->avail[k];
+                 b = avail_from_link(pool, b->next))
+                purged += purge_block(pool, b, k);
+    }
+    buddy_probe2(purge, pool, purged);
+    pthread_mutex_unlock(&pool->lock);
+    return purged;
+}
+
+/*
+ * Prezeroing. A background thread clears dirty free blocks while nothing
+ * happens in the pool. It never takes a block out of the pool, it clears a
+ * free block one chunk at a time under the lock instead, so an allocator
+ * waits for at most one chunk. Everyone who takes the lock while the thread
+ * runs sets pool->prezero_yield first. Seeing it between two chunks means
+ * the pool is busy and the block being cleared may be gone, so the thread
+ * drops the block and waits for the pool to go quiet again.
+ */
+#define PREZERO_CHUNK (UINT64_C(1) << 16) /*Bytes cleared per trip through the lock*/
+#define PREZERO_SLICE_NS 1000000          /*Work done before sleeping off the budget*/
+#define PREZERO_QUIET_US 500              /*Quiet time needed after pool activity*/
+#define PREZERO_POLL_MS 20                /*Longest sleep while everything is clean*/
+
+/**
+ * @brief Wait on prezero_cv for ns nanoseconds or until told to stop, must
+ * hold pool->lock
+ */
+static void prezero_sleep(struct buddy_pool *pool, uint64_t ns)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    ns += (uint64_t)deadline.tv_nsec;
+    deadline.tv_sec += (time_t)(ns / 1000000000);
+    deadline.tv_nsec = (long)(ns % 1000000000);
+    while (!pool->prezero_stop &&
+           pthread_cond_timedwait(&pool->prezero_cv, &pool->lock, &deadline) != ETIMEDOUT)
+        ;
+}
+
+/**
+ * @brief Find a free block of a page or more below node i of order o that
+ * has dirty pages
+ */
+static struct avail *prezero_find_tree(struct buddy_pool *pool, size_t i, size_t o, size_t *k)
+{
+    unsigned char v = pool->tree[i];
+    if (tree_largest(v, o) < (int)pool->page_shift)
+        return NULL;
+    if (v == 0)
+    {
+        struct avail *block = tree_block(pool, i, o);
+        size_t first = (size_t)((char *)block - (char *)pool->base) >> pool->page_shift;
+        if (dirty_count(pool, first, first + ((size_t)1 << (o - pool->page_shift)) - 1) == 0)
+            return NULL;
+        *k = o;
+        return block;
+    }
+    struct avail *block = prezero_find_tree(pool, 2 * i, o - 1, k);
+    return block ? block : prezero_find_tree(pool, 2 * i + 1, o - 1, k);
+}
+
+/**
+ * @brief Find a free block of a page or more that has dirty pages, biggest
+ * first on the list engine. Must hold pool->lock.
+ */
+static struct avail *prezero_find(struct buddy_pool *pool, size_t *k)
+{
+    if (pool->engine == BUDDY_ENGINE_TREE)
+        return prezero_find_tree(pool, 1, pool->kval_m, k);
+    for (size_t j = pool->kval_m; j >= pool->page_shift; j--)
+    {
+        for (struct avail *b = avail_from_link(pool, pool->avail[j].next); b != &pool->avail[j];
+             b = avail_from_link(pool, b->next))
+        {
+            size_t first = (size_t)((char *)b - (char *)pool->base) >> pool->page_shift;
+            if (dirty_count(pool, first, first + ((size_t)1 << (j - pool->page_shift)) - 1))
+            {
+                *k = j;
+                return b;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void *prezero_main(void *arg)
+{
+    struct buddy_pool *pool = arg;
+    size_t chunk = PREZERO_CHUNK > (UINT64_C(1) << pool->page_shift) ?
+                   PREZERO_CHUNK : (UINT64_C(1) << pool->page_shift);
+    struct avail *block = NULL;
+    size_t k = 0;
+    uintptr_t pos = 0;
+    uint64_t busy = 0;
+    uint64_t poll = PREZERO_QUIET_US * UINT64_C(1000);
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->prezero_stop)
+    {
+        if (__atomic_exchange_n(&pool->prezero_yield, false, __ATOMIC_RELAXED))
+        {
+            //Someone is using the pool or waits for the lock, get out of the
+            //way until it has been quiet a while
+            block = NULL;
+            poll = PREZERO_QUIET_US * UINT64_C(1000);
+            prezero_sleep(pool, poll);
+            continue;
+        }
+        if (block == NULL)
+        {
+            block = prezero_find(pool, &k);
+            pos = 0;
+            if (block == NULL)
+            {
+                //Look less often the longer the pool stays idle
+                prezero_sleep(pool, poll);
+                if (poll < PREZERO_POLL_MS * UINT64_C(1000000))
+                    poll *= 2;
+                continue;
+            }
+        }
+
+        //Clear the next chunk if it has a dirty page, the list engine keeps
+        //its header at the start of the block
+        uint64_t start = monotonic_ns();
+        char *from = (char *)block + pos;
+        size_t len = chunk < (UINT64_C(1) << k) - pos ? chunk : (UINT64_C(1) << k) - pos;
+        size_t first = (size_t)(from - (char *)pool->base) >> pool->page_shift;
+        size_t last = first + (len >> pool->page_shift) - 1;
+        if (dirty_count(pool, first, last))
+        {
+            size_t skip = pos == 0 && pool->engine == BUDDY_ENGINE_LIST ? sizeof(struct avail) : 0;
+            zero_stream(from + skip, len - skip);
+            dirty_range(pool, first, last, false);
+            pool->prezero_bytes += len;
+        }
+        pos += len;
+        if (pos == UINT64_C(1) << k)
+            block = NULL;
+        busy += monotonic_ns() - start;
+
+        //Give the lock up between chunks and sleep off the cpu budget
+        if (busy >= PREZERO_SLICE_NS && pool->prezero_pct < 100)
+        {
+            prezero_sleep(pool, busy * (100 - pool->prezero_pct) / pool->prezero_pct);
+            busy = 0;
+        }
+        else
+        {
+            pthread_mutex_unlock(&pool->lock);
+            pthread_mutex_lock(&pool->lock);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+int buddy_prezero_start(struct buddy_pool *pool, unsigned int cpu_pct)
+{
+    if (pool == NULL || cpu_pct == 0 || cpu_pct > 100)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    pool_lock(pool);
+    if (pool->prezero_on)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        errno = EBUSY;
+        return -1;
+    }
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pool->prezero_cv, &attr);
+    pthread_condattr_destroy(&attr);
+    pool->prezero_pct = cpu_pct;
+    pool->prezero_stop = false;
+    int rc = pthread_create(&pool->prezero_tid, NULL, prezero_main, pool);
+    if (rc != 0)
+    {
+        pthread_cond_destroy(&pool->prezero_cv);
+        pthread_mutex_unlock(&pool->lock);
+        errno = rc;
+        return -1;
+    }
+    __atomic_store_n(&pool->prezero_on, true, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+void buddy_prezero_stop(struct buddy_pool *pool)
+{
+    if (pool == NULL)
+    {
+        return; // Nothing to stop
+    }
+    pool_lock(pool);
+    if (!pool->prezero_on)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+    pool->prezero_stop = true;
+    pthread_cond_broadcast(&pool->prezero_cv);
+    pthread_mutex_unlock(&pool->lock);
+    pthread_join(pool->prezero_tid, NULL);
+    pthread_cond_destroy(&pool->prezero_cv);
+    __atomic_store_n(&pool->prezero_on, false, __ATOMIC_RELAXED);
+}
+
+/*
+ * Batches. A batch of n blocks of order k is cut from one block of order
+ * k + ceil(log2 n): the pieces fill it from the bottom and what is left over
+ * above them is handed back as the aligned free blocks it decomposes into.
+ * None of those can merge since each one's buddy holds pieces or smaller
+ * leftovers. A batch free joins pairs of buddies inside the batch before
+ * anything goes back to the engine.
+ */
+
+/**
+ * @brief Split the allocated block of order k + m into n allocated blocks
+ * of order k at its start and free the rest. Must hold pool->lock.
+ */
+static void block_carve(struct buddy_pool *pool, struct avail *block, size_t k, size_t m, size_t n)
+{
+    uintptr_t off = (uintptr_t)((char *)block - (char *)pool->base);
+    size_t units = (size_t)1 << m;
+    if (pool->engine == BUDDY_ENGINE_TREE)
+    {
+        //Rebuild the nodes that cover pieces bottom up, the ones covering
+        //only leftovers are already zero (free) below an allocated node
+        unsigned char *tree = pool->tree;
+        for (size_t o = k; o <= k + m; o++)
+        {
+            size_t first = tree_index(pool, off, o);
+            size_t span = (size_t)1 << (o - k);
+            for (size_t j = 0; j * span < n; j++)
+            {
+                size_t i = first + j;
+                if ((j + 1) * span <= n)
+                    tree[i] = o == k ? TREE_ALLOC : TREE_FULL;
+                else
+                    tree[i] = tree_combine(tree[2 * i], tree[2 * i + 1], o);
+            }
+        }
+        tree_update(pool, tree_index(pool, off, k + m), k + m);
+        for (size_t p = n; p < units; p += p & -p)
+            pool->nfree[k + __builtin_ctzll(p)]++;
+    }
+    else
+    {
+        for (size_t p = n; p < units; p += p & -p)
+            avail_push(pool, (struct avail *)((char *)block + (p << k)), k + __builtin_ctzll(p));
+    }
+    pool->free_bytes += (units - n) << k;
+    pool->live[k + m]--;
+    live_add(pool, k, n);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        struct avail *piece = (struct avail *)((char *)block + (i << k));
+        piece->tag = BLOCK_RESERVED;
+        piece->kval = k;
+        piece->flags = 0;
+    }
+}
+
+/**
+ * @brief Turn two allocated buddies of order k into one allocated block of
+ * order k + 1. Must hold pool->lock.
+ */
+static void block_join(struct buddy_pool *pool, struct avail *lower, size_t k)
+{
+    struct avail *upper = (struct avail *)((char *)lower + (UINT64_C(1) << k));
+    if (pool->engine == BUDDY_ENGINE_TREE)
+    {
+        //Allocated nodes have zeroed children, the parents do not change
+        //since an allocated node and a full one both have nothing free
+        uintptr_t off = (uintptr_t)((char *)lower - (char *)pool->base);
+        size_t i = tree_index(pool, off, k + 1);
+        pool->tree[2 * i] = pool->tree[2 * i + 1] = 0;
+        pool->tree[i] = TREE_ALLOC;
+    }
+    upper->tag = BLOCK_UNUSED;
+    lower->kval = k + 1;
+    pool->live[k] -= 2;
+    live_add(pool, k + 1, 1);
+}
+
+size_t buddy_malloc_batch(struct buddy_pool *pool, size_t size, size_t n, void **out)
+{
+    if (pool == NULL || size == 0 || n == 0 || out == NULL)
+    {
+        return 0; // Nothing to allocate
+    }
+    if (pool->headerless)
+    {
+        errno = EINVAL;
+        return 0; //Carved pieces need their headers
+    }
+    size_t kval = size_to_k(pool, size);
+    if (kval == 0)
+    {
+        errno = ENOMEM;
+        return 0; //Not enough memory
+    }
+
+    size_t got = 0;
+    pool_lock(pool);
+    while (got < n)
+    {
+        //Enough room for the rest if we can, else the biggest block there is
+        size_t m = btok(n - got);
+        size_t largest = largest_free_k(pool);
+        if (largest < kval || pool->nfree[largest] == 0)
+        {
+            if (pool->split_free && list_coalesce(pool))
+                continue;
+            break;
+        }
+        if (kval + m > largest)
+            m = largest - kval;
+        size_t pieces = n - got < ((size_t)1 << m) ? n - got : (size_t)1 << m;
+        struct avail *block = block_alloc(pool, kval + m);
+        block_carve(pool, block, kval, m, pieces);
+        for (size_t i = 0; i < pieces; i++)
+            out[got++] = (char *)block + (i << kval) + BUDDY_HEADER;
+    }
+
+    if (__builtin_expect(pool->prof != NULL, 0))
+    {
+        for (size_t i = 0; i < got; i++)
+        {
+            if ((pool->prof_left -= (int64_t)size) < 0)
+            {
+                prof_sample(pool, out[i], size);
+                ((struct avail *)((char *)out[i] - BUDDY_HEADER))->flags |= BLOCK_F_SAMPLED;
+                pool->prof_left = prof_next(pool->prof);
+            }
+        }
+    }
+    buddy_probe4(malloc_batch, pool, size, n, got);
+    if (got < n)
+        errno = ENOMEM;
+    unlock_and_notify(pool);
+    return got;
+}
+
+void buddy_free_batch(struct buddy_pool *pool, void **ptrs, size_t n)
+{
+    if (pool == NULL || ptrs == NULL || n == 0)
+    {
+        return; // Nothing to free
+    }
+    buddy_probe2(free_batch, pool, n);
+    //Direct mappings are unmapped on their own, they have no buddies
+    if (pool->mmap_threshold != 0)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            if (ptrs[i] != NULL && !in_pool(pool, ptrs[i]))
+            {
+                direct_free(pool, ptrs[i]);
+                ptrs[i] = NULL;
+            }
+        }
+    }
+    size_t sorted = 1;
+    while (sorted < n && (uintptr_t)ptrs[sorted - 1] <= (uintptr_t)ptrs[sorted])
+        sorted++;
+
+    pool_lock(pool);
+    if (pool->headerless)
+    {
+        //Joining needs the headers, every block walks the tree on its own
+        for (size_t i = 0; i < n; i++)
+            if (ptrs[i] != NULL)
+                free_locked(pool, ptrs[i]);
+        unlock_and_notify(pool);
+        return;
+    }
+    int merged = -1;
+    //Trimmed blocks do not join, they go back one by one
+    if (sorted < n || pool->exact_fit != 0)
+    {
+        //Sorting costs more than joining saves, release in the given order
+        for (size_t i = 0; i < n; i++)
+        {
+            if (ptrs[i] == NULL)
+                continue;
+            struct avail *block = ptr_block(ptrs[i]);
+            if (!block_reserved(pool, block))
+            {
+                fprintf(stderr, "buddy_free: Block %p is not reserved\n", ptrs[i]);
+                continue; // Block is not reserved
+            }
+            if (__builtin_expect(block->flags & BLOCK_F_SAMPLED, 0) && pool->prof != NULL)
+                prof_drop(pool, ptrs[i]);
+            int m = block_free(pool, block);
+            if (m > merged)
+                merged = m;
+        }
+        if (merged >= 0)
+            released(pool, (size_t)merged);
+        unlock_and_notify(pool);
+        return;
+    }
+
+    //ptrs[0..top) is reused as a stack of blocks waiting to be released.
+    //Blocks arrive in address order so a block can only be the upper
+    //buddy of the block on top of the stack.
+    size_t top = 0;
+    void *prev = NULL;
+    for (size_t i = 0; i < n; i++)
+    {
+        void *ptr = ptrs[i];
+        if (ptr == NULL)
+            continue;
+        struct avail *block = ptr_block(ptr);
+        if (ptr == prev || !block_reserved(pool, block))
+        {
+            fprintf(stderr, "buddy_free: Block %p is not reserved\n", ptr);
+            continue; // Block is not reserved
+        }
+        prev = ptr;
+        if (__builtin_expect(block->flags & BLOCK_F_SAMPLED, 0) && pool->prof != NULL)
+            prof_drop(pool, ptr);
+
+        while (top > 0)
+        {
+            struct avail *below = ptrs[top - 1];
+            size_t k = block->kval;
+            if (below->kval != k || below > block || buddy_of(pool, below, k) != block)
+                break;
+            block_join(pool, below, k);
+            block = below;
+            top--;
+        }
+        ptrs[top++] = block;
+    }
+
+    for (size_t i = 0; i < top; i++)
+    {
+        int m = block_release(pool, ptrs[i]);
+        if (m > merged)
+            merged = m;
+    }
+    if (merged >= 0)
+        released(pool, (size_t)merged);
+    unlock_and_notify(pool);
+}
+
+int buddy_malloc_sg(struct buddy_pool *pool, size_t size, struct iovec *iov, int max_iov)
+{
+    buddy_probe2(malloc_entry, pool, size);
+    if (pool == NULL || size == 0 || iov == NULL || max_iov <= 0)
+    {
+        errno = EINVAL;
+        return -1; // Nothing to allocate
+    }
+    if (wants_direct(pool, size))
+    {
+        //A mapping of its own is never short of contiguous memory
+        iov[0].iov_base = direct_malloc(pool, size, false);
+        iov[0].iov_len = size;
+        return iov[0].iov_base ? 1 : -1;
+    }
+
+    size_t hdr = pool->headerless ? 0 : BUDDY_HEADER;
+    size_t left = size;
+    int n = 0;
+    pool_lock(pool);
+    while (left > 0)
+    {
+        //One block for the rest if there is one, else the largest free block.
+        //Taking the largest first keeps the number of pieces down.
+        size_t kval = size_to_k(pool, left);
+        size_t largest = largest_free_k(pool);
+        if (kval == 0 || kval > largest)
+        {
+            if (pool->split_free && list_coalesce(pool))
+                continue;
+            kval = largest;
+        }
+        if (kval == 0 || n == max_iov)
+            break;
+        size_t piece = ((size_t)1 << kval) - hdr;
+        if (piece > left)
+            piece = left;
+        void *ptr = malloc_locked(pool, piece, piece < left ? MALLOC_WHOLE : 0);
+        if (ptr == NULL)
+            break;
+        iov[n].iov_base = ptr;
+        iov[n++].iov_len = piece;
+        left -= piece;
+    }
+    if (left > 0)
+    {
+        //All or nothing, the pieces taken so far go back
+        while (n > 0)
+            free_locked(pool, iov[--n].iov_base);
+        unlock_and_notify(pool);
+        errno = ENOMEM;
+        return -1;
+    }
+    unlock_and_notify(pool);
+    return n;
+}
+
+void buddy_free_sg(struct buddy_pool *pool, const struct iovec *iov, int iovcnt)
+{
+    if (pool == NULL || iov == NULL || iovcnt <= 0)
+    {
+        return; // Nothing to free
+    }
+    if (iovcnt == 1 && iov[0].iov_base != NULL && !in_pool(pool, iov[0].iov_base))
+    {
+        direct_free(pool, iov[0].iov_base);
+        return;
+    }
+    pool_lock(pool);
+    for (int i = 0; i < iovcnt; i++)
+        if (iov[i].iov_base != NULL)
+            free_locked(pool, iov[i].iov_base);
+    unlock_and_notify(pool);
+}
+
+/*
+ * io_uring fixed buffers. The pool is registered as equal power of two
+ * buffers so the buffer of any block is its offset shifted down. Raw
+ * syscalls keep liburing out of the build.
+ */
+#define URING_MAX_K 30              /*The kernel takes fixed buffers of at most 1GiB*/
+#define URING_MAX_BUFS (1u << 14)   /*and at most this many of them*/
+
+int buddy_uring_register(struct buddy_pool *pool, int ring_fd, size_t chunk_k)
+{
+    if (pool == NULL || ring_fd < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+#ifndef BUDDY_HAVE_URING
+    (void)chunk_k;
+    errno = ENOSYS;
+    return -1;
+#else
+    size_t max_k = pool->kval_m < URING_MAX_K ? pool->kval_m : URING_MAX_K;
+    if (chunk_k == 0)
+        chunk_k = max_k;
+    if (chunk_k < pool->page_shift || chunk_k > max_k ||
+        (pool->numbytes >> chunk_k) > URING_MAX_BUFS)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t n = pool->numbytes >> chunk_k;
+    struct iovec *iov = malloc(n * sizeof(struct iovec));
+    if (iov == NULL)
+        return -1;
+    for (size_t i = 0; i < n; i++)
+    {
+        iov[i].iov_base = (char *)pool->base + (i << chunk_k);
+        iov[i].iov_len = (size_t)1 << chunk_k;
+    }
+    //Held while the kernel pins the pages so nothing is purged under it
+    pool_lock(pool);
+    long rc = -1;
+    if (pool->uring_k != 0)
+        errno = EBUSY;
+    else
+        rc = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, iov, (unsigned)n);
+    if (rc == 0)
+    {
+        pool->uring_fd = ring_fd;
+        pool->uring_k = chunk_k;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    free(iov);
+    return rc == 0 ? (int)n : -1;
+#endif
+}
+
+int buddy_uring_index(struct buddy_pool *pool, const void *ptr, size_t len, size_t *offset)
+{
+    if (pool == NULL || pool->uring_k == 0 || !in_pool(pool, (void *)ptr))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t k = pool->uring_k;
+    uintptr_t off = (uintptr_t)ptr - (uintptr_t)pool->base;
+    if (len > pool->numbytes - off || (len != 0 && ((off + len - 1) >> k) != (off >> k)))
+    {
+        errno = EINVAL;
+        return -1; //Runs past the end of its buffer
+    }
+    if (offset != NULL)
+        *offset = off & (((size_t)1 << k) - 1);
+    return (int)(off >> k);
+}
+
+int buddy_uring_unregister(struct buddy_pool *pool)
+{
+    if (pool == NULL || pool->uring_k == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+#ifndef BUDDY_HAVE_URING
+    errno = ENOSYS;
+    return -1;
+#else
+    pool_lock(pool);
+    long rc = syscall(__NR_io_uring_register, pool->uring_fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    //A ring that is gone has dropped its buffers already
+    if (rc == 0 || errno == EBADF)
+    {
+        pool->uring_fd = 0;
+        pool->uring_k = 0;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return rc == 0 ? 0 : -1;
+#endif
+}
+
+/**
+ * @brief buddy_stats for callers that hold pool->lock
+ */
+static void stats_locked(struct buddy_pool *pool, struct buddy_stats *stats)
+{
+    memset(stats, 0, sizeof(struct buddy_stats));
+    stats->numbytes = pool->numbytes;
+    for (size_t k = 0; k <= pool->kval_m; k++)
+    {
+        stats->nfree[k] = pool->nfree[k];
+        stats->reserved[k] = pool->reserve_have[k];
+        stats->free_bytes += pool->nfree[k] << k;
+        if (pool->nfree[k])
+            stats->largest_free_k = k;
+    }
+    stats->calloc_calls = pool->calloc_calls;
+    stats->calloc_hits = pool->calloc_hits;
+    stats->prezero_bytes = pool->prezero_bytes;
+    stats->direct_maps = pool->ndirect;
+    for (size_t i = 0; i < pool->ndirect; i++)
+        stats->direct_bytes += pool->direct[i].len;
+}
+
+void buddy_stats(struct buddy_pool *pool, struct buddy_stats *stats)
+{
+    pool_lock(pool);
+    stats_locked(pool, stats);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int buddy_profile_save(struct buddy_pool *pool, FILE *out)
+{
+    if (pool == NULL || out == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t peak[MAX_K];
+    pool_lock(pool);
+    memcpy(peak, pool->live_peak, sizeof(peak));
+    pthread_mutex_unlock(&pool->lock);
+
+    fprintf(out, "# buddy size profile: k peak_blocks\n");
+    for (size_t k = SMALLEST_K; k < MAX_K; k++)
+    {
+        if (peak[k])
+            fprintf(out, "%zu %zu\n", k, peak[k]);
+    }
+    return ferror(out) ? -1 : 0;
+}
+
+int buddy_profile_load(FILE *in, struct buddy_opts *opts)
+{
+    if (in == NULL || opts == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t presplit[MAX_K] = {0};
+    char line[128];
+    while (fgets(line, sizeof(line), in) != NULL)
+    {
+        size_t k, count;
+        char extra;
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (sscanf(line, "%zu %zu %c", &k, &count, &extra) != 2 || k < SMALLEST_K || k >= MAX_K)
+        {
+            errno = EINVAL;
+            return -1; //Not a profile we wrote
+        }
+        presplit[k] = count;
+    }
+    if (ferror(in))
+        return -1;
+    memcpy(opts->presplit, presplit, sizeof(presplit));
+    return 0;
+}
+
+/*
+ * Handles. A handle names an allocation through a slot in pool->handles so
+ * the block behind it can be moved by buddy_compact while it is not pinned.
+ */
+
+/**
+ * One slot of the handle table.
+ */
+struct buddy_handle
+{
+    void *ptr;          /*User pointer of the block, NULL if the slot is free*/
+    size_t size;        /*Requested size, the bytes copied when moving*/
+    uint32_t pins;      /*Number of outstanding buddy_pin calls*/
+    uint32_t gen;       /*Bumped every time the slot is reused*/
+    uint32_t next_free; /*Next free slot + 1 when the slot is free*/
+};
+
+/**
+ * @brief Find the slot for a handle, NULL if the handle is stale or invalid
+ */
+static struct buddy_handle *handle_get(struct buddy_pool *pool, uint64_t handle)
+{
+    uint32_t idx = (uint32_t)handle;
+    if (idx == 0 || idx > pool->nhandles)
+        return NULL;
+    struct buddy_handle *h = &pool->handles[idx - 1];
+    if (h->ptr == NULL || h->gen != (uint32_t)(handle >> 32))
+        return NULL;
+    return h;
+}
+
+uint64_t buddy_halloc(struct buddy_pool *pool, size_t size)
+{
+    if (pool == NULL || size == 0)
+        return 0;
+    if (pool->headerless)
+    {
+        errno = EINVAL;
+        return 0; //Compaction finds blocks through their headers
+    }
+    pool_lock(pool);
+    if (pool->handle_free == 0 && pool->nhandles == pool->handle_cap)
+    {
+        size_t cap = pool->handle_cap ? pool->handle_cap * 2 : 64;
+        struct buddy_handle *tbl = NULL;
+        if (cap <= UINT32_MAX)
+            tbl = realloc(pool->handles, cap * sizeof(struct buddy_handle));
+        if (tbl == NULL)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            errno = ENOMEM;
+            return 0;
+        }
+        pool->handles = tbl;
+        pool->handle_cap = cap;
+    }
+
+    void *ptr = malloc_locked(pool, size, MALLOC_WHOLE);
+    if (ptr == NULL)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        return 0;
+    }
+
+    uint32_t idx = pool->handle_free;
+    if (idx)
+    {
+        pool->handle_free = pool->handles[idx - 1].next_free;
+    }
+    else
+    {
+        idx = (uint32_t)++pool->nhandles;
+        pool->handles[idx - 1].gen = 0;
+    }
+    struct buddy_handle *h = &pool->handles[idx - 1];
+    h->ptr = ptr;
+    h->size = size;
+    h->pins = 0;
+    h->next_free = 0;
+    uint64_t handle = ((uint64_t)h->gen << 32) | idx;
+    pthread_mutex_unlock(&pool->lock);
+    return handle;
+}
+
+void *buddy_pin(struct buddy_pool *pool, uint64_t handle)
+{
+    void *ptr = NULL;
+    pool_lock(pool);
+    struct buddy_handle *h = handle_get(pool, handle);
+    if (h != NULL)
+    {
+        h->pins++;
+        ptr = h->ptr;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return ptr;
+}
+
+void buddy_unpin(struct buddy_pool *pool, uint64_t handle)
+{
+    pool_lock(pool);
+    struct buddy_handle *h = handle_get(pool, handle);
+    if (h != NULL && h->pins > 0)
+        h->pins--;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void buddy_hfree(struct buddy_pool *pool, uint64_t handle)
+{
+    pool_lock(pool);
+    struct buddy_handle *h = handle_get(pool, handle);
+    if (h != NULL)
+    {
+        free_locked(pool, h->ptr);
+        h->ptr = NULL;
+        h->gen++;
+        h->next_free = pool->handle_free;
+        pool->handle_free = (uint32_t)(h - pool->handles) + 1;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Child pools. A child takes whole blocks from its parent and keeps its own
+ * per k caches, the parent lock is only taken to borrow or give back blocks
+ * and then for a batch of them at a time.
+ */
+#define CHILD_BATCH_BYTES (UINT64_C(1) << 16)  /*Bytes borrowed at once for small blocks*/
+
+int buddy_child_init(struct buddy_child *child, struct buddy_pool *parent, size_t quota,
+                     size_t soft_limit)
+{
+    if (child == NULL || parent == NULL || quota == 0 || soft_limit > quota || parent->headerless)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(child, 0, sizeof(struct buddy_child));
+    child->parent = parent;
+    child->quota = quota;
+    child->soft_limit = soft_limit;
+    pthread_mutex_init(&child->lock, NULL);
+    return 0;
+}
+
+/**
+ * @brief Give cached blocks back to the parent until the child holds at most
+ * target bytes. Must hold child->lock.
+ */
+static void child_trim(struct buddy_child *child, size_t target)
+{
+    struct buddy_pool *pool = child->parent;
+    int merged = -1;
+    pool_lock(pool);
+    for (size_t k = pool->kval_m; k >= SMALLEST_K && child->held > target; k--)
+    {
+        while (child->free[k] != NULL && child->held > target)
+        {
+            struct avail *block = child->free[k];
+            child->free[k] = avail_from_link(pool, block->next);
+            child->nfree[k]--;
+            child->held -= UINT64_C(1) << k;
+            int m = block_release(pool, block);
+            if (m > merged)
+                merged = m;
+        }
+    }
+    if (merged >= 0)
+        released(pool, (size_t)merged);
+    unlock_and_notify(pool);
+}
+
+/**
+ * @brief Borrow a batch of order k blocks from the parent onto the cache
+ * without going over the quota, or over the soft limit after the first.
+ * Must hold child->lock.
+ */
+static void child_refill(struct buddy_child *child, size_t k)
+{
+    struct buddy_pool *pool = child->parent;
+    size_t bytes = UINT64_C(1) << k;
+    size_t n = CHILD_BATCH_BYTES >> k;
+    if (n == 0)
+        n = 1;
+    pool_lock(pool);
+    for (size_t i = 0; i < n && child->held + bytes <= child->quota; i++)
+    {
+        if (i > 0 && child->held + bytes > child->soft_limit)
+            break;
+        struct avail *block = block_alloc(pool, k);
+        if (block == NULL)
+            break;
+        block->next = avail_to_link(pool, child->free[k]);
+        child->free[k] = block;
+        child->nfree[k]++;
+        child->held += bytes;
+    }
+    unlock_and_notify(pool);
+}
+
+void *buddy_child_malloc(struct buddy_child *child, size_t size)
+{
+    if (child == NULL || size == 0)
+        return NULL;
+    struct buddy_pool *pool = child->parent;
+    size_t kval = size > pool->numbytes ? 0 : size_to_k(pool, size + BUDDY_CHILD_HEADER - BUDDY_HEADER);
+    if (kval == 0)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t bytes = UINT64_C(1) << kval;
+
+    pthread_mutex_lock(&child->lock);
+    if (child->used + bytes > child->quota)
+    {
+        pthread_mutex_unlock(&child->lock);
+        errno = EDQUOT;
+        return NULL;
+    }
+    if (child->free[kval] == NULL)
+    {
+        //Blocks cached at other sizes count against the quota too
+        if (child->held + bytes > child->quota)
+            child_trim(child, child->quota - bytes);
+        child_refill(child, kval);
+    }
+    struct avail *block = child->free[kval];
+    if (block == NULL)
+    {
+        pthread_mutex_unlock(&child->lock);
+        errno = ENOMEM;
+        return NULL;
+    }
+    child->free[kval] = avail_from_link(pool, block->next);
+    child->nfree[kval]--;
+    child->used += bytes;
+
+    block->next = avail_to_link(pool, child->inuse);
+    block->prev = avail_to_link(pool, NULL);
+    if (child->inuse != NULL)
+        child->inuse->prev = avail_to_link(pool, block);
+    child->inuse = block;
+    pthread_mutex_unlock(&child->lock);
+    return (void *)((char *)block + BUDDY_CHILD_HEADER);
+}
+
+void buddy_child_free(struct buddy_child *child, void *ptr)
+{
+    if (child == NULL || ptr == NULL)
+        return;
+    struct buddy_pool *pool = child->parent;
+    struct avail *block = (struct avail *)((char *)ptr - BUDDY_CHILD_HEADER);
+    size_t k = block->kval;
+    pthread_mutex_lock(&child->lock);
+    struct avail *prev = avail_from_link(pool, block->prev), *next = avail_from_link(pool, block->next);
+    if (prev != NULL)
+        prev->next = block->next;
+    else
+        child->inuse = next;
+    if (next != NULL)
+        next->prev = block->prev;
+    child->used -= UINT64_C(1) << k;
+    block->next = avail_to_link(pool, child->free[k]);
+    child->free[k] = block;
+    child->nfree[k]++;
+    if (child->held > child->soft_limit)
+        child_trim(child, child->soft_limit);
+    pthread_mutex_unlock(&child->lock);
+}
+
+void buddy_child_destroy(struct buddy_child *child)
+{
+    struct buddy_pool *pool = child->parent;
+    int merged = -1;
+    pool_lock(pool);
+    for (struct avail *block = child->inuse; block != NULL;)
+    {
+        struct avail *next = avail_from_link(pool, block->next);
+        int m = block_release(pool, block);
+        if (m > merged)
+            merged = m;
+        block = next;
+    }
+    for (size_t k = 0; k < MAX_K; k++)
+    {
+        for (struct avail *block = child->free[k]; block != NULL;)
+        {
+            struct avail *next = avail_from_link(pool, block->next);
+            int m = block_release(pool, block);
+            if (m > merged)
+                merged = m;
+            block = next;
+        }
+    }
+    if (merged >= 0)
+        released(pool, (size_t)merged);
+    unlock_and_notify(pool);
+    pthread_mutex_destroy(&child->lock);
+    memset(child, 0, sizeof(struct buddy_child));
+}
+
+/**
+ * A movable block found by buddy_compact.
+ */
+struct movable
+{
+    uintptr_t off;              /*Offset of the block from pool->base*/
+    size_t k;                   /*K value of the block*/
+    struct buddy_handle *h;     /*Handle that owns the block*/
+};
+
+/**
+ * A region that only holds movable blocks.
+ */
+struct region
+{
+    size_t first;               /*Index of the first movable block in it*/
+    size_t count;               /*Number of movable blocks in it*/
+    size_t cost;                /*Bytes that have to be copied to empty it*/
+};
+
+static int movable_cmp(const void *a, const void *b)
+{
+    const struct movable *x = a, *y = b;
+    return x->off < y->off ? -1 : x->off > y->off;
+}
+
+/**
+ * @brief Gather every unpinned handle block sorted by address so the blocks
+ * of any aligned region sit next to each other.
+ * @return The number of blocks stored in mv
+ */
+static size_t collect_movable(struct buddy_pool *pool, struct movable *mv)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < pool->nhandles; i++)
+    {
+        struct buddy_handle *h = &pool->handles[i];
+        if (h->ptr == NULL || h->pins)
+            continue;
+        struct avail *block = ptr_block(h->ptr);
+        mv[n].off = (uintptr_t)((char *)block - (char *)pool->base);
+        mv[n].k = block->kval;
+        mv[n++].h = h;
+    }
+    qsort(mv, n, sizeof(struct movable), movable_cmp);
+    return n;
+}
+
+/**
+ * @brief Bytes allocated inside the aligned region of order r at start
+ */
+static size_t region_used(struct buddy_pool *pool, uintptr_t start, size_t r)
+{
+    size_t used = 0;
+    for (uintptr_t off = start; off < start + (UINT64_C(1) << r);)
+    {
+        size_t k;
+        if (!block_at(pool, off, &k))
+            used += UINT64_C(1) << k;
+        off += UINT64_C(1) << k;
+    }
+    return used;
+}
+
+static int region_cmp(const void *a, const void *b)
+{
+    const struct region *x = a, *y = b;
+    return x->cost < y->cost ? -1 : x->cost > y->cost;
+}
+
+/**
+ * @brief Move every block of a region elsewhere so the region becomes one
+ * free block.
  *
- * @param bytes the number of bytes
- * @return size_t the K value that will fit bytes
+ * The free blocks inside the region are claimed first so the replacements
+ * can not land in the region, then everything is released at once and
+ * merges back up to order r.
+ *
+ * @return true if the region was emptied
  */
-size_t btok(size_t bytes)
+static bool evacuate(struct buddy_pool *pool, uintptr_t start, size_t r,
+                     struct movable *mv, size_t count, struct buddy_compact_report *rep)
 {
-    if(bytes <= 1) return 0;
+    size_t cap = 16, nheld = 0;
+    struct avail **held = malloc(cap * sizeof(struct avail *));
+    if (held == NULL)
+        return false;
 
-    size_t k = 0;
-    k+=(btok(bytes/2) + 1);
-    return k;
-}
+    for (uintptr_t off = start; off < start + (UINT64_C(1) << r);)
+    {
+        size_t k;
+        bool free = block_at(pool, off, &k);
+        if (free)
+        {
+            if (nheld == cap)
+            {
+                struct avail **tmp = realloc(held, 2 * cap * sizeof(struct avail *));
+                if (tmp == NULL)
+                    break;
+                held = tmp;
+                cap *= 2;
+            }
+            held[nheld] = (struct avail *)((char *)pool->base + off);
+            block_claim(pool, held[nheld++], k);
+        }
+        off += UINT64_C(1) << k;
+    }
 
-struct avail *buddy_calc(struct buddy_pool *pool, struct avail *buddy)
-{   
-    if (buddy == NULL)
+    //Moved blocks can only be released once every move is done, add them
+    //to the held set as we go
+    bool ok = true;
+    for (size_t i = 0; i < count; i++)
     {
-        fprintf(stderr, "buddy_calc: Buddy is NULL\n");
-        return NULL;
+        struct avail *nb = block_alloc(pool, mv[i].k);
+        if (nb == NULL)
+        {
+            ok = false;
+            break;
+        }
+        void *dst = (char *)nb + BUDDY_HEADER;
+        memcpy(dst, mv[i].h->ptr, mv[i].h->size);
+        struct avail *old = ptr_block(mv[i].h->ptr);
+        if ((old->flags & BLOCK_F_SAMPLED) && pool->prof != NULL)
+        {
+            prof_move(pool, mv[i].h->ptr, dst);
+            nb->flags |= BLOCK_F_SAMPLED;
+        }
+        mv[i].h->ptr = dst;
+        rep->moved_blocks++;
+        rep->moved_bytes += UINT64_C(1) << mv[i].k;
+
+        if (nheld == cap)
+        {
+            struct avail **tmp = realloc(held, 2 * cap * sizeof(struct avail *));
+            if (tmp == NULL)
+            {
+                //Still allocated so nothing leaks, the region just stays split
+                block_release(pool, (struct avail *)((char *)pool->base + mv[i].off));
+                ok = false;
+                break;
+            }
+            held = tmp;
+            cap *= 2;
+        }
+        held[nheld++] = (struct avail *)((char *)pool->base + mv[i].off);
     }
 
-    uintptr_t addr = (int)((char *)buddy - (char *)pool->base);
-    fprintf(stderr, "buddy_calc: addr = %p - %p = %ld\n", buddy, pool->base, addr);
-    int k = buddy->kval;
+    for (size_t i = 0; i < nheld; i++)
+        block_release(pool, held[i]);
+    free(held);
 
-    fprintf(stderr, "buddy_calc: k = %d\n", k);
-    uintptr_t buddy_addr = (addr ^ (UINT64_C(1) << k));
-    if (buddy_addr >= (uintptr_t)pool->numbytes)
+    size_t k;
+    return ok && block_at(pool, start, &k) && k >= r;
+}
+
+size_t buddy_compact(struct buddy_pool *pool, size_t budget, struct buddy_compact_report *report)
+{
+    struct buddy_compact_report rep = {0};
+    struct buddy_stats st;
+    pool_lock(pool);
+    stats_locked(pool, &st);
+    rep.largest_before = st.largest_free_k;
+
+    struct movable *mv = malloc((pool->nhandles + 1) * sizeof(struct movable));
+    struct region *rg = malloc((pool->nhandles + 1) * sizeof(struct region));
+
+    //Only regions larger than the largest free block are worth emptying.
+    //The smallest such order is tried first since it is the cheapest.
+    size_t left = budget;
+    for (size_t r = st.largest_free_k + 1; mv && rg && r < pool->kval_m; r++)
     {
-        fprintf(stderr, "buddy_calc: Buddy address out of range. Invalid address: %p\tMax address: %p\n", buddy_addr, pool->numbytes);
-        return NULL; // Ensure buddy address is within valid range
-    }
+        //Blocks moved at a lower order have new addresses so collect again
+        size_t nmv = collect_movable(pool, mv);
+        size_t nrg = 0;
+        for (size_t i = 0; i < nmv;)
+        {
+            uintptr_t start = mv[i].off >> r << r;
+            size_t j = i, movable_bytes = 0;
+            while (j < nmv && (mv[j].off >> r << r) == start)
+                movable_bytes += UINT64_C(1) << mv[j++].k;
 
-    struct avail *buddy_block = (struct avail *)((char *)pool->base + buddy_addr);
-    buddy_block->tag = BLOCK_AVAIL;
-    buddy_block->kval = k;
+            //The region qualifies if nothing but our blocks is allocated in it
+            if (region_used(pool, start, r) == movable_bytes)
+            {
+                rg[nrg].first = i;
+                rg[nrg].count = j - i;
+                rg[nrg++].cost = movable_bytes;
+            }
+            i = j;
+        }
 
+        //Nearly empty regions first
+        qsort(rg, nrg, sizeof(struct region), region_cmp);
+        for (size_t i = 0; i < nrg && rg[i].cost <= left; i++)
+        {
+            uintptr_t start = mv[rg[i].first].off >> r << r;
+            //Blocks moved for an earlier region may have landed in this one
+            if (region_used(pool, start, r) != rg[i].cost)
+                continue;
+            left -= rg[i].cost;
+            if (evacuate(pool, start, r, &mv[rg[i].first], rg[i].count, &rep))
+                rep.reclaimed[r]++;
+        }
+    }
+    free(mv);
+    free(rg);
 
-    return buddy_block;
+    stats_locked(pool, &st);
+    rep.largest_after = st.largest_free_k;
+    if (pool->reserve_mask != 0)
+        reserve_refill(pool);
+    if (pool->wait_mask != 0)
+        wake_waiters(pool, rep.largest_after);
+    pthread_mutex_unlock(&pool->lock);
+    if (report != NULL)
+        *report = rep;
+    return rep.moved_bytes;
 }
 
-void *buddy_malloc(struct buddy_pool *pool, size_t size)
-{    //get the kval for the requested size with enough room for the tag
+/*
+ * Realloc. A block shrinks in place by handing its upper halves back and
+ * grows in place when the buddies above it are free. Otherwise it moves,
+ * and a block of REMAP_MIN_K or more moves by remapping its pages to the
+ * new block with mremap instead of copying them, which costs a page table
+ * update per page (per huge page when it is backed by them) and leaves the
+ * old block as fresh zero pages. Kernels before 5.7 lack MREMAP_DONTUNMAP
+ * and always copy.
+ */
+#define REMAP_MIN_K 18  /*Smallest block moved with mremap, memcpy is faster below*/
 
-    if (size == 0)
+#ifndef MREMAP_DONTUNMAP
+#define MREMAP_DONTUNMAP 4
+#endif
+
+/**
+ * @brief Give the upper part of an allocated block of order k back so
+ * only the lower kval remains. Must hold pool->lock.
+ */
+static void block_shrink(struct buddy_pool *pool, struct avail *block, size_t k, size_t kval)
+{
+    unsigned short flags = block->flags;
+    block_carve(pool, block, kval, k - kval, 1);
+    block->flags = flags;
+    //The halves handed back may hold old data
+    size_t first = (size_t)((char *)block - (char *)pool->base + (UINT64_C(1) << kval)) >> pool->page_shift;
+    size_t last = (size_t)((char *)block - (char *)pool->base + (UINT64_C(1) << k) - 1) >> pool->page_shift;
+    dirty_range(pool, first, last, true);
+    released(pool, k - 1);
+}
+
+/**
+ * @brief Grow an allocated block of order k to kval by taking the free
+ * buddies above it. Must hold pool->lock.
+ * @return false if one of them is not free, nothing changed then
+ */
+static bool block_grow(struct buddy_pool *pool, struct avail *block, size_t k, size_t kval)
+{
+    uintptr_t off = (uintptr_t)((char *)block - (char *)pool->base);
+    if (off & ((UINT64_C(1) << kval) - 1))
+        return false; //Not the lower buddy all the way up
+    for (size_t j = k; j < kval; j++)
     {
-        fprintf(stderr, "buddy_malloc: size is 0\n");
-        return NULL; // Nothing to allocate
+        size_t bk;
+        if (!block_at(pool, off + (UINT64_C(1) << j), &bk) || bk != j)
+            return false;
     }
-    if (size > pool->numbytes)
+    for (size_t j = k; j < kval; j++)
     {
-        fprintf(stderr, "buddy_malloc: size is too large\n");
-        return NULL; // Size is too large
+        block_claim(pool, (struct avail *)((char *)block + (UINT64_C(1) << j)), j);
+        block_join(pool, block, j);
     }
-    size_t kval = btok(size + sizeof(struct avail)); //sizeof(struct avail) is the size of the metadata
-    fprintf(stderr, "buddy_malloc: kval = %lu\n", kval);
+    return true;
+}
 
-    //R1 Find a block
+/**
+ * @brief Move the pages of an allocated block of order k to the start of
+ * dest. The old block is left mapped with fresh zero pages.
+ * @return false if the kernel would not do it
+ */
+static bool block_remap(struct avail *block, size_t k, struct avail *dest)
+{
+    size_t len = UINT64_C(1) << k;
+    //Kernels before 5.7 can not leave the old range mapped and fail with
+    //EINVAL. Unmapping it ourselves would leave a hole in the pool that
+    //another thread's mmap could land in, so the caller copies instead.
+    void *r = mremap(block, len, len, MREMAP_MAYMOVE | MREMAP_FIXED | MREMAP_DONTUNMAP, dest);
+    return r != MAP_FAILED;
+}
 
-    if(kval > pool->kval_m)
+/**
+ * @brief buddy_realloc of a direct mapping. It is resized with mremap while
+ * it stays above the threshold and copied into the pool otherwise.
+ */
+static void *direct_realloc(struct buddy_pool *pool, void *ptr, size_t size)
+{
+    struct avail *block = (struct avail *)((char *)ptr - BUDDY_HEADER);
+    size_t len;
+    pool_lock(pool);
+    if (!direct_take(pool, block, &len))
     {
-        fprintf(stderr, "Requested size is too large\n");
-        return NULL; //Not enough memory
+        pthread_mutex_unlock(&pool->lock);
+        fprintf(stderr, "buddy_realloc: Block %p is not reserved\n", ptr);
+        errno = EINVAL;
+        return NULL; // Block is not reserved
     }
 
-    //Find the first available block that is >= kval
-    size_t j = kval-1;
-    for (size_t i = kval; i <= pool->kval_m; i++)
+    if (!wants_direct(pool, size))
     {
-        if (pool->avail[i].next != &pool->avail[i])
+        size_t kval = size_to_k(pool, size);
+        struct avail *dest = kval ? block_alloc(pool, kval) : NULL;
+        if (dest == NULL)
         {
-            j = i;
-            break;
+            //The slot we took is still there
+            pool->direct_held++;
+            direct_add(pool, block, len);
+            unlock_and_notify(pool);
+            errno = ENOMEM;
+            return NULL; //Not enough memory
+        }
+        dest->flags = block->flags;
+        void *moved = (char *)dest + BUDDY_HEADER;
+        if ((block->flags & BLOCK_F_SAMPLED) && pool->prof != NULL)
+            prof_move(pool, ptr, moved);
+        unlock_and_notify(pool);
+        memcpy(moved, ptr, size);
+        if (munmap(block, len) == -1)
+        {
+            handle_error_and_die("buddy_realloc munmap");
         }
+        return moved;
     }
-    fprintf(stderr, "buddy_malloc: j = %lu\n", j);
 
-    //If we did not find a block then we need to return NULL
-    if(j < kval  || j > pool->kval_m)
+    //Keep the slot we took so putting the mapping back can not fail
+    pool->direct_held++;
+    pthread_mutex_unlock(&pool->lock);
+    size_t nlen = direct_len(pool, size);
+    struct avail *moved = nlen ? mremap(block, len, nlen, MREMAP_MAYMOVE) : MAP_FAILED;
+    pool_lock(pool);
+    if (moved == MAP_FAILED)
     {
-        fprintf(stderr, "No available blocks\n");
-        return NULL; //No available blocks
+        direct_add(pool, block, len);
+        pthread_mutex_unlock(&pool->lock);
+        errno = ENOMEM;
+        return NULL; //Not enough memory
     }
+    direct_add(pool, moved, nlen);
+    if (moved != block && (moved->flags & BLOCK_F_SAMPLED) && pool->prof != NULL)
+        prof_move(pool, ptr, (char *)moved + BUDDY_HEADER);
+    pthread_mutex_unlock(&pool->lock);
+    return (char *)moved + BUDDY_HEADER;
+}
 
-    //R2 Remove from list;
-    // remove the block from the list
-    fprintf(stderr, "Removing block from list\n");
-    struct avail *l = pool->avail[j].next;
-    struct avail *p = l->next;
-    pool->avail[j].next = p;
-    p->prev = &pool->avail[j];
-    l->tag = BLOCK_RESERVED;
-    
-    while(j > kval){
-        fprintf(stderr, "Splitting block\n");
-        fprintf(stderr, "Block size: %d\n", l->kval);
-        fprintf(stderr, "kval size: %zu\n", kval);
-        //R4 Split the block
-        l->kval--;
-        j--;
-        struct avail *buddy = buddy_calc(pool, l);
-        if (buddy == NULL)
-        {
-            fprintf(stderr, "Buddy calculation failed\n");
-            // If buddy calculation fails, we need to restore the block to its original state
-            l->prev->next = l;
-            l->next->prev = l;
-            l->next = l->prev = NULL;
-            l->tag = BLOCK_AVAIL;
-            return NULL;
+void *buddy_realloc(struct buddy_pool *pool, void *ptr, size_t size)
+{
+    buddy_probe3(realloc, pool, ptr, size);
+    if (pool == NULL)
+    {
+        return NULL; // Nothing to work with
+    }
+    if (ptr == NULL)
+    {
+        return buddy_malloc(pool, size);
+    }
+    if (size == 0)
+    {
+        buddy_free(pool, ptr);
+        return NULL;
+    }
+    if (!in_pool(pool, ptr))
+    {
+        return direct_realloc(pool, ptr, size);
+    }
+    if (pool->headerless)
+    {
+        errno = EINVAL;
+        return NULL; //The old size is not at hand
+    }
+
+    pool_lock(pool);
+    struct avail *block = ptr_block(ptr);
+    if (!block_reserved(pool, block))
+    {
+        pthread_mutex_unlock(&pool->lock);
+        fprintf(stderr, "buddy_realloc: Block %p is not reserved\n", ptr);
+        errno = EINVAL;
+        return NULL; // Block is not reserved
+    }
+    if (block->flags & BLOCK_F_EXACT)
+    {
+        //Trimmed blocks are not split or grown in place, they move
+        size_t old = (size_t)((char *)avail_from_link(pool, block->next) - (char *)ptr);
+        pthread_mutex_unlock(&pool->lock);
+        void *moved = buddy_malloc(pool, size);
+        if (moved != NULL)
+        {
+            memcpy(moved, ptr, old < size ? old : size);
+            buddy_free(pool, ptr);
         }
+        return moved;
+    }
+    size_t k = block->kval;
+    //A colored pointer keeps its offset when it stays or is remapped
+    size_t gap = (size_t)((char *)ptr - (char *)block) - BUDDY_HEADER;
+    size_t kval = size_to_k(pool, size > pool->numbytes ? size : size + gap);
+    bool direct = wants_direct(pool, size);
+    if (kval == 0 && !direct)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        errno = ENOMEM;
+        return NULL; //Can never fit
+    }
+    //Above the threshold a block only stays when it already fits
+    if (kval != 0 && (kval <= k || (!direct && block_grow(pool, block, k, kval))))
+    {
+        if (kval < k)
+            block_shrink(pool, block, k, kval);
+        unlock_and_notify(pool);
+        return ptr;
+    }
 
-        fprintf(stderr, "Buddy address: %p\n", buddy);
-        // Update the buddy block's properties
-        buddy->tag = BLOCK_AVAIL;
-        buddy->kval = l->kval;
-        buddy->next = buddy->prev = &pool->avail[buddy->kval];
-        pool->avail[buddy->kval].next = pool->avail[buddy->kval].prev = buddy;
+    struct avail *dest;
+    size_t len = 0;
+    if (direct)
+    {
+        if (direct_hold(pool) == -1)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        len = direct_len(pool, size);
+        dest = len ? mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
+                   : MAP_FAILED;
+        if (dest == MAP_FAILED)
+        {
+            pool_lock(pool);
+            pool->direct_held--;
+            pthread_mutex_unlock(&pool->lock);
+            errno = ENOMEM;
+            return NULL; //Not enough memory
+        }
+    }
+    else
+    {
+        dest = block_alloc(pool, kval);
+        if (dest == NULL)
+        {
+            unlock_and_notify(pool);
+            errno = ENOMEM;
+            return NULL; //Not enough memory
+        }
+        pthread_mutex_unlock(&pool->lock);
     }
 
-    // Ensure the block is valid before returning
-    if (l == NULL)
+    //Both blocks are ours so the data moves without the lock. Nobody else
+    //touches the flags of our block either.
+    unsigned short flags = block->flags;
+    //A direct mapping is copied into, remapping would split it in two and
+    //a later mremap of the whole mapping would fail. Pool pages registered
+    //with io_uring must stay where the kernel pinned them.
+    bool remapped = !direct && pool->uring_k == 0 && k >= REMAP_MIN_K && k >= pool->page_shift &&
+                    block_remap(block, k, dest);
+    if (!remapped)
+        memcpy((char *)dest + BUDDY_HEADER, ptr, (UINT64_C(1) << k) - BUDDY_HEADER - gap);
+
+    pool_lock(pool);
+    //Remapping carried the old header along and left none behind
+    dest->tag = direct ? BLOCK_DIRECT : BLOCK_RESERVED;
+    dest->kval = direct ? 0 : kval;
+    dest->flags = flags;
+    if (direct)
+        direct_add(pool, dest, len);
+    if (remapped)
+    {
+        block->tag = BLOCK_RESERVED;
+        block->kval = k;
+    }
+    void *moved = (char *)dest + BUDDY_HEADER + (remapped ? gap : 0);
+    if ((flags & BLOCK_F_SAMPLED) && pool->prof != NULL)
+        prof_move(pool, ptr, moved);
+    int merged = block_release(pool, block);
+    if (remapped && k > pool->page_shift)
     {
-        fprintf(stderr, "Block is NULL\n");
-        return NULL; // Return NULL if block is invalid
+        //Only the page we wrote the header to holds anything
+        size_t first = (size_t)((char *)block - (char *)pool->base) >> pool->page_shift;
+        dirty_range(pool, first + 1, first + ((size_t)1 << (k - pool->page_shift)) - 1, false);
     }
+    released(pool, (size_t)merged);
+    unlock_and_notify(pool);
+    return moved;
+}
 
-    // Return the memory address just after the block's metadata
-    printf("\n\n\n");
-    return (void *)((char *)l + sizeof(struct avail));
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0
+#endif
+
+/**
+ * A slice of the pool that one prefault thread is responsible for.
+ */
+struct touch_range
+{
+    char *start;        /*First byte to touch*/
+    size_t len;         /*Number of bytes in the range*/
+    size_t page;        /*Page size*/
+};
+
+static void *touch_pages(void *arg)
+{
+    struct touch_range *r = arg;
+    //A read would only map the shared zero page so we have to write
+    for (size_t off = 0; off < r->len; off += r->page)
+    {
+        ((volatile char *)r->start)[off] = 0;
+    }
+    return NULL;
 }
 
-void buddy_free(struct buddy_pool *pool, void *ptr)
+/**
+ * @brief Fault in every page of the pool by writing one byte per page from
+ * several threads in parallel. Falls back to touching pages in the calling
+ * thread for any slice that could not get a thread.
+ *
+ * @param pool The pool to prefault
+ * @param threads The number of threads to use, 0 for one per cpu
+ */
+static void prefault_touch(struct buddy_pool *pool, unsigned int threads)
 {
-    if(ptr == NULL)
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t pages = pool->numbytes / page;
+    if (threads == 0)
     {
-        fprintf(stderr, "buddy_free: ptr is NULL\n");
-        return; // Nothing to free
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (unsigned int)cpus : 1;
     }
-    fprintf(stderr, "\n\n\nbuddy_free: ptr = %p\n", ptr);
-    struct avail *block = (struct avail *)((char *)ptr - sizeof(struct avail));
-    if (block == NULL)
+    //No point starting a thread for less than a few hundred kilobytes
+    if (threads > pages / 64)
+        threads = pages / 64 ? (unsigned int)(pages / 64) : 1;
+
+    pthread_t tid[threads];
+    struct touch_range ranges[threads];
+    bool started[threads];
+    size_t per = pages / threads;
+    for (unsigned int i = 0; i < threads; i++)
     {
-        fprintf(stderr, "buddy_free: Block is NULL\n");
-        return; // Nothing to free
+        size_t first = i * per;
+        size_t count = (i == threads - 1) ? pages - first : per;
+        ranges[i].start = (char *)pool->base + first * page;
+        ranges[i].len = count * page;
+        ranges[i].page = page;
+        //Thread 0 is the caller
+        started[i] = i > 0 && pthread_create(&tid[i], NULL, touch_pages, &ranges[i]) == 0;
     }
-    if (block->tag != BLOCK_RESERVED)
+    for (unsigned int i = 0; i < threads; i++)
     {
-        fprintf(stderr, "buddy_free: Block is not reserved\n");
-        return; // Block is not reserved
+        if (!started[i])
+            touch_pages(&ranges[i]);
     }
-
-    //S1 Is buddy available?
-    struct avail *buddy = buddy_calc(pool, block);
-    if (buddy == NULL)
+    for (unsigned int i = 1; i < threads; i++)
     {
-        if(block->kval == pool->kval_m){
-            block->tag = BLOCK_AVAIL;
-            block->next = &pool->avail[block->kval];
-            block->prev = &pool->avail[block->kval];
-            pool->avail[block->kval].next = block;
-            return; // Buddy calculation failed
-        }
-        fprintf(stderr, "buddy_free: Buddy calculation failed\n");
-        return; // Buddy calculation failed
-    }
-
-    if(block->kval == pool->kval_m || buddy->tag == BLOCK_RESERVED || (buddy->tag == BLOCK_AVAIL && buddy->kval != block->kval)){
-        fprintf(stderr, "Buddy is not available\n");
-        //S3 Put on list
-        block->tag = BLOCK_AVAIL;
-        buddy = pool->avail[block->kval].next;
-        block->next = buddy;
-        buddy->prev = block;
-        // block->kval = buddy->kval;
-        block->prev = &pool->avail[block->kval];
-        pool->avail[block->kval].next = block;
-    }
-    else{
-        fprintf(stderr, "Buddy is available\n");
-        while(buddy->tag == BLOCK_AVAIL && buddy->kval == block->kval){
-            //S2 Combine with buddy
-            struct avail temp_block = *block;
-
-            fprintf(stderr, "Combining with buddy\n");
-            fprintf(stderr, "Block address: %p\n", block);
-            fprintf(stderr, "Buddy address: %p\n", buddy);
-            
-            if (buddy == NULL)
-            {
-                fprintf(stderr, "buddy_free: Buddy calculation failed\n");
-                return; // Buddy calculation failed
-            }
+        if (started[i])
+            pthread_join(tid[i], NULL);
+    }
+}
 
-            buddy->prev->next = buddy->next;
-            buddy->next->prev = buddy->prev;
-            buddy->tag = BLOCK_UNUSED;
-            
-            block->kval++;
-            if (buddy != NULL && (uintptr_t)buddy < (uintptr_t)block)
-            {
-                block = buddy;
-            }
-            if(block->kval == pool->kval_m){
-                block->tag = BLOCK_AVAIL;
-                block->next = &pool->avail[block->kval];
-                block->prev = &pool->avail[block->kval];
-                pool->avail[block->kval].next = block;
+/*
+ * Process wide registry of pool address ranges so a bare pointer leads back
+ * to its pool. It is a two level radix tree over the address bits above
+ * REG_SHIFT, every leaf slot holds the pool that owns one 2^REG_SHIFT
+ * granule. Pools are mapped aligned to their size, up to the span of one
+ * top slot, so a pool either sits inside a single leaf or fills whole top
+ * slots, which then point straight at it. Leaves are installed with a
+ * compare and swap and lookups are two loads that never take a lock, so a
+ * leaf is never unmapped. There is at most one per top slot and they go
+ * away with the process.
+ */
+#define REG_SHIFT MIN_K                              /*Granule, the smallest pool*/
+#define REG_LEAF_BITS 14                             /*Granules per leaf as a power of two*/
+#define REG_TOP_SHIFT (REG_SHIFT + REG_LEAF_BITS)    /*Address bits covered by one top slot*/
+#define REG_ADDR_BITS 48                             /*Pointers above this are in no pool*/
+#define REG_POOL 0x1                                 /*Tag of a top slot that holds a pool*/
 
-                return block;
-            }
-            buddy = buddy_calc(pool, block);
+static uintptr_t registry[UINT64_C(1) << (REG_ADDR_BITS - REG_TOP_SHIFT)];
 
+/**
+ * @brief The leaf under top slot t, created if needed. Must not be called
+ * for a slot that holds a pool.
+ * @return The leaf or NULL with errno set
+ */
+static struct buddy_pool **registry_leaf(size_t t)
+{
+    uintptr_t v = __atomic_load_n(&registry[t], __ATOMIC_ACQUIRE);
+    if (v != 0)
+        return (struct buddy_pool **)v;
+    size_t len = sizeof(struct buddy_pool *) << REG_LEAF_BITS;
+    void *leaf = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (leaf == MAP_FAILED)
+        return NULL;
+    if (!__atomic_compare_exchange_n(&registry[t], &v, (uintptr_t)leaf, false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE))
+    {
+        //Another pool in the same span beat us to it
+        munmap(leaf, len);
+        return (struct buddy_pool **)v;
+    }
+    return leaf;
+}
 
-            if (buddy == NULL)
+/**
+ * @brief Point the registry for the range of pool at owner, which is the
+ * pool itself or NULL to take it out again
+ * @return 0 on success, -1 with errno set if a leaf could not be mapped
+ */
+static int registry_set(struct buddy_pool *pool, struct buddy_pool *owner)
+{
+    uintptr_t start = (uintptr_t)pool->base;
+    if ((start + pool->numbytes - 1) >> REG_ADDR_BITS)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (pool->kval_m >= REG_TOP_SHIFT)
+    {
+        //Whole top slots. A leaf left there by smaller pools that are gone
+        //stays, a lookup may still be walking it, so every granule in it
+        //points at the owner instead.
+        for (size_t t = start >> REG_TOP_SHIFT; t < (start + pool->numbytes) >> REG_TOP_SHIFT; t++)
+        {
+            uintptr_t v = __atomic_load_n(&registry[t], __ATOMIC_ACQUIRE);
+            if (v != 0 && !(v & REG_POOL))
+            {
+                struct buddy_pool **leaf = (struct buddy_pool **)v;
+                for (size_t i = 0; i < (UINT64_C(1) << REG_LEAF_BITS); i++)
+                    __atomic_store_n(&leaf[i], owner, __ATOMIC_RELEASE);
+            }
+            else
             {
-                fprintf(stderr, "buddy_free: Buddy calculation failed\n");
-                return; // Buddy calculation failed
+                __atomic_store_n(&registry[t], owner ? (uintptr_t)owner | REG_POOL : 0,
+                                 __ATOMIC_RELEASE);
             }
-           
         }
-        buddy_free(pool, &block);
+        return 0;
     }
+    size_t t = start >> REG_TOP_SHIFT;
+    struct buddy_pool **leaf = owner ? registry_leaf(t)
+                                     : (struct buddy_pool **)__atomic_load_n(&registry[t], __ATOMIC_ACQUIRE);
+    if (leaf == NULL)
+        return owner ? -1 : 0;
+    size_t first = (start >> REG_SHIFT) & ((UINT64_C(1) << REG_LEAF_BITS) - 1);
+    for (size_t i = 0; i < pool->numbytes >> REG_SHIFT; i++)
+        __atomic_store_n(&leaf[first + i], owner, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * @brief mmap the pool aligned to its size, or to one top registry slot
+ * when it is larger, so it never shares a registry granule with another.
+ */
+static void *map_aligned(size_t len, int flags)
+{
+    size_t align = len < (UINT64_C(1) << REG_TOP_SHIFT) ? len : UINT64_C(1) << REG_TOP_SHIFT;
+    char *r = mmap(NULL, len + align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (r == MAP_FAILED)
+        return MAP_FAILED;
+    char *a = (char *)(((uintptr_t)r + align - 1) & ~(uintptr_t)(align - 1));
+    if (mmap(a, len, PROT_READ | PROT_WRITE, flags | MAP_FIXED, -1, 0) == MAP_FAILED)
+    {
+        int err = errno;
+        munmap(r, len + align);
+        errno = err;
+        return MAP_FAILED;
+    }
+    if (a > r)
+        munmap(r, (size_t)(a - r));
+    if (a + len < r + len + align)
+        munmap(a + len, (size_t)(r + align - a));
+    return a;
+}
 
+struct buddy_pool *buddy_owner(const void *ptr)
+{
+    uintptr_t addr = (uintptr_t)ptr;
+    if (addr >> REG_ADDR_BITS)
+        return NULL;
+    uintptr_t v = __atomic_load_n(&registry[addr >> REG_TOP_SHIFT], __ATOMIC_ACQUIRE);
+    if (v & REG_POOL)
+        return (struct buddy_pool *)(v & ~(uintptr_t)REG_POOL);
+    if (v == 0)
+        return NULL;
+    struct buddy_pool **leaf = (struct buddy_pool **)v;
+    return __atomic_load_n(&leaf[(addr >> REG_SHIFT) & ((UINT64_C(1) << REG_LEAF_BITS) - 1)],
+                           __ATOMIC_ACQUIRE);
 }
 
-// /**
-//  * @brief This is a simple version of realloc.
-//  *
-//  * @param poolThe memory pool
-//  * @param ptr  The user memory
-//  * @param size the new size requested
-//  * @return void* pointer to the new user memory
-//  */
-// void *buddy_realloc(struct buddy_pool *pool, void *ptr, size_t size)
-// {
-//     //Required for Grad Students
-//     //Optional for Undergrad Students
-// }
+void buddy_free_any(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return; // Nothing to free
+    }
+    struct buddy_pool *pool = buddy_owner(ptr);
+    if (pool == NULL)
+    {
+        fprintf(stderr, "buddy_free_any: %p is not in any pool\n", ptr);
+        return;
+    }
+    buddy_free(pool, ptr);
+}
 
-void buddy_init(struct buddy_pool *pool, size_t size)
+size_t buddy_usable_size(const void *ptr)
+{
+    struct buddy_pool *pool = ptr ? buddy_owner(ptr) : NULL;
+    if (pool == NULL)
+        return 0;
+    struct avail *block;
+    size_t k;
+    if (pool->headerless)
+    {
+        //Nodes above ours change under other threads, walk under the lock
+        uintptr_t off = (uintptr_t)((const char *)ptr - (char *)pool->base);
+        pool_lock(pool);
+        bool avail = block_at(pool, off, &k);
+        pthread_mutex_unlock(&pool->lock);
+        if (avail || (off & ((UINT64_C(1) << k) - 1)) != 0)
+            return 0;
+        block = (struct avail *)ptr;
+    }
+    else
+    {
+        //The header of a block the caller owns does not change under us
+        block = ptr_block((void *)ptr);
+        if (!block_reserved(pool, block))
+            return 0;
+        if (block->flags & BLOCK_F_EXACT)
+            return (size_t)((char *)avail_from_link(pool, block->next) - (const char *)ptr);
+        k = block->kval;
+    }
+    return (size_t)((char *)block + (UINT64_C(1) << k) - (const char *)ptr);
+}
+
+int buddy_init_opts(struct buddy_pool *pool, size_t size, const struct buddy_opts *opts)
 {
+    static const struct buddy_opts defaults = {0};
+    if (opts == NULL)
+        opts = &defaults;
+    if (opts->prefault < BUDDY_PREFAULT_NONE || opts->prefault > BUDDY_PREFAULT_TOUCH ||
+        opts->engine < BUDDY_ENGINE_LIST || opts->engine > BUDDY_ENGINE_TREE ||
+        opts->policy < BUDDY_POLICY_LIFO || opts->policy > BUDDY_POLICY_ADDRESS ||
+        (opts->headerless && (opts->engine != BUDDY_ENGINE_TREE || opts->color)) ||
+        (opts->exact_fit != 0 && (opts->engine != BUDDY_ENGINE_TREE || opts->headerless)))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
     size_t kval = 0;
     if (size == 0)
         kval = DEFAULT_K;
@@ -275,53 +3719,232 @@ void buddy_init(struct buddy_pool *pool, size_t size)
 
     if (kval < MIN_K)
         kval = MIN_K;
-    if (kval > MAX_K)
+    if (kval >= MAX_K)
         kval = MAX_K - 1;
 
     //make sure pool struct is cleared out
     memset(pool,0,sizeof(struct buddy_pool));
     pool->kval_m = kval;
     pool->numbytes = (UINT64_C(1) << pool->kval_m);
-    //Memory map a block of raw memory to manage
-
-    pool->base = mmap(
-        NULL,                               /*addr to map to*/
-        pool->numbytes,                     /*length*/
-        PROT_READ | PROT_WRITE,             /*prot*/
-        MAP_PRIVATE | MAP_ANONYMOUS,        /*flags*/
-        -1,                                 /*fd -1 when using MAP_ANONYMOUS*/
-        0                                   /* offset 0 when using MAP_ANONYMOUS*/
-    );
+    pool->engine = opts->engine;
+    pool->policy = opts->policy;
+    pool->mmap_threshold = opts->mmap_threshold;
+    pool->color = opts->color;
+    pool->headerless = opts->headerless;
+    pool->exact_fit = opts->exact_fit;
+
+    //A lazy pool is never backed up front so we do not want the kernel to
+    //account for swap on a mapping that may be far larger than ram.
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if (opts->prefault == BUDDY_PREFAULT_NONE)
+        flags |= MAP_NORESERVE;
+    else if (opts->prefault == BUDDY_PREFAULT_POPULATE)
+        flags |= MAP_POPULATE;
+
+    //Memory map a block of raw memory to manage, aligned for the registry
+    pool->base = map_aligned(pool->numbytes, flags);
     if (MAP_FAILED == pool->base)
     {
-        handle_error_and_die("buddy_init avail array mmap failed");
+        int err = errno;
+        memset(pool,0,sizeof(struct buddy_pool));
+        errno = err;
+        return -1;
     }
 
+    if (opts->prefault == BUDDY_PREFAULT_TOUCH)
+        prefault_touch(pool, opts->threads);
+
     //Set all blocks to empty. We are using circular lists so the first elements just point
     //to an available block. Thus the tag, and kval feild are unused burning a small bit of
     //memory but making the code more readable. We mark these blocks as UNUSED to aid in debugging.
     for (size_t i = 0; i <= kval; i++)
     {
-        pool->avail[i].next = pool->avail[i].prev = &pool->avail[i];
+        pool->avail[i].next = pool->avail[i].prev = avail_to_link(pool, &pool->avail[i]);
         pool->avail[i].kval = i;
         pool->avail[i].tag = BLOCK_UNUSED;
     }
 
-    //Add in the first block
-    pool->avail[kval].next = pool->avail[kval].prev = (struct avail *)pool->base;
-    struct avail *m = pool->avail[kval].next;
-    m->tag = BLOCK_AVAIL;
-    m->kval = kval;
-    m->next = m->prev = &pool->avail[kval];
+    //One dirty bit per page, a zeroed mapping says every page reads as zero
+    pool->page_shift = (size_t)__builtin_ctzll((uint64_t)sysconf(_SC_PAGESIZE));
+    long llc = -1;
+#ifdef _SC_LEVEL3_CACHE_SIZE
+    llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+#endif
+    pool->stream_bytes = llc > 0 ? (size_t)llc / 4 * 3 : CALLOC_STREAM_BYTES;
+    pool->dirty_bytes = (((pool->numbytes >> pool->page_shift) + 63) / 64) * sizeof(uint64_t);
+    pool->dirty = mmap(NULL, pool->dirty_bytes, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (MAP_FAILED == pool->dirty)
+    {
+        int err = errno;
+        munmap(pool->base, pool->numbytes);
+        memset(pool,0,sizeof(struct buddy_pool));
+        errno = err;
+        return -1;
+    }
+
+    pool->nfree[kval] = 1;
+    pool->free_bytes = pool->numbytes;
+    if (pool->engine == BUDDY_ENGINE_TREE)
+    {
+        //One byte per node down to SMALLEST_K. The mapping starts out zeroed
+        //which is exactly a tree describing one free block.
+        pool->tree_bytes = UINT64_C(1) << (kval - SMALLEST_K + 1);
+        pool->tree = mmap(NULL, pool->tree_bytes, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (MAP_FAILED == pool->tree)
+        {
+            int err = errno;
+            munmap(pool->base, pool->numbytes);
+            munmap(pool->dirty, pool->dirty_bytes);
+            memset(pool,0,sizeof(struct buddy_pool));
+            errno = err;
+            return -1;
+        }
+    }
+    else
+    {
+        //Add in the first block. This is the only write to the pool so a lazy
+        //pool has exactly one page resident after init.
+        struct avail *m = (struct avail *)pool->base;
+        pool->avail[kval].next = pool->avail[kval].prev = avail_to_link(pool, m);
+        m->tag = BLOCK_AVAIL;
+        m->kval = kval;
+        m->next = m->prev = avail_to_link(pool, &pool->avail[kval]);
+
+        if (opts->policy == BUDDY_POLICY_ADDRESS)
+        {
+            //Bitmaps for every order in one lazy mapping, zeroed means empty
+            for (size_t k = SMALLEST_K; k <= kval; k++)
+                pool->bits_bytes += bits_size(kval - k) * sizeof(uint64_t);
+            uint64_t *bits = mmap(NULL, pool->bits_bytes, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (MAP_FAILED == bits)
+            {
+                int err = errno;
+                munmap(pool->base, pool->numbytes);
+                munmap(pool->dirty, pool->dirty_bytes);
+                memset(pool,0,sizeof(struct buddy_pool));
+                errno = err;
+                return -1;
+            }
+            for (size_t k = SMALLEST_K; k <= kval; k++)
+            {
+                pool->free_bits[k] = bits;
+                bits += bits_size(kval - k);
+            }
+            bits_set(pool, m, kval);
+        }
+    }
+    //Waiters time out against the monotonic clock so wall clock jumps do
+    //not stretch or cut short a timeout
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    for (size_t k = 0; k < MAX_K; k++)
+        pthread_cond_init(&pool->wait_cv[k], &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&pool->lock, NULL);
+
+    //Set the emergency reserve aside, it must fit completely
+    for (size_t k = 0; k < MAX_K; k++)
+    {
+        if (opts->reserve[k] == 0)
+            continue;
+        if (k < SMALLEST_K || k > kval)
+        {
+            buddy_destroy(pool);
+            errno = EINVAL;
+            return -1;
+        }
+        pool->reserve_want[k] = opts->reserve[k];
+        pool->reserve_mask |= UINT64_C(1) << k;
+    }
+    reserve_refill(pool);
+    if (pool->reserve_mask != 0)
+    {
+        buddy_destroy(pool);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    //Split the pool up front the way the caller expects it to be used,
+    //smallest first so the halves left over count towards bigger orders
+    for (size_t k = 0; k < MAX_K; k++)
+    {
+        if (opts->presplit[k] != 0 && (k < SMALLEST_K || k > kval))
+        {
+            buddy_destroy(pool);
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    if (pool->engine == BUDDY_ENGINE_LIST)
+    {
+        for (size_t k = SMALLEST_K; k < kval; k++)
+        {
+            while (pool->nfree[k] < opts->presplit[k] && presplit_one(pool, k))
+                ;
+        }
+    }
+
+    if (registry_set(pool, pool) == -1)
+    {
+        int err = errno;
+        buddy_destroy(pool);
+        errno = err;
+        return -1;
+    }
+    buddy_probe3(init, pool, pool->base, pool->numbytes);
+    return 0;
+}
+
+void buddy_init(struct buddy_pool *pool, size_t size)
+{
+    if (buddy_init_opts(pool, size, NULL) == -1)
+    {
+        handle_error_and_die("buddy_init avail array mmap failed");
+    }
 }
 
 void buddy_destroy(struct buddy_pool *pool)
 {
+    buddy_probe1(destroy, pool);
+    buddy_prezero_stop(pool);
+    registry_set(pool, NULL);
+    if (pool->uring_k != 0)
+        buddy_uring_unregister(pool);
     int rval = munmap(pool->base, pool->numbytes);
     if (-1 == rval)
     {
         handle_error_and_die("buddy_destroy avail array");
     }
+    if (pool->tree != NULL && munmap(pool->tree, pool->tree_bytes) == -1)
+    {
+        handle_error_and_die("buddy_destroy tree");
+    }
+    if (pool->dirty != NULL && munmap(pool->dirty, pool->dirty_bytes) == -1)
+    {
+        handle_error_and_die("buddy_destroy dirty pages");
+    }
+    if (pool->free_bits[SMALLEST_K] != NULL &&
+        munmap(pool->free_bits[SMALLEST_K], pool->bits_bytes) == -1)
+    {
+        handle_error_and_die("buddy_destroy bitmaps");
+    }
+    for (size_t i = 0; i < pool->ndirect; i++)
+    {
+        if (munmap(pool->direct[i].block, pool->direct[i].len) == -1)
+        {
+            handle_error_and_die("buddy_destroy direct mapping");
+        }
+    }
+    free(pool->direct);
+    free(pool->handles);
+    buddy_prof_stop(pool);
+    for (size_t k = 0; k < MAX_K; k++)
+        pthread_cond_destroy(&pool->wait_cv[k]);
+    pthread_mutex_destroy(&pool->lock);
     //Zero out the array so it can be reused it needed
     memset(pool,0,sizeof(struct buddy_pool));
 }
@@ -4,8 +4,37 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 
+/**
+ * Defined when the library is built with USDT probes. They need <sys/sdt.h>
+ * (systemtap-sdt-dev) and can be turned off with -DBUDDY_NO_SDT.
+ */
+#if !defined(BUDDY_NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define BUDDY_HAVE_SDT 1
+#endif
+#endif
+
+/**
+ * Defined when pools can be registered as io_uring fixed buffers. It needs
+ * <linux/io_uring.h> and can be turned off with -DBUDDY_NO_URING.
+ */
+#if !defined(BUDDY_NO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define BUDDY_HAVE_URING 1
+#endif
+#endif
+
+/**
+ * Building with -DBUDDY_COMPACT_HEADER shrinks the header in front of every
+ * allocation from 24 to 8 bytes. The free list links become 32 bit offsets
+ * from the pool base in units of the smallest block, which caps a pool at
+ * 32GiB, and the smallest block drops to 16 bytes.
+ */
 #ifdef __cplusplus
 extern "C"
 {
@@ -24,32 +53,142 @@ extern "C"
   /**
    * The maximum size of the buddy memory pool. This is 1 larger than needed
    * to allow indexes 1-N instead of 0-N. Internally the maximum amount of
-   * memory is MAX_K-1
+   * memory is MAX_K-1. Pools are mapped aligned with up to 2^34 bytes of
+   * slack, so the largest pool is 64TiB and still fits in a 47 bit address
+   * space.
    */
-#define MAX_K 48
+#ifdef BUDDY_COMPACT_HEADER
+#define MAX_K 36
+#else
+#define MAX_K 47
+#endif
 
   /**
    * The smallest memory block size that can be returned by buddy_malloc value must
    * be large enough to account for the avail header.
    */
+#ifdef BUDDY_COMPACT_HEADER
+#define SMALLEST_K 4
+#else
 #define SMALLEST_K 6
+#endif
+
+#define BUDDY_PREFAULT_NONE     0  /*Map lazily, pages fault in on first touch*/
+#define BUDDY_PREFAULT_POPULATE 1  /*Ask the kernel to populate the mapping up front*/
+#define BUDDY_PREFAULT_TOUCH    2  /*Touch every page from a set of threads*/
+
+#define BUDDY_ENGINE_LIST 0  /*Free lists threaded through the free blocks*/
+#define BUDDY_ENGINE_TREE 1  /*Implicit binary tree kept outside of the pool*/
+
+#define BUDDY_POLICY_LIFO    0  /*Reuse the most recently freed block of an order*/
+#define BUDDY_POLICY_ADDRESS 1  /*Always use the lowest address free block of an order*/
+
+#define BUDDY_CRITICAL 0x1  /*buddy_malloc_flags: may use the emergency reserve*/
+
+#define BUDDY_PRESSURE_OK  0  /*Free memory is back above the high watermarks*/
+#define BUDDY_PRESSURE_LOW 1  /*Free memory fell below a low watermark*/
 
 #define BLOCK_AVAIL    1  /*Block is available to allocate*/
 #define BLOCK_RESERVED 0  /*Block has been handed to user*/
+#define BLOCK_DIRECT   2  /*Block has a mapping of its own outside the pool*/
 #define BLOCK_UNUSED   3  /*Block is not used at all*/
+#define BLOCK_COLORED  4  /*Stand in header of a colored pointer, kval is its offset in cache lines*/
 
   /**
    * Struct to represent the table of all available blocks do not reorder members
    * of this struct because internal calculations depend on the ordering.
    */
+#ifdef BUDDY_COMPACT_HEADER
+  /**
+   * A link is the offset of a block from the pool base in units of
+   * 2^SMALLEST_K. The top values stand for NULL and the list heads.
+   */
+  typedef uint32_t avail_link;
+
+  struct avail
+  {
+    unsigned short int tag : 3;   /*Tag for block status BLOCK_AVAIL, BLOCK_RESERVED*/
+    unsigned short int kval : 6;  /*The kval of this block*/
+    unsigned short int flags : 7; /*Internal bookkeeping bits*/
+    avail_link next;              /*next memory block*/
+    avail_link prev;              /*prev memory block, past the header so free blocks only*/
+  };
+
+  /**
+   * Bytes in front of every pointer handed out. Allocated blocks only keep
+   * the tag, kval and flags.
+   */
+#define BUDDY_HEADER 8
+#else
+  typedef struct avail *avail_link;
+
   struct avail
   {
     unsigned short int tag;     /*Tag for block status BLOCK_AVAIL, BLOCK_RESERVED*/
     unsigned short int kval;    /*The kval of this block*/
+    unsigned short int flags;   /*Internal bookkeeping bits, fills padding*/
     struct avail *next;         /*next memory block*/
     struct avail *prev;         /*prev memory block*/
   };
 
+  /**
+   * Bytes in front of every pointer handed out
+   */
+#define BUDDY_HEADER sizeof(struct avail)
+#endif
+
+  /**
+   * Bytes in front of every pointer a child pool hands out. Blocks in use
+   * stay linked so they keep the whole header, not just BUDDY_HEADER.
+   */
+#define BUDDY_CHILD_HEADER ((sizeof(struct avail) + 7) & ~(size_t)7)
+
+  /**
+   * Options for buddy_init_opts. A zeroed struct gives the same pool as
+   * buddy_init.
+   */
+  struct buddy_opts
+  {
+    int prefault;               /*How page faults are paid, one of BUDDY_PREFAULT_* */
+    unsigned int threads;       /*Threads for BUDDY_PREFAULT_TOUCH, 0 for one per cpu*/
+    int engine;                 /*Allocator engine, one of BUDDY_ENGINE_* */
+    int policy;                 /*Which free block to hand out, one of BUDDY_POLICY_* */
+    size_t reserve[MAX_K];      /*Blocks of each k value held back for BUDDY_CRITICAL*/
+    size_t mmap_threshold;      /*Requests above this many bytes get their own mapping, 0 for never*/
+    size_t presplit[MAX_K];     /*Free blocks of each k value to split the pool into up front*/
+    bool color;                 /*Spread object starts across cache sets using block slack*/
+    bool headerless;            /*Hand out block starts with no header in front, tree engine only*/
+    size_t exact_fit;           /*Requests of at least this many bytes keep only the pages they need, 0 for never*/
+  };
+
+  struct buddy_handle;
+  struct buddy_direct;
+  struct buddy_prof;
+  struct buddy_pool;
+
+  /**
+   * Called when a pool crosses its watermarks with level set to one of
+   * BUDDY_PRESSURE_*. It runs on the thread whose malloc or free crossed the
+   * line, after the pool lock was dropped, so it may call back into the pool.
+   * When a child pool borrowed or gave back the blocks it runs with the
+   * child lock held and must not call into that child.
+   */
+  typedef void (*buddy_pressure_fn)(struct buddy_pool *pool, int level, void *arg);
+
+  /**
+   * Watermarks for buddy_set_watermarks. The pool reports BUDDY_PRESSURE_LOW
+   * once free memory drops below either low mark and BUDDY_PRESSURE_OK once
+   * it is back at or above both high marks. Zero disables a mark.
+   */
+  struct buddy_watermarks
+  {
+    size_t low_bytes;           /*Free bytes below this are low*/
+    size_t high_bytes;          /*Free bytes needed to be ok again*/
+    size_t low_k;               /*A largest free block below this k value is low*/
+    size_t high_k;              /*Largest free k value needed to be ok again*/
+    unsigned int min_interval_ms; /*Least time between two callbacks*/
+  };
+
   /**
    * The buddy memory pool.
    */
@@ -59,6 +198,146 @@ extern "C"
     size_t numbytes;            /*The number of bytes this pool is managing*/
     void *base;                 /*Base address used to scale memory for buddy calculations*/
     struct avail avail[MAX_K];  /*The array of available memory blocks*/
+    size_t nfree[MAX_K];        /*Number of free blocks of each k value*/
+    int engine;                 /*The engine managing free space BUDDY_ENGINE_* */
+    unsigned char *tree;        /*Free space tree used by BUDDY_ENGINE_TREE*/
+    size_t tree_bytes;          /*Size of the tree mapping*/
+    int policy;                 /*Which free block to hand out BUDDY_POLICY_* */
+    uint64_t *free_bits[MAX_K]; /*Per k bitmap of free blocks for BUDDY_POLICY_ADDRESS*/
+    size_t bits_bytes;          /*Size of the bitmap mapping*/
+    uint64_t *dirty;            /*Bit per page, set once a page may hold old data*/
+    size_t dirty_bytes;         /*Size of the dirty page bitmap mapping*/
+    size_t page_shift;          /*log2 of the page size*/
+    size_t stream_bytes;        /*buddy_calloc clears runs this big bypassing the cache*/
+    struct buddy_handle *handles; /*Table of relocatable allocations*/
+    size_t nhandles;            /*Slots of the handle table in use*/
+    size_t handle_cap;          /*Slots allocated for the handle table*/
+    uint32_t handle_free;       /*First free handle slot + 1, 0 if none*/
+    struct buddy_prof *prof;    /*Heap profiler state, NULL when not sampling*/
+    int64_t prof_left;          /*Bytes to allocate before the next sample*/
+    pthread_mutex_t lock;       /*Serializes every operation on the pool*/
+    bool prezero_on;            /*The prezero thread is running*/
+    bool prezero_yield;         /*Set by everyone taking the lock while the thread runs*/
+    pthread_cond_t wait_cv[MAX_K]; /*buddy_malloc_wait callers sleep on the k value they need*/
+    size_t waiters[MAX_K];      /*Number of callers sleeping on each wait_cv*/
+    uint64_t wait_mask;         /*Bit k is set while waiters[k] is non zero*/
+    struct avail *reserve[MAX_K]; /*Blocks held back for BUDDY_CRITICAL, linked through next*/
+    size_t reserve_have[MAX_K]; /*Blocks on each reserve list*/
+    size_t reserve_want[MAX_K]; /*Blocks each reserve list is refilled to*/
+    uint64_t reserve_mask;      /*Bit k is set while reserve k is short*/
+    size_t free_bytes;          /*Bytes in free blocks*/
+    buddy_pressure_fn pressure_fn; /*Watermark callback, NULL when not watching*/
+    void *pressure_arg;         /*Argument for pressure_fn*/
+    struct buddy_watermarks wm; /*When to call pressure_fn*/
+    int pressure;               /*Level last reported BUDDY_PRESSURE_* */
+    uint64_t pressure_ns;       /*Monotonic time of the last callback, 0 if none*/
+    size_t calloc_calls;        /*Calls to buddy_calloc that got memory*/
+    size_t calloc_hits;         /*Of those, calls that had nothing to clear*/
+    size_t prezero_bytes;       /*Bytes cleared by the prezero thread*/
+    pthread_t prezero_tid;      /*Background thread clearing free blocks*/
+    pthread_cond_t prezero_cv;  /*The prezero thread sleeps here*/
+    bool prezero_stop;          /*Tells the prezero thread to exit*/
+    unsigned int prezero_pct;   /*Share of one cpu the prezero thread may use*/
+    size_t mmap_threshold;      /*Requests above this many bytes get their own mapping, 0 for never*/
+    struct buddy_direct *direct; /*Table of mappings handed out above mmap_threshold*/
+    size_t ndirect;             /*Slots of the direct table in use*/
+    size_t direct_cap;          /*Slots allocated for the direct table*/
+    size_t direct_held;         /*Slots kept free for mappings being moved*/
+    size_t live[MAX_K];         /*Allocated blocks of each k value*/
+    size_t live_peak[MAX_K];    /*Most blocks of each k value allocated at once*/
+    bool split_free;            /*Free lists may hold free buddies left by presplitting*/
+    bool color;                 /*Spread object starts across cache sets using block slack*/
+    size_t color_next[MAX_K];   /*Next cache line offset to hand out for each k value*/
+    bool headerless;            /*Pointers are block starts, sizes live in the tree only*/
+    size_t exact_fit;           /*Requests of at least this many bytes keep only the pages they need, 0 for never*/
+    int uring_fd;               /*io_uring the pool is registered with as fixed buffers*/
+    size_t uring_k;             /*log2 of each registered buffer, 0 when not registered*/
+  };
+
+#ifdef BUDDY_COMPACT_HEADER
+#define LINK_NULL UINT32_MAX           /*Link that stands for NULL*/
+#define LINK_HEAD (UINT32_MAX - MAX_K) /*LINK_HEAD + k stands for pool->avail[k]*/
+
+  /**
+   * The block a link of pool points to
+   */
+  static inline struct avail *avail_from_link(struct buddy_pool *pool, avail_link v)
+  {
+    if (v >= LINK_HEAD)
+      return v == LINK_NULL ? NULL : &pool->avail[v - LINK_HEAD];
+    return (struct avail *)((char *)pool->base + ((size_t)v << SMALLEST_K));
+  }
+
+  /**
+   * The link that points to a block of pool, one of its list heads or NULL
+   */
+  static inline avail_link avail_to_link(struct buddy_pool *pool, struct avail *block)
+  {
+    if (block == NULL)
+      return LINK_NULL;
+    if (block >= pool->avail && block < pool->avail + MAX_K)
+      return LINK_HEAD + (avail_link)(block - pool->avail);
+    return (avail_link)((size_t)((char *)block - (char *)pool->base) >> SMALLEST_K);
+  }
+#else
+  static inline struct avail *avail_from_link(struct buddy_pool *pool, avail_link v)
+  {
+    (void)pool;
+    return v;
+  }
+
+  static inline avail_link avail_to_link(struct buddy_pool *pool, struct avail *block)
+  {
+    (void)pool;
+    return block;
+  }
+#endif
+
+  /**
+   * A snapshot of the free space in a pool.
+   */
+  struct buddy_stats
+  {
+    size_t numbytes;            /*The number of bytes the pool is managing*/
+    size_t free_bytes;          /*Bytes in free blocks*/
+    size_t largest_free_k;      /*K value of the largest free block, 0 if none*/
+    size_t nfree[MAX_K];        /*Number of free blocks of each k value*/
+    size_t reserved[MAX_K];     /*Emergency reserve blocks held of each k value*/
+    size_t calloc_calls;        /*Calls to buddy_calloc that got memory*/
+    size_t calloc_hits;         /*Of those, calls whose memory was already zero*/
+    size_t prezero_bytes;       /*Bytes cleared by the prezero thread*/
+    size_t direct_maps;         /*Allocations with a mapping of their own*/
+    size_t direct_bytes;        /*Bytes mapped for them*/
+  };
+
+  /**
+   * What a call to buddy_compact did.
+   */
+  struct buddy_compact_report
+  {
+    size_t moved_blocks;        /*Blocks copied to a new location*/
+    size_t moved_bytes;         /*Bytes of the blocks that were moved*/
+    size_t reclaimed[MAX_K];    /*Free blocks of each k value created by emptying regions*/
+    size_t largest_before;      /*K value of the largest free block before compacting*/
+    size_t largest_after;       /*K value of the largest free block after compacting*/
+  };
+
+  /**
+   * A child pool that borrows blocks from a parent buddy_pool under a byte
+   * quota. Blocks it hands out are linked through their headers on inuse and
+   * freed blocks are cached on free[k] so most calls never touch the parent.
+   */
+  struct buddy_child
+  {
+    struct buddy_pool *parent;  /*The pool blocks are borrowed from*/
+    pthread_mutex_t lock;       /*Serializes every operation on the child*/
+    size_t quota;               /*Most bytes the child may hold*/
+    size_t soft_limit;          /*Cached blocks above this many bytes go back*/
+    size_t held;                /*Bytes of blocks borrowed from the parent*/
+    size_t used;                /*Bytes of blocks handed to the user*/
+    struct avail *inuse;        /*List of blocks handed to the user, NULL terminated*/
+    struct avail *free[MAX_K];  /*Cached free blocks of each k value, linked through next*/
+    size_t nfree[MAX_K];        /*Number of cached blocks of each k value*/
   };
 
   /**
@@ -85,12 +364,62 @@ extern "C"
    * If size is zero, the return value will be NULL
    * If pool is NULL, the return value will be NULL
    *
+   * A request above the mmap threshold of the pool gets a mapping of its
+   * own so that one huge block does not split the pool. buddy_free,
+   * buddy_realloc and buddy_free_batch tell these apart from pool blocks.
+   *
    * @param pool The memory pool to alloc from
    * @param size The size of the user requested memory block in bytes
    * @return A pointer to the memory block
    */
   void *buddy_malloc(struct buddy_pool *pool, size_t size);
 
+  /**
+   * Same as buddy_malloc but if the pool cannot serve the request right now
+   * the caller sleeps until a free (or buddy_compact) makes a block large
+   * enough and then tries again. Frees only wake callers whose request fits
+   * in the block the free merged into so small frees do not disturb callers
+   * waiting for large blocks.
+   *
+   * A timeout_ms of 0 makes a single attempt and -1 waits forever.
+   *
+   * @param pool The memory pool to alloc from
+   * @param size The size of the user requested memory block in bytes
+   * @param timeout_ms The longest time to wait in milliseconds
+   * @return A pointer to the memory block or NULL with errno set to
+   * ETIMEDOUT if the time ran out, or ENOMEM if the request can never fit
+   */
+  void *buddy_malloc_wait(struct buddy_pool *pool, size_t size, int timeout_ms);
+
+  /**
+   * Same as buddy_malloc with flags. With BUDDY_CRITICAL a request the pool
+   * cannot serve is taken from the emergency reserve set up with
+   * buddy_opts.reserve, using the smallest reserve block that fits. The
+   * block is freed with buddy_free like any other, and the reserve is
+   * refilled by later frees as soon as the pool has the memory again.
+   *
+   * @param pool The memory pool to alloc from
+   * @param size The size of the user requested memory block in bytes
+   * @param flags Zero or BUDDY_CRITICAL
+   * @return A pointer to the memory block, NULL with errno set to ENOMEM
+   */
+  void *buddy_malloc_flags(struct buddy_pool *pool, size_t size, int flags);
+
+  /**
+   * Same as buddy_malloc but also reports how much of the block can be used.
+   * A request is rounded up to a power of two block, a 600 byte request
+   * gets a 1KiB block, so a growable buffer can take the whole block and
+   * grow later. The block may be resized with buddy_realloc and freed with
+   * buddy_free_sized using *actual as its size.
+   *
+   * @param pool The memory pool to alloc from
+   * @param min_size The least number of bytes needed
+   * @param actual Set to the usable bytes at the returned pointer, at least
+   * min_size, may be NULL
+   * @return A pointer to the memory block, NULL with errno set to ENOMEM
+   */
+  void *buddy_malloc_at_least(struct buddy_pool *pool, size_t min_size, size_t *actual);
+
   /**
    * A block of memory previously allocated by a call to malloc,
    * calloc or realloc is deallocated, making it available again
@@ -108,6 +437,213 @@ extern "C"
    */
   void buddy_free(struct buddy_pool *pool, void *ptr);
 
+  /**
+   * Same as buddy_free for callers that know the size they asked for. The
+   * block size comes from size alone so the header in front of ptr is never
+   * read and a cold object is freed without pulling its first line into the
+   * cache. The tree engine only touches its own tree, the list engine still
+   * writes the header to put the block on a free list.
+   *
+   * The tree engine reports a size that does not match the block as not
+   * reserved, with the list engine it corrupts the pool. BUDDY_CRITICAL
+   * requests may get a larger reserve block and must use buddy_free.
+   * Colored pointers and pools being profiled fall back to reading the header.
+   *
+   * @param pool The memory pool
+   * @param ptr Pointer to the memory block to free
+   * @param size The size passed to the malloc, calloc (nmemb * size) or
+   * realloc call that returned ptr
+   */
+  void buddy_free_sized(struct buddy_pool *pool, void *ptr, size_t size);
+
+  /**
+   * The pool whose range ptr falls in. Every pool registers its range in a
+   * process wide radix tree when it is initialized and leaves it when it is
+   * destroyed, a lookup is two loads and takes no lock. Mappings handed out
+   * above the mmap threshold are outside every pool and are not found.
+   *
+   * @param ptr Any address
+   * @return The pool or NULL if ptr is in no pool
+   */
+  struct buddy_pool *buddy_owner(const void *ptr);
+
+  /**
+   * buddy_free for callers that do not keep track of the pool. Pointers
+   * from child pools and handles must still go back through their own
+   * calls, a pointer that is in no pool is reported and ignored.
+   *
+   * @param ptr Pointer returned by malloc, calloc or realloc of any pool
+   */
+  void buddy_free_any(void *ptr);
+
+  /**
+   * Bytes that can be used at ptr, from ptr to the end of its block. This
+   * is at least the size asked for and often more.
+   *
+   * @param ptr Pointer returned by malloc, calloc or realloc of any pool
+   * @return The usable size or 0 if ptr is not an allocated block of a pool
+   */
+  size_t buddy_usable_size(const void *ptr);
+
+  /**
+   * Allocates n blocks of size bytes each with one trip through the pool.
+   * The blocks are cut from as few large blocks as possible, so a batch is
+   * mostly contiguous. If the pool runs out part way the blocks allocated so
+   * far are kept and errno is set to ENOMEM. Batches always come from the
+   * pool, whatever the mmap threshold.
+   *
+   * @param pool The memory pool to alloc from
+   * @param size The size of each block in bytes
+   * @param n The number of blocks wanted
+   * @param out Receives the pointers, room for n
+   * @return The number of blocks allocated
+   */
+  size_t buddy_malloc_batch(struct buddy_pool *pool, size_t size, size_t n, void **out);
+
+  /**
+   * Allocates memory for an array of nmemb elements of size bytes each and
+   * returns a pointer to the allocated memory. The memory is set to zero.
+   * Only pages that may hold old data are cleared, memory that was never
+   * handed out or was given back with buddy_purge is already zero and is
+   * not touched. Large runs are cleared with stores that bypass the cache.
+   *
+   * If nmemb * size overflows, errno is set to ENOMEM and NULL is returned
+   *
+   * @param pool The memory pool to alloc from
+   * @param nmemb The number of elements
+   * @param size The size of each element in bytes
+   * @return A pointer to the zeroed memory block
+   */
+  void *buddy_calloc(struct buddy_pool *pool, size_t nmemb, size_t size);
+
+  /**
+   * Gives the pages of free blocks that hold old data back to the kernel
+   * with MADV_DONTNEED. The pages read as zero afterwards so buddy_calloc
+   * does not have to clear them. Only free blocks of at least a page are
+   * purged. A pool registered with buddy_uring_register is never purged.
+   *
+   * @param pool The memory pool
+   * @return The number of bytes given back
+   */
+  size_t buddy_purge(struct buddy_pool *pool);
+
+  /**
+   * Starts a background thread that clears dirty free blocks of a page or
+   * more while the pool is idle so later buddy_calloc calls find them zero.
+   * It backs off as soon as anything is allocated or freed and only resumes
+   * after the pool has been quiet for a while. It holds the pool lock for
+   * one small chunk at a time and sleeps so that it uses at most cpu_pct
+   * percent of one cpu.
+   *
+   * @param pool The memory pool
+   * @param cpu_pct Share of one cpu the thread may use, 1 to 100
+   * @return 0 on success, -1 with errno set to EINVAL for a bad cpu_pct,
+   * EBUSY if the thread already runs or the error of pthread_create
+   */
+  int buddy_prezero_start(struct buddy_pool *pool, unsigned int cpu_pct);
+
+  /**
+   * Stops the prezero thread and waits for it to exit. Does nothing if it
+   * is not running. buddy_destroy calls this.
+   *
+   * @param pool The memory pool
+   */
+  void buddy_prezero_stop(struct buddy_pool *pool);
+
+  /**
+   * Frees n blocks with one trip through the pool. When the blocks are in
+   * address order, as buddy_malloc_batch hands them out, buddies inside the
+   * batch are joined before they go back so the batch is released as a
+   * handful of large blocks. Otherwise they are released one by one in the
+   * order given. NULL entries are skipped.
+   *
+   * The ptrs array is used as scratch space and its contents are lost.
+   *
+   * @param pool The memory pool
+   * @param ptrs The blocks to free
+   * @param n The number of entries in ptrs
+   */
+  void buddy_free_batch(struct buddy_pool *pool, void **ptrs, size_t n);
+
+  /**
+   * Allocates size bytes as one or more blocks for readv/writev when no
+   * single free block is large enough. The request is served whole if it
+   * can be, otherwise the largest free blocks are taken first so the
+   * request is split into as few pieces as possible. Every piece but the
+   * last is a whole block.
+   *
+   * Either all of size is allocated or nothing is. Free the pieces with
+   * buddy_free_sg, or each iov_base on its own with buddy_free.
+   *
+   * @param pool The memory pool to alloc from
+   * @param size The number of bytes to allocate
+   * @param iov Filled with the pieces in order, their lengths add up to size
+   * @param max_iov The number of entries in iov
+   * @return The number of pieces, -1 with errno set to ENOMEM if size does
+   * not fit in max_iov pieces
+   */
+  int buddy_malloc_sg(struct buddy_pool *pool, size_t size, struct iovec *iov, int max_iov);
+
+  /**
+   * Frees the pieces buddy_malloc_sg handed out with one trip through the
+   * pool. NULL entries are skipped.
+   *
+   * @param pool The memory pool
+   * @param iov The pieces to free
+   * @param iovcnt The number of entries in iov
+   */
+  void buddy_free_sg(struct buddy_pool *pool, const struct iovec *iov, int iovcnt);
+
+  /**
+   * Registers the pool as io_uring fixed buffers so reads and writes into
+   * its blocks can use IORING_OP_READ_FIXED and IORING_OP_WRITE_FIXED and
+   * the kernel does not pin and unpin pages on every submission. The pool
+   * is cut into buffers of 2^chunk_k bytes, buffer i starts i << chunk_k
+   * bytes into the pool. Use buddy_uring_index to find the buffer of a
+   * block.
+   *
+   * Registering pins every page of the pool, so the whole pool becomes
+   * resident and counts against RLIMIT_MEMLOCK. While registered,
+   * buddy_purge gives nothing back and buddy_realloc copies instead of
+   * moving pages, either would leave the kernel holding pages the pool no
+   * longer maps. Register before I/O starts, not while the pool is in use
+   * by other threads.
+   *
+   * @param pool The memory pool
+   * @param ring_fd The io_uring file descriptor from io_uring_setup
+   * @param chunk_k log2 of each buffer, 0 for the largest the kernel takes.
+   * The kernel takes buffers of at most 1GiB and 16384 of them.
+   * @return The number of buffers registered, -1 with errno set to EINVAL
+   * for a bad chunk_k, EBUSY if the pool is already registered, ENOSYS if
+   * built without io_uring, or the error of io_uring_register
+   */
+  int buddy_uring_register(struct buddy_pool *pool, int ring_fd, size_t chunk_k);
+
+  /**
+   * Finds the fixed buffer holding len bytes at ptr of a registered pool.
+   * The sqe of a fixed read or write takes ptr as its addr and the index as
+   * its buf_index. A block of at most 2^chunk_k bytes always lies in one
+   * buffer. Larger blocks and direct mappings do not.
+   *
+   * @param pool The memory pool
+   * @param ptr Start of the I/O, anywhere inside a block of the pool
+   * @param len Length of the I/O
+   * @param offset Set to the offset of ptr into the buffer, may be NULL
+   * @return The buffer index, -1 with errno set to EINVAL if the pool is not
+   * registered or the range is not inside one buffer
+   */
+  int buddy_uring_index(struct buddy_pool *pool, const void *ptr, size_t len, size_t *offset);
+
+  /**
+   * Unregisters the fixed buffers of the pool. buddy_destroy does this for
+   * a pool that is still registered.
+   *
+   * @param pool The memory pool
+   * @return 0 on success, -1 with errno set to EINVAL if the pool is not
+   * registered or the error of io_uring_register
+   */
+  int buddy_uring_unregister(struct buddy_pool *pool);
+
   /**
    * Changes the size of the memory block pointed to by ptr.
    * The function may move the memory block to a new location
@@ -124,6 +660,17 @@ extern "C"
    * if size is equal to zero, and ptr is not NULL, then the  call
    * is equivalent to free(ptr)
    *
+   * A block shrinks in place and grows in place when the buddies above it
+   * are free. Large blocks that have to move are moved by remapping their
+   * pages with mremap rather than by copying them.
+   *
+   * With an mmap threshold a block that grows past it moves to a mapping of
+   * its own, one that stays above it is resized with mremap and one that
+   * shrinks to the threshold or below moves back into the pool.
+   *
+   * If the block can not be resized NULL is returned with errno set to
+   * ENOMEM and the old block is left as it was.
+   *
    * @param pool The memory pool
    * @param ptr Pointer to a memory block
    * @param size The new size of the memory block
@@ -152,6 +699,75 @@ extern "C"
    */
   void buddy_init(struct buddy_pool *pool, size_t size);
 
+  /**
+   * Same as buddy_init but with extra options. By default (opts is NULL or
+   * prefault is BUDDY_PREFAULT_NONE) the region is mapped with MAP_NORESERVE
+   * and only the page holding the first block header is touched, so even a
+   * pool of 2^(MAX_K-1) bytes is ready in microseconds. Latency critical
+   * callers can instead pay every page fault at startup with
+   * BUDDY_PREFAULT_POPULATE (MAP_POPULATE) or BUDDY_PREFAULT_TOUCH (pages are
+   * written by opts->threads threads in parallel).
+   *
+   * opts->engine picks how free space is tracked. BUDDY_ENGINE_LIST threads
+   * doubly linked lists through the free blocks (see struct avail).
+   * BUDDY_ENGINE_TREE keeps an implicit binary tree of one byte per node in a
+   * separate mapping where every node holds the largest free order below it,
+   * so malloc and free are O(log n) walks that never touch free blocks.
+   *
+   * opts->policy picks which free block of an order malloc uses. The default
+   * BUDDY_POLICY_LIFO takes the most recently freed one. BUDDY_POLICY_ADDRESS
+   * takes the lowest addressed one, found through a hierarchical bitmap per
+   * order, so live data packs into the bottom of the pool and the top stays
+   * in large blocks. The tree engine always allocates this way.
+   *
+   * opts->reserve[k] blocks of each k value are allocated up front and kept
+   * for buddy_malloc_flags callers that pass BUDDY_CRITICAL. Init fails with
+   * ENOMEM if the pool is too small to hold them.
+   *
+   * opts->mmap_threshold sends malloc, calloc and realloc requests above it
+   * to a mapping of their own instead of the pool, including requests the
+   * pool could never hold. The default of 0 keeps everything in the pool.
+   *
+   * opts->presplit[k] asks for that many free blocks of each k value to be
+   * split off up front, as far as the pool allows, so the first requests
+   * find blocks of their size ready instead of walking a split chain down
+   * from the top block. buddy_profile_load fills it in from a profile saved
+   * by an earlier run. Presplit buddies are only merged again when they are
+   * freed after use or when a request can not be served otherwise. The tree
+   * engine walks the same path whatever the split state and ignores it.
+   *
+   * opts->color moves the start of each object a rotating number of cache
+   * lines into its block, as far as the slack between the request and the
+   * block size allows. Otherwise every object of a size starts at the same
+   * offset from a power of two boundary and their first lines all compete
+   * for the same cache sets. A small header in front of a shifted pointer
+   * leads back to the block. Batches, child pools and blocks that realloc
+   * or compaction move are not colored.
+   *
+   * opts->headerless hands out the start of each block with no header in
+   * front, so a 64 byte request takes a 64 byte block and the first cache
+   * line of an object belongs to the caller. It needs the tree engine, which
+   * keeps every size outside the pool, and can not be combined with color.
+   * buddy_free walks the tree to find the size, buddy_free_sized skips that.
+   * realloc, batch allocation, handles, child pools and the profiler need
+   * the header and fail with EINVAL on such a pool.
+   *
+   * opts->exact_fit trims requests of at least that many bytes to the
+   * pages they need instead of a whole power of two block. 640MiB takes a
+   * 1GiB block, keeps 512MiB plus 128MiB plus a page for the header, and
+   * hands the other 384MiB back at once. The kept blocks all go back on
+   * free. It needs the tree engine with headers. Trimmed blocks are not
+   * colored and realloc always moves them.
+   *
+   * Unlike buddy_init this function does not kill the process on failure.
+   *
+   * @param pool A pointer to the pool to initialize
+   * @param size The size of the pool in bytes.
+   * @param opts The options to use, may be NULL
+   * @return 0 on success, -1 with errno set on failure
+   */
+  int buddy_init_opts(struct buddy_pool *pool, size_t size, const struct buddy_opts *opts);
+
   /**
    * Inverse of buddy_init.
    *
@@ -162,6 +778,184 @@ extern "C"
    */
   void buddy_destroy(struct buddy_pool *pool);
 
+  /**
+   * Take a snapshot of the free space in a pool. This works the same for
+   * every engine.
+   *
+   * @param pool The memory pool
+   * @param stats Filled in with the current free space
+   */
+  void buddy_stats(struct buddy_pool *pool, struct buddy_stats *stats);
+
+  /**
+   * Writes the size class profile of a pool, the most blocks of each k
+   * value that were allocated at the same time, one "k count" line each.
+   * A later run can load it with buddy_profile_load to start warm.
+   *
+   * @param pool The memory pool
+   * @param out Where to write the profile
+   * @return 0 on success, -1 with errno set on failure
+   */
+  int buddy_profile_save(struct buddy_pool *pool, FILE *out);
+
+  /**
+   * Reads a profile written by buddy_profile_save into opts->presplit so
+   * buddy_init_opts splits the new pool the way the old one was used. The
+   * rest of opts is left alone.
+   *
+   * @param in The profile
+   * @param opts The options to fill in
+   * @return 0 on success, -1 with errno set to EINVAL for a malformed profile
+   */
+  int buddy_profile_load(FILE *in, struct buddy_opts *opts);
+
+  /**
+   * Allocates a relocatable block. The caller holds the returned handle
+   * instead of a pointer and uses buddy_pin to get the current address of
+   * the block. While a block is not pinned buddy_compact is free to move it.
+   *
+   * @param pool The memory pool to alloc from
+   * @param size The size of the user requested memory block in bytes
+   * @return A non zero handle, 0 if the request could not be satisfied
+   */
+  uint64_t buddy_halloc(struct buddy_pool *pool, size_t size);
+
+  /**
+   * Pins a block so it will not move and returns its current address. The
+   * address is only valid until the matching buddy_unpin. Pins nest.
+   *
+   * @param pool The memory pool
+   * @param handle A handle from buddy_halloc
+   * @return The address of the block, NULL if the handle is not valid
+   */
+  void *buddy_pin(struct buddy_pool *pool, uint64_t handle);
+
+  /**
+   * Undoes one buddy_pin.
+   *
+   * @param pool The memory pool
+   * @param handle A handle from buddy_halloc
+   */
+  void buddy_unpin(struct buddy_pool *pool, uint64_t handle);
+
+  /**
+   * Frees a block allocated with buddy_halloc. The handle becomes invalid
+   * and is never handed out again.
+   *
+   * @param pool The memory pool
+   * @param handle A handle from buddy_halloc
+   */
+  void buddy_hfree(struct buddy_pool *pool, uint64_t handle);
+
+  /**
+   * Heals external fragmentation by moving unpinned handle blocks out of
+   * nearly empty regions. A region is only emptied if every block allocated
+   * in it belongs to an unpinned handle, blocks from buddy_malloc never move.
+   * Regions of the smallest order above the largest free block are tried
+   * first, cheapest first, so large orders come back for the least copying.
+   *
+   * @param pool The memory pool
+   * @param budget The maximum number of bytes to move
+   * @param report Filled in with what was done, may be NULL
+   * @return The number of bytes moved
+   */
+  size_t buddy_compact(struct buddy_pool *pool, size_t budget, struct buddy_compact_report *report);
+
+  /**
+   * Starts sampling allocations made with buddy_malloc. On average one
+   * sample is taken every rate bytes (a Poisson process over allocated
+   * bytes), a sample records the call stack and the size of the allocation.
+   * Samples are dropped again by buddy_free so the profile always knows what
+   * is live. Starting again discards the previous profile.
+   *
+   * While sampling is off buddy_malloc and buddy_free only pay one branch.
+   *
+   * @param pool The memory pool
+   * @param rate Mean number of bytes between samples, 512KiB is a good default
+   * @return 0 on success, -1 with errno set on failure
+   */
+  int buddy_prof_start(struct buddy_pool *pool, size_t rate);
+
+  /**
+   * Stops sampling and discards the profile.
+   *
+   * @param pool The memory pool
+   */
+  void buddy_prof_stop(struct buddy_pool *pool);
+
+  /**
+   * Writes the profile in the legacy heap profile format read by pprof. Each
+   * stack carries both the live heap (pprof -inuse_space) and cumulative
+   * allocations (pprof -alloc_space). Counts are raw samples, pprof scales
+   * them by the sampling rate recorded in the header.
+   *
+   * @param pool The memory pool
+   * @param out Where to write the profile
+   * @return 0 on success, -1 with errno set on failure
+   */
+  int buddy_prof_dump(struct buddy_pool *pool, FILE *out);
+
+  /**
+   * Creates a child pool of parent. The child may hold at most quota bytes
+   * of blocks (counted as whole 2^k blocks) from the parent at a time. Freed
+   * blocks are kept for reuse until the child holds more than soft_limit
+   * bytes, then the cache is handed back to the parent in one go. Blocks
+   * are also taken from the parent in batches up to soft_limit.
+   *
+   * @param child The child pool to initialize
+   * @param parent The pool to borrow from
+   * @param quota The most bytes the child may hold
+   * @param soft_limit How much the child may hold before it gives cached
+   * blocks back, at most quota
+   * @return 0 on success, -1 with errno set to EINVAL on bad arguments
+   */
+  int buddy_child_init(struct buddy_child *child, struct buddy_pool *parent, size_t quota,
+                       size_t soft_limit);
+
+  /**
+   * Registers fn to be called when the free memory of the pool crosses the
+   * watermarks in wm, so caches built on the pool can shrink before
+   * allocations fail. The pool starts out as BUDDY_PRESSURE_OK and is checked
+   * by every malloc and free. Crossings that come sooner than
+   * wm->min_interval_ms after the previous callback are reported once the
+   * interval has passed, if the pool is still across the line. A NULL fn
+   * stops watching.
+   *
+   * @param pool The memory pool
+   * @param wm The watermarks, low marks may not be above high marks
+   * @param fn The callback or NULL
+   * @param arg Passed to fn
+   * @return 0 on success, -1 with errno set to EINVAL on bad watermarks
+   */
+  int buddy_set_watermarks(struct buddy_pool *pool, const struct buddy_watermarks *wm,
+                           buddy_pressure_fn fn, void *arg);
+
+  /**
+   * Same as buddy_malloc but charged to the child.
+   *
+   * @param child The child pool to alloc from
+   * @param size The size of the user requested memory block in bytes
+   * @return A pointer to the memory block or NULL with errno set to EDQUOT
+   * if the quota would be exceeded or ENOMEM if the parent is out of memory
+   */
+  void *buddy_child_malloc(struct buddy_child *child, size_t size);
+
+  /**
+   * Frees a block from buddy_child_malloc of the same child.
+   *
+   * @param child The child pool
+   * @param ptr Pointer to the memory block to free
+   */
+  void buddy_child_free(struct buddy_child *child, void *ptr);
+
+  /**
+   * Gives every block the child holds back to the parent, including the
+   * ones still in use, with one trip to the parent.
+   *
+   * @param child The child pool to destroy
+   */
+  void buddy_child_destroy(struct buddy_child *child);
+
   /**
    * @brief Entry to a main function for testing purposes
    *
@@ -1,14 +1,23 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <time.h>
+#include <string.h>
 #ifdef __APPLE__
 #include <sys/errno.h>
 #else
 #include <errno.h>
 #endif
+#include <elf.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "harness/unity.h"
 #include "../src/lab.h"
 
+#ifdef BUDDY_HAVE_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
 
 void setUp(void) {
   // set stuff up here
@@ -28,21 +37,22 @@ void check_buddy_pool_full(struct buddy_pool *pool)
   //A full pool should have all values 0-(kval-1) as empty
   for (size_t i = 0; i < pool->kval_m; i++)
     {
-      assert(pool->avail[i].next == &pool->avail[i]);
-      assert(pool->avail[i].prev == &pool->avail[i]);
+      assert(avail_from_link(pool, pool->avail[i].next) == &pool->avail[i]);
+      assert(avail_from_link(pool, pool->avail[i].prev) == &pool->avail[i]);
       assert(pool->avail[i].tag == BLOCK_UNUSED);
       assert(pool->avail[i].kval == i);
     }
 
   //The avail array at kval should have the base block
-  assert(pool->avail[pool->kval_m].next->tag == BLOCK_AVAIL);
-  assert(pool->avail[pool->kval_m].next->next == &pool->avail[pool->kval_m]);
-  assert(pool->avail[pool->kval_m].prev->prev == &pool->avail[pool->kval_m]);
+  struct avail *top = avail_from_link(pool, pool->avail[pool->kval_m].next);
+  assert(top->tag == BLOCK_AVAIL);
+  assert(avail_from_link(pool, top->next) == &pool->avail[pool->kval_m]);
+  assert(avail_from_link(pool, top->prev) == &pool->avail[pool->kval_m]);
 
   //Check to make sure the base address points to the starting pool
   //If this fails either buddy_init is wrong or we have corrupted the
   //buddy_pool struct.
-  assert(pool->avail[pool->kval_m].next == pool->base);
+  assert(avail_from_link(pool, pool->avail[pool->kval_m].next) == pool->base);
 }
 
 /**
@@ -53,13 +63,58 @@ void check_buddy_pool_empty(struct buddy_pool *pool)
   //An empty pool should have all values 0-(kval) as empty
   for (size_t i = 0; i <= pool->kval_m; i++)
     {
-      assert(pool->avail[i].next == &pool->avail[i]);
-      assert(pool->avail[i].prev == &pool->avail[i]);
+      assert(avail_from_link(pool, pool->avail[i].next) == &pool->avail[i]);
+      assert(avail_from_link(pool, pool->avail[i].prev) == &pool->avail[i]);
       assert(pool->avail[i].tag == BLOCK_UNUSED);
       assert(pool->avail[i].kval == i);
     }
 }
 
+/**
+ * Check through buddy_stats that the pool is one free block. Works for every
+ * engine.
+ */
+void check_buddy_stats_full(struct buddy_pool *pool)
+{
+  struct buddy_stats st;
+  buddy_stats(pool, &st);
+  assert(st.free_bytes == pool->numbytes);
+  assert(st.largest_free_k == pool->kval_m);
+  assert(st.nfree[pool->kval_m] == 1);
+}
+
+/**
+ * Randomly allocate and free blocks of random sizes. Every block is filled
+ * with a pattern that is checked again when the block is freed so any
+ * overlapping blocks are caught. Everything is freed at the end.
+ */
+void run_random_workload(struct buddy_pool *pool, int iterations)
+{
+  enum { SLOTS = 256 };
+  unsigned char *ptrs[SLOTS] = {0};
+  size_t sizes[SLOTS] = {0};
+  for (int n = 0; n < iterations; n++)
+    {
+      int i = rand() % SLOTS;
+      if (ptrs[i])
+        {
+          for (size_t b = 0; b < sizes[i]; b++)
+            assert(ptrs[i][b] == (unsigned char)i);
+          buddy_free(pool, ptrs[i]);
+          ptrs[i] = NULL;
+        }
+      else
+        {
+          sizes[i] = 1 + rand() % (1 << (rand() % 14));
+          ptrs[i] = buddy_malloc(pool, sizes[i]);
+          if (ptrs[i])
+            memset(ptrs[i], i, sizes[i]);
+        }
+    }
+  for (int i = 0; i < SLOTS; i++)
+    buddy_free(pool, ptrs[i]);
+}
+
 /**
  * Test allocating 1 byte to make sure we split the blocks all the way down
  * to MIN_K size. Then free the block and ensure we end up with a full
@@ -95,7 +150,7 @@ void test_buddy_malloc_one_large(void)
 
   //Ask for an exact K value to be allocated. This test makes assumptions on
   //the internal details of buddy_init.
-  size_t ask = bytes - sizeof(struct avail);
+  size_t ask = bytes - BUDDY_HEADER;
   void *mem = buddy_malloc(&pool, ask);
   fprintf(stderr, "Allocated memory address: %p\n", mem);
   assert(mem != NULL);
@@ -110,7 +165,7 @@ void test_buddy_malloc_one_large(void)
   // }
 
   //Move the pointer back and make sure we got what we expected
-  struct avail *tmp = (struct avail *)mem - 1;
+  struct avail *tmp = (struct avail *)((char *)mem - BUDDY_HEADER);
   assert(tmp->kval == MIN_K);
   assert(tmp->tag == BLOCK_RESERVED);
   check_buddy_pool_empty(&pool);
@@ -260,7 +315,8 @@ void test_buddy_malloc_free_multiple_blocks(void) {
 void test_buddy_malloc_power_of_two_sizes(void) {
   fprintf(stderr, "->Testing buddy_malloc with power-of-two sizes\n");
   struct buddy_pool pool;
-  size_t size = UINT64_C(1) << MIN_K;
+  //A 2^MIN_K request plus its header needs the next k value up
+  size_t size = UINT64_C(1) << (MIN_K + 1);
   buddy_init(&pool, size);
 
   for (size_t i = 0; i <= MIN_K; i++) {
@@ -324,6 +380,29 @@ void test_buddy_init(void)
     }
 }
 
+/**
+ * Tests that every prefault mode gives the same fully configured pool as
+ * buddy_init and that bad options are rejected.
+ */
+void test_buddy_init_opts(void)
+{
+  fprintf(stderr, "->Testing buddy init with options\n");
+  for (int mode = BUDDY_PREFAULT_NONE; mode <= BUDDY_PREFAULT_TOUCH; mode++)
+    {
+      struct buddy_opts opts = {.prefault = mode, .threads = 4};
+      struct buddy_pool pool;
+      assert(buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts) == 0);
+      check_buddy_pool_full(&pool);
+      buddy_destroy(&pool);
+    }
+
+  struct buddy_opts bad = {.prefault = 42};
+  struct buddy_pool pool;
+  errno = 0;
+  assert(buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &bad) == -1);
+  assert(errno == EINVAL);
+}
+
 void test_btok(void){
   fprintf(stderr, "->Testing btok\n");
 
@@ -341,6 +420,11 @@ void test_btok(void){
    k = btok(bytes);
   fprintf(stderr, "\tbytes = %d\n\tk = %d\n", bytes, k);
   assert(btok(bytes) == 20);
+
+  //Sizes that are not a power of two round up
+  assert(btok(17) == 5);
+  assert(btok(1025) == 11);
+  assert(btok((UINT64_C(1) << 40) + 1) == 41);
 }
 
 void test_buddy_calc(void){
@@ -365,6 +449,1556 @@ void test_buddy_calc(void){
 }
 
 
+/**
+ * Random allocations with the list engine must never overlap and must all
+ * merge back into one block.
+ */
+void test_buddy_list_random(void)
+{
+  fprintf(stderr, "->Testing random workload with the list engine\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+  run_random_workload(&pool, 20000);
+  check_buddy_pool_full(&pool);
+  check_buddy_stats_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+ * The tree engine must serve the same requests as the list engine and never
+ * put anything on the avail lists.
+ */
+void test_buddy_tree_engine(void)
+{
+  fprintf(stderr, "->Testing the tree engine\n");
+  struct buddy_opts opts = {.engine = BUDDY_ENGINE_TREE};
+  struct buddy_pool pool;
+  size_t bytes = UINT64_C(1) << MIN_K;
+  assert(buddy_init_opts(&pool, bytes, &opts) == 0);
+  check_buddy_stats_full(&pool);
+
+  //One block that takes the whole pool
+  void *mem = buddy_malloc(&pool, bytes - BUDDY_HEADER);
+  assert(mem != NULL);
+  assert(mem == (char *)pool.base + BUDDY_HEADER);
+  struct avail *tmp = (struct avail *)((char *)mem - BUDDY_HEADER);
+  assert(tmp->kval == MIN_K);
+  assert(tmp->tag == BLOCK_RESERVED);
+  check_buddy_pool_empty(&pool);
+  assert(buddy_malloc(&pool, 5) == NULL);
+  assert(errno == ENOMEM);
+  buddy_free(&pool, mem);
+  check_buddy_stats_full(&pool);
+
+  //Small blocks come from the lowest address first
+  void *a = buddy_malloc(&pool, 1);
+  void *b = buddy_malloc(&pool, 1);
+  assert(a == (char *)pool.base + BUDDY_HEADER);
+  assert(b == (char *)a + (UINT64_C(1) << SMALLEST_K));
+  buddy_free(&pool, a);
+  buddy_free(&pool, b);
+  check_buddy_stats_full(&pool);
+
+  run_random_workload(&pool, 20000);
+  check_buddy_stats_full(&pool);
+  check_buddy_pool_empty(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+ * The address policy hands out the lowest free block of an order no matter
+ * which order blocks were freed in.
+ */
+void test_buddy_address_policy(void)
+{
+  fprintf(stderr, "->Testing the address ordered policy\n");
+  struct buddy_opts opts = {.policy = BUDDY_POLICY_ADDRESS};
+  struct buddy_pool pool;
+  assert(buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts) == 0);
+  check_buddy_pool_full(&pool);
+
+  //Fill a few blocks then free them from the top down so LIFO would
+  //hand back the lowest one first and address order the same one
+  void *mem[8];
+  for (int i = 0; i < 8; i++)
+    mem[i] = buddy_malloc(&pool, 1);
+  for (int i = 0; i < 8; i++)
+    assert(mem[i] == (char *)pool.base + i * (UINT64_C(1) << SMALLEST_K) + BUDDY_HEADER);
+  buddy_free(&pool, mem[2]);
+  buddy_free(&pool, mem[6]);
+  buddy_free(&pool, mem[4]);
+  assert(buddy_malloc(&pool, 1) == mem[2]);
+  assert(buddy_malloc(&pool, 1) == mem[4]);
+  assert(buddy_malloc(&pool, 1) == mem[6]);
+  for (int i = 0; i < 8; i++)
+    buddy_free(&pool, mem[i]);
+  check_buddy_pool_full(&pool);
+
+  run_random_workload(&pool, 20000);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+
+  opts.policy = 2;
+  assert(buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts) == -1);
+  assert(errno == EINVAL);
+}
+
+/**
+ * Handles hand back the same memory until they are freed and stale handles
+ * are rejected.
+ */
+void test_buddy_handles(void)
+{
+  fprintf(stderr, "->Testing handles\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+
+  uint64_t h = buddy_halloc(&pool, 100);
+  assert(h != 0);
+  char *p = buddy_pin(&pool, h);
+  assert(p != NULL);
+  strcpy(p, "hello");
+  assert(buddy_pin(&pool, h) == p);
+  buddy_unpin(&pool, h);
+  buddy_unpin(&pool, h);
+
+  buddy_hfree(&pool, h);
+  assert(buddy_pin(&pool, h) == NULL);
+  assert(buddy_pin(&pool, 0) == NULL);
+
+  //The slot is reused with a new generation
+  uint64_t h2 = buddy_halloc(&pool, 100);
+  assert(h2 != 0 && h2 != h);
+  assert(buddy_pin(&pool, h) == NULL);
+  buddy_hfree(&pool, h2);
+
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+ * Leave one live block in every 64KiB of the pool and make sure compaction
+ * packs them together again without losing their contents, and that pinned
+ * blocks stay where they are.
+ */
+void test_buddy_compact(void)
+{
+  fprintf(stderr, "->Testing compaction\n");
+  for (int engine = BUDDY_ENGINE_LIST; engine <= BUDDY_ENGINE_TREE; engine++)
+    {
+      struct buddy_opts opts = {.engine = engine};
+      struct buddy_pool pool;
+      assert(buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts) == 0);
+
+      enum { N = 1000, STRIDE = 64, SIZE = 1000 };
+      static uint64_t h[N];
+      for (int i = 0; i < N; i++)
+        {
+          h[i] = buddy_halloc(&pool, SIZE);
+          assert(h[i] != 0);
+          memset(buddy_pin(&pool, h[i]), i, SIZE);
+          buddy_unpin(&pool, h[i]);
+        }
+      for (int i = 0; i < N; i++)
+        {
+          if (i % STRIDE)
+            buddy_hfree(&pool, h[i]);
+        }
+
+      //Pin the first survivor, it must not move
+      void *pinned = buddy_pin(&pool, h[0]);
+
+      struct buddy_stats before;
+      buddy_stats(&pool, &before);
+      struct buddy_compact_report rep;
+      size_t moved = buddy_compact(&pool, pool.numbytes, &rep);
+      assert(moved == rep.moved_bytes);
+      assert(rep.moved_blocks > 0);
+      assert(rep.largest_before == before.largest_free_k);
+      assert(rep.largest_after > rep.largest_before);
+      size_t reclaimed = 0;
+      for (size_t k = 0; k < MAX_K; k++)
+        reclaimed += rep.reclaimed[k];
+      assert(reclaimed > 0);
+
+      //A zero budget moves nothing
+      assert(buddy_compact(&pool, 0, NULL) == 0);
+
+      assert(buddy_pin(&pool, h[0]) == pinned);
+      buddy_unpin(&pool, h[0]);
+      buddy_unpin(&pool, h[0]);
+      for (int i = 0; i < N; i += STRIDE)
+        {
+          unsigned char *p = buddy_pin(&pool, h[i]);
+          for (int b = 0; b < SIZE; b++)
+            assert(p[b] == (unsigned char)i);
+          buddy_unpin(&pool, h[i]);
+          buddy_hfree(&pool, h[i]);
+        }
+      check_buddy_stats_full(&pool);
+      buddy_destroy(&pool);
+    }
+}
+
+/**
+ * Critical allocations dip into the reserve once the pool is exhausted and
+ * frees refill it.
+ */
+void test_buddy_reserve(void)
+{
+  fprintf(stderr, "->Testing the emergency reserve\n");
+  struct buddy_opts opts = {0};
+  struct buddy_pool pool;
+  opts.reserve[10] = 2;
+  assert(buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts) == 0);
+  struct buddy_stats st;
+  buddy_stats(&pool, &st);
+  assert(st.reserved[10] == 2);
+  assert(st.free_bytes == pool.numbytes - 2 * 1024);
+
+  //Use up everything the normal path can get
+  enum { N = 1 << (MIN_K - SMALLEST_K) };
+  static void *mem[N];
+  int n = 0;
+  while ((mem[n] = buddy_malloc(&pool, 1)) != NULL)
+    n++;
+  assert(buddy_malloc_flags(&pool, 500, 0) == NULL);
+
+  void *c1 = buddy_malloc_flags(&pool, 500, BUDDY_CRITICAL);
+  void *c2 = buddy_malloc_flags(&pool, 1, BUDDY_CRITICAL);
+  assert(c1 != NULL && c2 != NULL);
+  assert(((struct avail *)((char *)c2 - BUDDY_HEADER))->kval == 10);
+  assert(buddy_malloc_flags(&pool, 1, BUDDY_CRITICAL) == NULL);
+  assert(errno == ENOMEM);
+
+  //Freeing a reserve block gives it straight back to the reserve
+  buddy_free(&pool, c1);
+  buddy_stats(&pool, &st);
+  assert(st.reserved[10] == 1);
+  buddy_free(&pool, c2);
+  for (int i = 0; i < n; i++)
+    buddy_free(&pool, mem[i]);
+  buddy_stats(&pool, &st);
+  assert(st.reserved[10] == 2);
+  assert(st.free_bytes == pool.numbytes - 2 * 1024);
+  buddy_destroy(&pool);
+
+  //A reserve that does not fit fails init
+  opts.reserve[10] = 0;
+  opts.reserve[MIN_K] = 2;
+  assert(buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts) == -1);
+  assert(errno == ENOMEM);
+  opts.reserve[MIN_K] = 0;
+  opts.reserve[SMALLEST_K - 1] = 1;
+  assert(buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts) == -1);
+  assert(errno == EINVAL);
+}
+
+/**
+ * A child pool stays inside its quota, serves frees from its cache up to
+ * the soft limit and gives everything back on destroy.
+ */
+void test_buddy_child(void)
+{
+  fprintf(stderr, "->Testing child pools\n");
+  for (int engine = BUDDY_ENGINE_LIST; engine <= BUDDY_ENGINE_TREE; engine++)
+    {
+      struct buddy_opts opts = {.engine = engine};
+      struct buddy_pool pool;
+      assert(buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts) == 0);
+      struct buddy_child child;
+      assert(buddy_child_init(&child, &pool, 1024, 2048) == -1);
+      assert(errno == EINVAL);
+      assert(buddy_child_init(&child, &pool, 64 * 1024, 16 * 1024) == 0);
+
+      //1000 bytes plus the header is a 1KiB block so 64 fit
+      enum { N = 64 };
+      void *mem[N];
+      for (int i = 0; i < N; i++)
+        {
+          mem[i] = buddy_child_malloc(&child, 1000);
+          assert(mem[i] != NULL);
+          memset(mem[i], i, 1000);
+        }
+      assert(buddy_child_malloc(&child, 1000) == NULL);
+      assert(errno == EDQUOT);
+      assert(child.used == 64 * 1024 && child.held == 64 * 1024);
+
+      //Freeing keeps only the soft limit cached
+      for (int i = 0; i < N; i++)
+        buddy_child_free(&child, mem[i]);
+      assert(child.used == 0);
+      assert(child.held <= 16 * 1024);
+      struct buddy_stats st;
+      buddy_stats(&pool, &st);
+      assert(st.free_bytes == pool.numbytes - child.held);
+
+      //Cached blocks are reused without asking the parent
+      size_t held = child.held;
+      void *a = buddy_child_malloc(&child, 1000);
+      assert(a != NULL && child.held == held);
+      buddy_stats(&pool, &st);
+      assert(st.free_bytes == pool.numbytes - held);
+
+      //Other sizes still fit the quota by trimming the cache
+      void *big = buddy_child_malloc(&child, 32 * 1024);
+      assert(big == NULL && errno == EDQUOT);
+      big = buddy_child_malloc(&child, 32 * 1024 - BUDDY_CHILD_HEADER);
+      assert(big != NULL);
+      assert(child.held <= child.quota);
+
+      buddy_child_destroy(&child);
+      check_buddy_stats_full(&pool);
+
+      //A parent that runs out fails with ENOMEM
+      assert(buddy_child_init(&child, &pool, pool.numbytes, pool.numbytes) == 0);
+      void *all = buddy_malloc(&pool, pool.numbytes / 2);
+      assert(all != NULL);
+      assert(buddy_child_malloc(&child, pool.numbytes / 2) == NULL);
+      assert(errno == ENOMEM);
+      buddy_free(&pool, all);
+      buddy_child_destroy(&child);
+      check_buddy_stats_full(&pool);
+      buddy_destroy(&pool);
+    }
+}
+
+/**
+ * Batches come out of one large block, never overlap, and go back as a
+ * whole no matter the order they are freed in.
+ */
+void test_buddy_batch(void)
+{
+  fprintf(stderr, "->Testing batch malloc and free\n");
+  for (int engine = BUDDY_ENGINE_LIST; engine <= BUDDY_ENGINE_TREE; engine++)
+    {
+      struct buddy_opts opts = {.engine = engine};
+      struct buddy_pool pool;
+      size_t bytes = UINT64_C(1) << MIN_K;
+      assert(buddy_init_opts(&pool, bytes, &opts) == 0);
+
+      //100 blocks of 64 bytes are cut from one 8KiB block
+      enum { N = 100 };
+      void *mem[N];
+      assert(buddy_malloc_batch(&pool, 40, N, mem) == N);
+      for (int i = 0; i < N; i++)
+        {
+          struct avail *block = (struct avail *)((char *)mem[i] - BUDDY_HEADER);
+          assert(block->tag == BLOCK_RESERVED && block->kval == 6);
+          assert(mem[i] == (char *)mem[0] + i * 64);
+          memset(mem[i], i, 40);
+        }
+      struct buddy_stats st;
+      buddy_stats(&pool, &st);
+      assert(st.free_bytes == bytes - N * 64);
+      assert(pool.free_bytes == st.free_bytes);
+
+      //The leftovers of the 8KiB block are usable
+      void *one = buddy_malloc(&pool, 40);
+      assert(one == (char *)mem[N - 1] + 64);
+      buddy_free(&pool, one);
+
+      //Free in a scrambled order with a NULL thrown in
+      for (int i = 0; i < N; i++)
+        {
+          int j = rand() % N;
+          void *tmp = mem[i];
+          mem[i] = mem[j];
+          mem[j] = tmp;
+        }
+      void *skipped = mem[7];
+      mem[7] = NULL;
+      buddy_free_batch(&pool, mem, N);
+      buddy_stats(&pool, &st);
+      assert(st.free_bytes == bytes - 64);
+      assert(pool.free_bytes == st.free_bytes);
+
+      //Run the pool dry around the one we skipped
+      enum { ALL = 1 << (MIN_K - 6) };
+      static void *all[ALL + 5];
+      assert(buddy_malloc_batch(&pool, 40, ALL + 5, all) == ALL - 1);
+      assert(errno == ENOMEM);
+      assert(pool.free_bytes == 0);
+      buddy_free_batch(&pool, all, ALL - 1);
+      buddy_stats(&pool, &st);
+      assert(st.free_bytes == bytes - 64);
+      buddy_free_batch(&pool, &skipped, 1);
+      check_buddy_stats_full(&pool);
+      buddy_destroy(&pool);
+    }
+}
+
+/**
+ * Pages of [ptr, ptr + len) that are backed by memory right now
+ */
+static size_t resident_pages(void *ptr, size_t len)
+{
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t n = (len + page - 1) / page;
+  unsigned char *vec = malloc(n);
+  assert(vec != NULL);
+  assert(mincore(ptr, len, vec) == 0);
+  size_t count = 0;
+  for (size_t i = 0; i < n; i++)
+    count += vec[i] & 1;
+  free(vec);
+  return count;
+}
+
+static bool all_zero(const unsigned char *p, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    if (p[i] != 0)
+      return false;
+  return true;
+}
+
+void test_buddy_presplit(void)
+{
+  fprintf(stderr, "->Testing presplit and size profiles\n");
+  for (int policy = BUDDY_POLICY_LIFO; policy <= BUDDY_POLICY_ADDRESS; policy++)
+    {
+      struct buddy_opts opts = {.policy = policy};
+      opts.presplit[6] = 64;
+      opts.presplit[10] = 8;
+      opts.presplit[16] = 2;
+      struct buddy_pool pool;
+      assert(buddy_init_opts(&pool, UINT64_C(1) << 20, &opts) == 0);
+      struct buddy_stats before, st;
+      buddy_stats(&pool, &before);
+      assert(before.free_bytes == pool.numbytes);
+      assert(before.nfree[6] >= 64 && before.nfree[10] >= 8 && before.nfree[16] >= 2);
+
+      //The first requests split nothing
+      void *ptrs[64];
+      for (size_t i = 0; i < 64; i++)
+        ptrs[i] = buddy_malloc(&pool, 40);
+      buddy_stats(&pool, &st);
+      assert(st.nfree[6] == before.nfree[6] - 64);
+      for (size_t k = 7; k <= pool.kval_m; k++)
+        assert(st.nfree[k] == before.nfree[k]);
+      for (size_t i = 0; i < 64; i++)
+        buddy_free(&pool, ptrs[i]);
+
+      //The split buddies still add up to the whole pool when needed
+      run_random_workload(&pool, 20000);
+      void *all = buddy_malloc(&pool, pool.numbytes - BUDDY_HEADER);
+      assert(all == (char *)pool.base + BUDDY_HEADER);
+      buddy_free(&pool, all);
+      check_buddy_stats_full(&pool);
+      buddy_destroy(&pool);
+    }
+
+  //A saved profile splits the next pool the same way
+  struct buddy_pool pool;
+  assert(buddy_init_opts(&pool, UINT64_C(1) << 20, NULL) == 0);
+  void *small[100], *mid[3];
+  for (size_t i = 0; i < 100; i++)
+    small[i] = buddy_malloc(&pool, 40);
+  for (size_t i = 0; i < 3; i++)
+    mid[i] = buddy_malloc(&pool, 5000);
+  for (size_t i = 0; i < 100; i++)
+    buddy_free(&pool, small[i]);
+  for (size_t i = 0; i < 3; i++)
+    buddy_free(&pool, mid[i]);
+  FILE *f = tmpfile();
+  assert(buddy_profile_save(&pool, f) == 0);
+  buddy_destroy(&pool);
+
+  struct buddy_opts opts = {0};
+  rewind(f);
+  assert(buddy_profile_load(f, &opts) == 0);
+  fclose(f);
+  assert(opts.presplit[6] == 100 && opts.presplit[13] == 3);
+  for (size_t k = 0; k < MAX_K; k++)
+    assert(k == 6 || k == 13 || opts.presplit[k] == 0);
+  assert(buddy_init_opts(&pool, UINT64_C(1) << 20, &opts) == 0);
+  struct buddy_stats st;
+  buddy_stats(&pool, &st);
+  assert(st.nfree[6] >= 100 && st.nfree[13] >= 3);
+  buddy_destroy(&pool);
+
+  //The tree engine has nothing to split
+  opts.engine = BUDDY_ENGINE_TREE;
+  assert(buddy_init_opts(&pool, UINT64_C(1) << 20, &opts) == 0);
+  check_buddy_stats_full(&pool);
+  buddy_destroy(&pool);
+
+  //Bad profiles and orders are refused
+  f = tmpfile();
+  fputs("6 100\nnot a profile\n", f);
+  rewind(f);
+  errno = 0;
+  assert(buddy_profile_load(f, &opts) == -1 && errno == EINVAL);
+  fclose(f);
+  struct buddy_opts bad = {0};
+  bad.presplit[3] = 1;
+  errno = 0;
+  assert(buddy_init_opts(&pool, UINT64_C(1) << 20, &bad) == -1 && errno == EINVAL);
+}
+
+void test_buddy_calloc(void)
+{
+  fprintf(stderr, "->Testing calloc and purge\n");
+  for (int engine = BUDDY_ENGINE_LIST; engine <= BUDDY_ENGINE_TREE; engine++)
+    {
+      struct buddy_opts opts = {.engine = engine};
+      struct buddy_pool pool;
+      size_t bytes = UINT64_C(1) << MIN_K;
+      assert(buddy_init_opts(&pool, bytes, &opts) == 0);
+
+      //Fresh memory is not touched at all
+      size_t whole = bytes - BUDDY_HEADER;
+      unsigned char *mem = buddy_calloc(&pool, 1, whole);
+      assert(mem != NULL);
+      assert(resident_pages(pool.base, bytes) <= 1);
+      buddy_free(&pool, mem);
+      assert(buddy_purge(&pool) == bytes);
+
+      //The headers written while splitting down to 64 bytes are wiped by
+      //the merges so the whole pool comes back clean
+      buddy_free(&pool, buddy_malloc(&pool, 40));
+      mem = buddy_calloc(&pool, 1, whole);
+      assert(mem != NULL);
+      assert(all_zero(mem, whole));
+
+      //Dirty memory is cleared
+      memset(mem, 0xAB, whole);
+      buddy_free(&pool, mem);
+      size_t half = bytes / 4;
+      mem = buddy_calloc(&pool, half / 8, 8);
+      assert(mem == (unsigned char *)pool.base + BUDDY_HEADER);
+      assert(all_zero(mem, half));
+      unsigned char *small = buddy_calloc(&pool, 10, 10);
+      assert(small != NULL && all_zero(small, 100));
+      memset(small, 0xCD, 100);
+      buddy_free(&pool, small);
+      small = buddy_calloc(&pool, 100, 1);
+      assert(small != NULL && all_zero(small, 100));
+      buddy_free(&pool, small);
+
+      //A purge hands the pages back and they stay out until written again
+      memset(mem, 0xEF, half);
+      buddy_free(&pool, mem);
+      assert(buddy_purge(&pool) == bytes);
+      assert(resident_pages(pool.base, bytes) <= 1);
+      assert(buddy_purge(&pool) == 0);
+      mem = buddy_calloc(&pool, 1, whole);
+      assert(mem != NULL);
+      assert(resident_pages(pool.base, bytes) <= 1);
+      assert(all_zero(mem, whole));
+      buddy_free(&pool, mem);
+
+      errno = 0;
+      assert(buddy_calloc(&pool, SIZE_MAX, 2) == NULL);
+      assert(errno == ENOMEM);
+      assert(buddy_calloc(&pool, 0, 8) == NULL);
+      check_buddy_stats_full(&pool);
+      buddy_destroy(&pool);
+    }
+}
+
+void test_buddy_prezero(void)
+{
+  fprintf(stderr, "->Testing the prezero thread\n");
+  for (int engine = BUDDY_ENGINE_LIST; engine <= BUDDY_ENGINE_TREE; engine++)
+    {
+      struct buddy_opts opts = {.engine = engine};
+      struct buddy_pool pool;
+      size_t bytes = UINT64_C(1) << MIN_K;
+      assert(buddy_init_opts(&pool, bytes, &opts) == 0);
+      assert(buddy_prezero_start(&pool, 0) == -1 && errno == EINVAL);
+      assert(buddy_prezero_start(&pool, 101) == -1 && errno == EINVAL);
+
+      //Nothing has to be cleared in a fresh pool, after that it is a miss
+      struct buddy_stats st;
+      size_t whole = bytes - BUDDY_HEADER;
+      for (int i = 0; i < 2; i++)
+        {
+          unsigned char *mem = buddy_calloc(&pool, 1, whole);
+          assert(mem != NULL && all_zero(mem, whole));
+          memset(mem, 0x77, whole);
+          buddy_free(&pool, mem);
+        }
+      buddy_stats(&pool, &st);
+      assert(st.calloc_calls == 2 && st.calloc_hits == 1);
+
+      //The thread clears the dirty pool while we sleep
+      assert(buddy_prezero_start(&pool, 100) == 0);
+      assert(buddy_prezero_start(&pool, 50) == -1 && errno == EBUSY);
+      for (int i = 0; i < 400; i++)
+        {
+          buddy_stats(&pool, &st);
+          if (st.prezero_bytes >= bytes)
+            break;
+          usleep(5000);
+        }
+      assert(st.prezero_bytes == bytes);
+      unsigned char *mem = buddy_calloc(&pool, 1, whole);
+      assert(mem != NULL && all_zero(mem, whole));
+      buddy_stats(&pool, &st);
+      assert(st.calloc_calls == 3 && st.calloc_hits == 2);
+      buddy_free(&pool, mem);
+
+      if (engine == BUDDY_ENGINE_LIST)
+        buddy_prezero_stop(&pool);
+      //The tree engine pool is destroyed with the thread still running
+      buddy_destroy(&pool);
+    }
+}
+
+static void fill(unsigned char *p, size_t n, unsigned char seed)
+{
+  for (size_t i = 0; i < n; i++)
+    p[i] = (unsigned char)(seed + i * 7);
+}
+
+static bool filled(const unsigned char *p, size_t n, unsigned char seed)
+{
+  for (size_t i = 0; i < n; i++)
+    if (p[i] != (unsigned char)(seed + i * 7))
+      return false;
+  return true;
+}
+
+void test_buddy_realloc(void)
+{
+  fprintf(stderr, "->Testing realloc\n");
+  for (int engine = BUDDY_ENGINE_LIST; engine <= BUDDY_ENGINE_TREE; engine++)
+    {
+      struct buddy_opts opts = {.engine = engine};
+      struct buddy_pool pool;
+      size_t bytes = UINT64_C(1) << 22;
+      assert(buddy_init_opts(&pool, bytes, &opts) == 0);
+      struct buddy_stats st;
+
+      //NULL and 0 behave like malloc and free
+      unsigned char *p = buddy_realloc(&pool, NULL, 100);
+      assert(p == (unsigned char *)pool.base + BUDDY_HEADER);
+      assert(buddy_realloc(&pool, p, 0) == NULL);
+      check_buddy_stats_full(&pool);
+
+      //The lowest block grows in place and shrinks in place
+      p = buddy_malloc(&pool, 100);
+      fill(p, 100, 1);
+      assert(buddy_realloc(&pool, p, 5000) == p);
+      assert(filled(p, 100, 1));
+      assert(((struct avail *)(p - BUDDY_HEADER))->kval == 13);
+      fill(p, 5000, 2);
+      assert(buddy_realloc(&pool, p, 1000) == p);
+      assert(filled(p, 1000, 2));
+      buddy_stats(&pool, &st);
+      assert(st.free_bytes == bytes - 1024);
+
+      //A block with a neighbour in the way is copied elsewhere
+      unsigned char *wall = buddy_malloc(&pool, 1000);
+      assert(wall == p + 1024);
+      unsigned char *q = buddy_realloc(&pool, p, 3000);
+      assert(q != NULL && q != p);
+      assert(filled(q, 1000, 2));
+      buddy_free(&pool, wall);
+      buddy_free(&pool, q);
+      check_buddy_stats_full(&pool);
+
+      //A big block is moved by remapping and leaves zero pages behind
+      size_t big = UINT64_C(300) << 10;
+      p = buddy_malloc(&pool, big);
+      wall = buddy_malloc(&pool, big);
+      fill(p, big, 3);
+      q = buddy_realloc(&pool, p, 2 * big);
+      assert(q != NULL && q != p);
+      assert(filled(q, big, 3));
+      assert(resident_pages(p - BUDDY_HEADER, UINT64_C(1) << 19) <= 1);
+      buddy_stats(&pool, &st);
+      assert(st.free_bytes == bytes - (UINT64_C(1) << 19) - (UINT64_C(1) << 20));
+
+      //Too big leaves the block alone
+      errno = 0;
+      assert(buddy_realloc(&pool, q, bytes) == NULL);
+      assert(errno == ENOMEM);
+      assert(filled(q, big, 3));
+      buddy_free(&pool, q);
+      buddy_free(&pool, wall);
+      check_buddy_stats_full(&pool);
+      buddy_destroy(&pool);
+    }
+}
+
+void test_buddy_mmap_threshold(void)
+{
+  fprintf(stderr, "->Testing mmap threshold\n");
+  for (int engine = BUDDY_ENGINE_LIST; engine <= BUDDY_ENGINE_TREE; engine++)
+    {
+      struct buddy_opts opts = {.engine = engine, .mmap_threshold = UINT64_C(128) << 10};
+      struct buddy_pool pool;
+      size_t bytes = UINT64_C(1) << 20;
+      assert(buddy_init_opts(&pool, bytes, &opts) == 0);
+      struct buddy_stats st;
+
+      //Big requests, even ones the pool could never hold, leave it alone
+      size_t big = UINT64_C(512) << 10;
+      unsigned char *p = buddy_malloc(&pool, big);
+      unsigned char *q = buddy_malloc(&pool, 2 * bytes);
+      assert(p != NULL && q != NULL);
+      assert(p < (unsigned char *)pool.base || p >= (unsigned char *)pool.base + bytes);
+      fill(p, big, 1);
+      fill(q, 2 * bytes, 2);
+      buddy_stats(&pool, &st);
+      assert(st.free_bytes == bytes);
+      assert(st.direct_maps == 2);
+      assert(st.direct_bytes >= big + 2 * bytes);
+      buddy_free(&pool, q);
+
+      //A mapping is resized in place of a copy and goes back into the pool
+      //once it is small enough
+      p = buddy_realloc(&pool, p, 4 * big);
+      assert(p != NULL && filled(p, big, 1));
+      buddy_stats(&pool, &st);
+      assert(st.direct_maps == 1 && st.direct_bytes >= 4 * big);
+      p = buddy_realloc(&pool, p, 1000);
+      assert(p == (unsigned char *)pool.base + BUDDY_HEADER);
+      assert(filled(p, 1000, 1));
+      buddy_stats(&pool, &st);
+      assert(st.direct_maps == 0 && st.direct_bytes == 0);
+
+      //A pool block that grows past the threshold moves out
+      q = buddy_realloc(&pool, p, big);
+      assert(q != NULL && q != p && filled(q, 1000, 1));
+      buddy_stats(&pool, &st);
+      assert(st.free_bytes == bytes && st.direct_maps == 1);
+
+      //Fresh mappings need no clearing
+      unsigned char *z = buddy_calloc(&pool, 1, big);
+      assert(z != NULL && all_zero(z, big));
+      buddy_stats(&pool, &st);
+      assert(st.calloc_calls == 1 && st.calloc_hits == 1);
+
+      //Batches sort out which is which
+      void *ptrs[4] = {q, buddy_malloc(&pool, 100), z, buddy_malloc(&pool, 100)};
+      buddy_free_batch(&pool, ptrs, 4);
+      buddy_stats(&pool, &st);
+      assert(st.direct_maps == 0);
+      check_buddy_stats_full(&pool);
+
+      //Left over mappings go away with the pool
+      assert(buddy_malloc(&pool, big) != NULL);
+      buddy_destroy(&pool);
+
+      //A block big enough for mremap moves out, then grows and shrinks as
+      //a mapping of its own
+      opts.mmap_threshold = UINT64_C(4) << 20;
+      assert(buddy_init_opts(&pool, UINT64_C(1) << 24, &opts) == 0);
+      big = UINT64_C(3) << 20;
+      p = buddy_malloc(&pool, big);
+      assert(p != NULL && p < (unsigned char *)pool.base + pool.numbytes);
+      fill(p, big, 3);
+      p = buddy_realloc(&pool, p, UINT64_C(6) << 20);
+      assert(p != NULL && filled(p, big, 3));
+      p = buddy_realloc(&pool, p, UINT64_C(64) << 20);
+      assert(p != NULL && filled(p, big, 3));
+      p = buddy_realloc(&pool, p, UINT64_C(5) << 20);
+      assert(p != NULL && filled(p, big, 3));
+      buddy_stats(&pool, &st);
+      assert(st.direct_maps == 1 && st.free_bytes == pool.numbytes);
+      p = buddy_realloc(&pool, p, UINT64_C(1) << 20);
+      assert(p != NULL && p < (unsigned char *)pool.base + pool.numbytes);
+      assert(filled(p, UINT64_C(1) << 20, 3));
+      buddy_free(&pool, p);
+      check_buddy_stats_full(&pool);
+      buddy_destroy(&pool);
+    }
+
+  //Without a threshold everything stays in the pool
+  struct buddy_pool pool;
+  assert(buddy_init_opts(&pool, UINT64_C(1) << 20, NULL) == 0);
+  errno = 0;
+  assert(buddy_malloc(&pool, UINT64_C(2) << 20) == NULL);
+  assert(errno == ENOMEM);
+  unsigned char *p = buddy_malloc(&pool, UINT64_C(512) << 10);
+  assert(p >= (unsigned char *)pool.base && p < (unsigned char *)pool.base + pool.numbytes);
+  buddy_free(&pool, p);
+  check_buddy_stats_full(&pool);
+  buddy_destroy(&pool);
+}
+
+void test_buddy_color(void)
+{
+  fprintf(stderr, "->Testing cache coloring\n");
+  for (int engine = BUDDY_ENGINE_LIST; engine <= BUDDY_ENGINE_TREE; engine++)
+    {
+      struct buddy_opts opts = {.engine = engine, .color = true};
+      struct buddy_pool pool;
+      assert(buddy_init_opts(&pool, UINT64_C(1) << 22, &opts) == 0);
+
+      //3000 bytes in a 4KiB block leave 16 spare lines, so 17 colors
+      enum { N = 34 };
+      unsigned char *p[N];
+      bool seen[64] = {false};
+      for (int i = 0; i < N; i++)
+        {
+          p[i] = buddy_malloc(&pool, 3000);
+          uintptr_t off = (uintptr_t)(p[i] - (unsigned char *)pool.base);
+          assert((off & 4095) >= BUDDY_HEADER);
+          assert((off & 4095) + 3000 <= 4096);
+          assert((off & 63) == BUDDY_HEADER);
+          if (i < 17)
+            {
+              assert(!seen[(off & 4095) >> 6]);
+              seen[(off & 4095) >> 6] = true;
+            }
+          fill(p[i], 3000, (unsigned char)i);
+        }
+      for (int i = 0; i < N; i++)
+        assert(filled(p[i], 3000, (unsigned char)i));
+
+      //Colored pointers resize in place and move with their data
+      unsigned char *q = p[1];
+      assert(buddy_realloc(&pool, q, 3050) == q);
+      assert(filled(q, 3000, 1));
+      q = buddy_realloc(&pool, q, 20000);
+      assert(q != NULL && filled(q, 3000, 1));
+      p[1] = q;
+
+      //Big colored blocks are remapped with their offset
+      size_t big = UINT64_C(300) << 10;
+      unsigned char *x = buddy_malloc(&pool, big);
+      unsigned char *s = buddy_malloc(&pool, big);
+      unsigned char *r = buddy_malloc(&pool, big);
+      assert(((uintptr_t)(s - (unsigned char *)pool.base) & 4095) != BUDDY_HEADER);
+      fill(s, big, 7);
+      unsigned char *t = buddy_realloc(&pool, s, 2 * big);
+      assert(t != NULL && t != s && filled(t, big, 7));
+      assert(((uintptr_t)(t - (unsigned char *)pool.base) & 4095) ==
+             ((uintptr_t)(s - (unsigned char *)pool.base) & 4095));
+      buddy_free(&pool, x);
+      buddy_free(&pool, r);
+      buddy_free(&pool, t);
+
+      //No slack, no color
+      unsigned char *full = buddy_malloc(&pool, 4096 - BUDDY_HEADER);
+      assert(((uintptr_t)(full - (unsigned char *)pool.base) & 4095) == BUDDY_HEADER);
+      buddy_free(&pool, full);
+
+      for (int i = 0; i < N / 2; i++)
+        buddy_free(&pool, p[i]);
+      buddy_free_batch(&pool, (void **)&p[N / 2], N / 2);
+      check_buddy_stats_full(&pool);
+
+      run_random_workload(&pool, 20000);
+      check_buddy_stats_full(&pool);
+      buddy_destroy(&pool);
+    }
+}
+
+void test_buddy_free_sized(void)
+{
+  fprintf(stderr, "->Testing sized free and headerless pools\n");
+  static const size_t sizes[] = {1, 40, 100, 1000, 5000, 70000};
+  enum { NSIZES = sizeof(sizes) / sizeof(sizes[0]) };
+  for (int engine = BUDDY_ENGINE_LIST; engine <= BUDDY_ENGINE_TREE; engine++)
+    {
+      struct buddy_opts opts = {.engine = engine};
+      struct buddy_pool pool;
+      assert(buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts) == 0);
+
+      unsigned char *p[2 * NSIZES];
+      for (int i = 0; i < 2 * NSIZES; i++)
+        {
+          p[i] = buddy_malloc(&pool, sizes[i % NSIZES]);
+          assert(p[i] != NULL);
+          fill(p[i], sizes[i % NSIZES], (unsigned char)i);
+        }
+      //Sized and plain frees mix, the blocks merge back either way
+      for (int i = 0; i < 2 * NSIZES; i++)
+        {
+          assert(filled(p[i], sizes[i % NSIZES], (unsigned char)i));
+          if (i % 2)
+            buddy_free(&pool, p[i]);
+          else
+            buddy_free_sized(&pool, p[i], sizes[i % NSIZES]);
+        }
+      check_buddy_stats_full(&pool);
+
+      unsigned char *c = buddy_calloc(&pool, 10, 100);
+      assert(c != NULL);
+      buddy_free_sized(&pool, c, 1000);
+      buddy_free_sized(&pool, NULL, 10);
+      check_buddy_stats_full(&pool);
+      buddy_destroy(&pool);
+    }
+
+  //The tree knows when the size is wrong
+  struct buddy_opts opts = {.engine = BUDDY_ENGINE_TREE};
+  struct buddy_pool pool;
+  assert(buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts) == 0);
+  void *w = buddy_malloc(&pool, 1000);
+  size_t free_bytes = pool.free_bytes;
+  buddy_free_sized(&pool, w, 5000);
+  buddy_free_sized(&pool, w, 10);
+  assert(pool.free_bytes == free_bytes);
+  buddy_free_sized(&pool, w, 1000);
+  check_buddy_stats_full(&pool);
+  buddy_destroy(&pool);
+
+  //Headerless pools need the tree and can not be colored
+  opts = (struct buddy_opts){.engine = BUDDY_ENGINE_LIST, .headerless = true};
+  assert(buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts) == -1 && errno == EINVAL);
+  opts = (struct buddy_opts){.engine = BUDDY_ENGINE_TREE, .headerless = true, .color = true};
+  assert(buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts) == -1 && errno == EINVAL);
+
+  opts.color = false;
+  size_t bytes = UINT64_C(1) << MIN_K;
+  assert(buddy_init_opts(&pool, bytes, &opts) == 0);
+  unsigned char *all = buddy_malloc(&pool, bytes);
+  assert(all == pool.base);
+  fill(all, bytes, 0x5A);
+  buddy_free(&pool, all);
+  check_buddy_stats_full(&pool);
+
+  //Power of two requests take exactly their size
+  unsigned char *a = buddy_malloc(&pool, 64);
+  unsigned char *b = buddy_malloc(&pool, 64);
+  unsigned char *d = buddy_malloc(&pool, 65);
+  assert(a == pool.base && b == a + 64 && d == a + 128);
+  fill(a, 64, 1);
+  fill(b, 64, 2);
+  fill(d, 65, 3);
+  assert(filled(a, 64, 1) && filled(b, 64, 2) && filled(d, 65, 3));
+
+  //Pointers into the middle of a block are refused
+  free_bytes = pool.free_bytes;
+  buddy_free(&pool, d + 64);
+  assert(pool.free_bytes == free_bytes);
+
+  //Calls that need the header refuse the pool
+  errno = 0;
+  assert(buddy_realloc(&pool, a, 100) == NULL && errno == EINVAL);
+  void *out[2];
+  errno = 0;
+  assert(buddy_malloc_batch(&pool, 64, 2, out) == 0 && errno == EINVAL);
+  struct buddy_child child;
+  assert(buddy_child_init(&child, &pool, bytes, bytes) == -1 && errno == EINVAL);
+
+  buddy_free(&pool, a);
+  buddy_free_sized(&pool, b, 64);
+  buddy_free_sized(&pool, d, 65);
+  check_buddy_stats_full(&pool);
+
+  unsigned char *c = buddy_calloc(&pool, 64, 64);
+  assert(c == pool.base && all_zero(c, 4096));
+  void *batch[2] = {buddy_malloc(&pool, 100), c};
+  buddy_free_batch(&pool, batch, 2);
+  check_buddy_stats_full(&pool);
+
+  run_random_workload(&pool, 20000);
+  check_buddy_stats_full(&pool);
+  buddy_destroy(&pool);
+}
+
+void test_buddy_registry(void)
+{
+  fprintf(stderr, "->Testing the pool registry\n");
+  struct buddy_opts bare = {.engine = BUDDY_ENGINE_TREE, .headerless = true};
+  struct buddy_opts color = {.color = true};
+  struct buddy_pool small, tree, colored, huge;
+  assert(buddy_init_opts(&small, UINT64_C(1) << MIN_K, NULL) == 0);
+  assert(buddy_init_opts(&tree, UINT64_C(1) << 22, &bare) == 0);
+  assert(buddy_init_opts(&colored, UINT64_C(1) << 22, &color) == 0);
+  //Larger than one top slot of the registry
+  assert(buddy_init_opts(&huge, UINT64_C(1) << 35, NULL) == 0);
+
+  //Pools are aligned to their size so none share a granule
+  assert(((uintptr_t)small.base & ((UINT64_C(1) << MIN_K) - 1)) == 0);
+  assert(((uintptr_t)tree.base & ((UINT64_C(1) << 22) - 1)) == 0);
+
+  unsigned char *a = buddy_malloc(&small, 100);
+  unsigned char *b = buddy_malloc(&tree, 100);
+  unsigned char *c = buddy_malloc(&colored, 3000);
+  unsigned char *d = buddy_malloc(&huge, UINT64_C(1) << 33);
+  unsigned char *e = buddy_malloc(&huge, 1000);
+  assert(a && b && c && d && e);
+  assert(buddy_owner(a) == &small && buddy_owner(a + 99) == &small);
+  assert(buddy_owner(b) == &tree);
+  assert(buddy_owner(c) == &colored);
+  assert(buddy_owner(d) == &huge && buddy_owner(d + (UINT64_C(1) << 33) - 1) == &huge);
+  assert(buddy_owner(e) == &huge);
+  assert(buddy_owner(&small) == NULL);
+  assert(buddy_owner(NULL) == NULL);
+  assert(buddy_owner((void *)UINTPTR_MAX) == NULL);
+
+  assert(buddy_usable_size(a) == 128 - BUDDY_HEADER);
+  assert(buddy_usable_size(b) == 128);
+  assert(buddy_usable_size(b + 64) == 0);
+  assert(buddy_usable_size(c) >= 3000 && buddy_usable_size(c) <= 4096 - BUDDY_HEADER);
+  assert(((uintptr_t)(c + buddy_usable_size(c)) & 4095) == 0);
+  assert(buddy_usable_size(e) == 1024 - BUDDY_HEADER);
+  assert(buddy_usable_size(&small) == 0);
+  fill(a, buddy_usable_size(a), 1);
+  fill(b, buddy_usable_size(b), 2);
+  fill(c, buddy_usable_size(c), 3);
+
+  buddy_free_any(a);
+  buddy_free_any(b);
+  buddy_free_any(c);
+  buddy_free_any(d);
+  buddy_free_any(e);
+  buddy_free_any(NULL);
+  check_buddy_stats_full(&small);
+  check_buddy_stats_full(&tree);
+  check_buddy_stats_full(&colored);
+  check_buddy_stats_full(&huge);
+
+  void *base = small.base;
+  void *huge_base = huge.base;
+  buddy_destroy(&small);
+  buddy_destroy(&huge);
+  assert(buddy_owner(base) == NULL);
+  assert(buddy_owner(huge_base) == NULL);
+
+  //A new pool may take over the address range
+  struct buddy_pool again;
+  assert(buddy_init_opts(&again, UINT64_C(1) << MIN_K, NULL) == 0);
+  assert(buddy_owner(again.base) == &again);
+  buddy_destroy(&again);
+  buddy_destroy(&tree);
+  buddy_destroy(&colored);
+}
+
+void test_buddy_malloc_at_least(void)
+{
+  fprintf(stderr, "->Testing malloc_at_least\n");
+  struct buddy_opts opts[] = {
+    {.engine = BUDDY_ENGINE_LIST},
+    {.engine = BUDDY_ENGINE_TREE, .headerless = true},
+    {.color = true},
+  };
+  for (size_t o = 0; o < sizeof(opts) / sizeof(opts[0]); o++)
+    {
+      struct buddy_pool pool;
+      size_t head = opts[o].headerless ? 0 : BUDDY_HEADER;
+      assert(buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts[o]) == 0);
+
+      //The whole 1KiB block, minus the header, is ours
+      size_t actual = 0;
+      unsigned char *p = buddy_malloc_at_least(&pool, 600, &actual);
+      assert(p != NULL);
+      assert(actual >= 600 && actual <= 1024 - head);
+      assert(((uintptr_t)(p + actual - (unsigned char *)pool.base) & 1023) == 0);
+      if (!opts[o].color)
+        assert(actual == 1024 - head);
+      fill(p, actual, 9);
+      assert(buddy_usable_size(p) == actual);
+      size_t got = actual;
+
+      //Exactly the usable size needs no bigger block
+      unsigned char *q = buddy_malloc_at_least(&pool, 1024 - head, &actual);
+      assert(q != NULL && actual == 1024 - head);
+      void *one = buddy_malloc_at_least(&pool, 1, NULL);
+      assert(one != NULL);
+      assert(buddy_malloc_at_least(&pool, 0, &actual) == NULL);
+
+      //Growing from there keeps every byte
+      if (!opts[o].headerless)
+        {
+          p = buddy_realloc(&pool, p, 5000);
+          assert(p != NULL && filled(p, got, 9));
+        }
+      buddy_free(&pool, p);
+      buddy_free_sized(&pool, q, 1024 - head);
+      buddy_free(&pool, one);
+      check_buddy_stats_full(&pool);
+      buddy_destroy(&pool);
+    }
+
+  //Direct mappings are rounded up to pages
+  struct buddy_opts direct = {.mmap_threshold = UINT64_C(1) << 16};
+  struct buddy_pool pool;
+  assert(buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &direct) == 0);
+  size_t actual = 0;
+  unsigned char *big = buddy_malloc_at_least(&pool, 100000, &actual);
+  assert(big != NULL && actual >= 100000);
+  assert(((uintptr_t)(big + actual) & 4095) == 0);
+  fill(big, actual, 4);
+  buddy_free(&pool, big);
+  check_buddy_stats_full(&pool);
+  buddy_destroy(&pool);
+}
+
+void test_buddy_exact_fit(void)
+{
+  fprintf(stderr, "->Testing exact fit\n");
+  struct buddy_opts opts = {.engine = BUDDY_ENGINE_LIST, .exact_fit = 4096};
+  struct buddy_pool pool;
+  assert(buddy_init_opts(&pool, UINT64_C(1) << 30, &opts) == -1 && errno == EINVAL);
+  opts = (struct buddy_opts){.engine = BUDDY_ENGINE_TREE, .headerless = true, .exact_fit = 4096};
+  assert(buddy_init_opts(&pool, UINT64_C(1) << 30, &opts) == -1 && errno == EINVAL);
+
+  opts = (struct buddy_opts){.engine = BUDDY_ENGINE_TREE, .exact_fit = UINT64_C(1) << 20};
+  size_t bytes = UINT64_C(1) << 30;
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  assert(buddy_init_opts(&pool, bytes, &opts) == 0);
+
+  //640MiB keeps 512MiB, 128MiB and a page, the other 384MiB are free
+  size_t big = UINT64_C(640) << 20;
+  unsigned char *a = buddy_malloc(&pool, big);
+  assert(a == (unsigned char *)pool.base + BUDDY_HEADER);
+  struct buddy_stats st;
+  buddy_stats(&pool, &st);
+  assert(st.free_bytes == bytes - big - page);
+  assert(buddy_usable_size(a) == big + page - BUDDY_HEADER);
+  a[0] = 1;
+  a[big - 1] = 2;
+
+  //Room a rounded up block would have taken
+  unsigned char *b = buddy_malloc(&pool, UINT64_C(250) << 20);
+  assert(b != NULL && b >= a + big);
+  size_t actual;
+  unsigned char *c = buddy_malloc_at_least(&pool, 3 << 20, &actual);
+  assert(c != NULL && actual == (3 << 20) + page - BUDDY_HEADER);
+  unsigned char *small = buddy_malloc(&pool, 1000);
+  assert(small != NULL && buddy_usable_size(small) == 1024 - BUDDY_HEADER);
+
+  //A trimmed block moves on realloc and keeps its data
+  unsigned char *c2 = buddy_realloc(&pool, c, 5 << 20);
+  assert(c2 != NULL && c2 != c);
+  assert(buddy_usable_size(c2) == (5 << 20) + page - BUDDY_HEADER);
+
+  buddy_free(&pool, b);
+  buddy_free_sized(&pool, c2, 5 << 20);
+  buddy_free(&pool, small);
+  assert(a[0] == 1 && a[big - 1] == 2);
+  buddy_free(&pool, a);
+  check_buddy_stats_full(&pool);
+
+  //Requests that fill a block exactly are not touched
+  a = buddy_malloc(&pool, (UINT64_C(1) << 24) - BUDDY_HEADER);
+  buddy_stats(&pool, &st);
+  assert(st.free_bytes == bytes - (UINT64_C(1) << 24));
+  void *batch[3] = {a, buddy_malloc(&pool, 3 << 20), buddy_malloc(&pool, 7 << 20)};
+  buddy_free_batch(&pool, batch, 3);
+  check_buddy_stats_full(&pool);
+
+  //So do requests within a page of their block, they report the whole block
+  size_t asks[] = {(UINT64_C(1) << 21) - 64, (UINT64_C(1) << 24) - 64};
+  for (size_t i = 0; i < sizeof(asks) / sizeof(asks[0]); i++)
+    {
+      a = buddy_malloc_at_least(&pool, asks[i], &actual);
+      assert(a != NULL && actual >= asks[i]);
+      assert(actual == buddy_usable_size(a));
+      buddy_free_sized(&pool, a, actual);
+    }
+  check_buddy_stats_full(&pool);
+
+  run_random_workload(&pool, 20000);
+  check_buddy_stats_full(&pool);
+  buddy_destroy(&pool);
+}
+
+void test_buddy_malloc_sg(void)
+{
+  fprintf(stderr, "->Testing malloc_sg\n");
+  struct buddy_opts opts[] = {
+    {.engine = BUDDY_ENGINE_LIST},
+    {.engine = BUDDY_ENGINE_TREE, .headerless = true},
+  };
+  for (size_t o = 0; o < sizeof(opts) / sizeof(opts[0]); o++)
+    {
+      struct buddy_pool pool;
+      struct buddy_stats st;
+      struct iovec iov[8];
+      size_t head = opts[o].headerless ? 0 : BUDDY_HEADER;
+      assert(buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts[o]) == 0);
+
+      //A request that fits one block takes one piece
+      assert(buddy_malloc_sg(&pool, 100, iov, 8) == 1);
+      assert(iov[0].iov_len == 100);
+      buddy_free_sg(&pool, iov, 1);
+      check_buddy_stats_full(&pool);
+
+      //Every other 64KiB block free, with the first two joined to 128KiB
+      void *blocks[16];
+      for (int i = 0; i < 16; i++)
+        {
+          blocks[i] = buddy_malloc(&pool, (UINT64_C(1) << 16) - head);
+          assert(blocks[i] != NULL);
+        }
+      buddy_free(&pool, blocks[0]);
+      for (int i = 1; i < 16; i += 2)
+        buddy_free(&pool, blocks[i]);
+      assert(buddy_malloc(&pool, 200000) == NULL);
+      buddy_stats(&pool, &st);
+      size_t free_bytes = st.free_bytes;
+
+      //Too few pieces allowed leaves the pool as it was
+      errno = 0;
+      assert(buddy_malloc_sg(&pool, 200000, iov, 2) == -1);
+      assert(errno == ENOMEM);
+      buddy_stats(&pool, &st);
+      assert(st.free_bytes == free_bytes);
+
+      //The largest block first, then one 64KiB block and a bit of another
+      int n = buddy_malloc_sg(&pool, 200000, iov, 8);
+      assert(n == 3);
+      assert(iov[0].iov_len == (UINT64_C(1) << 17) - head);
+      assert(iov[1].iov_len == (UINT64_C(1) << 16) - head);
+      size_t total = 0;
+      for (int i = 0; i < n; i++)
+        total += iov[i].iov_len;
+      assert(total == 200000);
+
+      //The pieces read and write as one buffer
+      unsigned char *src = malloc(200000);
+      unsigned char *dst = malloc(200000);
+      fill(src, 200000, 5);
+      FILE *f = tmpfile();
+      assert(f != NULL);
+      int fd = fileno(f);
+      assert(write(fd, src, 200000) == 200000);
+      assert(lseek(fd, 0, SEEK_SET) == 0);
+      assert(readv(fd, iov, n) == 200000);
+      size_t off = 0;
+      for (int i = 0; i < n; i++)
+        {
+          assert(memcmp(iov[i].iov_base, src + off, iov[i].iov_len) == 0);
+          off += iov[i].iov_len;
+        }
+      assert(lseek(fd, 0, SEEK_SET) == 0);
+      assert(writev(fd, iov, n) == 200000);
+      assert(lseek(fd, 0, SEEK_SET) == 0);
+      assert(read(fd, dst, 200000) == 200000);
+      assert(memcmp(src, dst, 200000) == 0);
+      fclose(f);
+      free(src);
+      free(dst);
+
+      buddy_free_sg(&pool, iov, n);
+      buddy_stats(&pool, &st);
+      assert(st.free_bytes == free_bytes);
+      for (int i = 2; i < 16; i += 2)
+        buddy_free(&pool, blocks[i]);
+      check_buddy_stats_full(&pool);
+      assert(buddy_malloc_sg(&pool, 0, iov, 8) == -1);
+      buddy_destroy(&pool);
+    }
+}
+
+void test_buddy_uring(void)
+{
+  fprintf(stderr, "->Testing io_uring fixed buffers\n");
+#ifndef BUDDY_HAVE_URING
+  TEST_IGNORE_MESSAGE("built without <linux/io_uring.h>");
+#else
+  struct buddy_pool pool;
+  assert(buddy_init_opts(&pool, UINT64_C(1) << MIN_K, NULL) == 0);
+  char *p = buddy_malloc(&pool, 1000);
+  assert(p != NULL);
+  errno = 0;
+  assert(buddy_uring_index(&pool, p, 1000, NULL) == -1 && errno == EINVAL);
+
+  struct io_uring_params params = {0};
+  int ring = (int)syscall(__NR_io_uring_setup, 4, &params);
+  if (ring < 0)
+    {
+      buddy_free(&pool, p);
+      buddy_destroy(&pool);
+      TEST_IGNORE_MESSAGE("io_uring not available");
+      return;
+    }
+  errno = 0;
+  assert(buddy_uring_register(&pool, ring, 8) == -1 && errno == EINVAL);
+  assert(buddy_uring_register(&pool, ring, MIN_K + 1) == -1 && errno == EINVAL);
+  assert(buddy_uring_register(&pool, ring, 16) == 16);
+  assert(buddy_uring_register(&pool, ring, 16) == -1 && errno == EBUSY);
+
+  //Buffer i covers the 64KiB i << 16 bytes into the pool
+  size_t off = 0;
+  size_t at = (size_t)(p - (char *)pool.base);
+  assert(buddy_uring_index(&pool, p, 1000, &off) == (int)(at >> 16));
+  assert(off == (at & 0xffff));
+  char *q = buddy_malloc(&pool, 40000);
+  at = (size_t)(q - (char *)pool.base);
+  assert(buddy_uring_index(&pool, q, 40000, &off) == (int)(at >> 16));
+  assert(off == (at & 0xffff));
+  char *big = buddy_malloc(&pool, 100000);
+  assert(buddy_uring_index(&pool, big, 100000, NULL) == -1 && errno == EINVAL);
+  assert(buddy_uring_index(&pool, big, 1000, NULL) >= 0);
+  assert(buddy_uring_index(&pool, (char *)pool.base + pool.numbytes - 10, 20, NULL) == -1);
+
+  //Pinned pages are never given back
+  memset(big, 1, 100000);
+  buddy_free(&pool, big);
+  assert(buddy_purge(&pool) == 0);
+
+  assert(buddy_uring_unregister(&pool) == 0);
+  assert(buddy_uring_unregister(&pool) == -1 && errno == EINVAL);
+  assert(buddy_uring_index(&pool, p, 1000, NULL) == -1);
+  assert(buddy_purge(&pool) > 0);
+
+  //Destroy lets go of a pool still registered
+  assert(buddy_uring_register(&pool, ring, 0) == 1);
+  assert(buddy_uring_index(&pool, q, 40000, &off) == 0);
+  assert(off == (size_t)(q - (char *)pool.base));
+  buddy_free(&pool, p);
+  buddy_free(&pool, q);
+  check_buddy_stats_full(&pool);
+  buddy_destroy(&pool);
+  close(ring);
+#endif
+}
+
+struct pressure_log
+{
+  int calls;
+  int level;
+  size_t free_bytes;
+};
+
+static void record_pressure(struct buddy_pool *pool, int level, void *arg)
+{
+  struct pressure_log *log = arg;
+  struct buddy_stats st;
+  //The pool lock is not held so calling back into the pool is fine
+  buddy_stats(pool, &st);
+  log->calls++;
+  log->level = level;
+  log->free_bytes = st.free_bytes;
+}
+
+/**
+ * The watermark callback fires once per crossing with hysteresis between
+ * the low and high marks and no more often than the interval allows.
+ */
+void test_buddy_watermarks(void)
+{
+  fprintf(stderr, "->Testing memory pressure watermarks\n");
+  struct buddy_pool pool;
+  size_t bytes = UINT64_C(1) << MIN_K;
+  buddy_init(&pool, bytes);
+  struct pressure_log log = {0};
+  struct buddy_watermarks wm = {.low_bytes = bytes / 2, .high_bytes = bytes / 4};
+  assert(buddy_set_watermarks(&pool, &wm, record_pressure, &log) == -1);
+  assert(errno == EINVAL);
+  wm.low_bytes = bytes / 4;
+  wm.high_bytes = bytes / 2;
+  assert(buddy_set_watermarks(&pool, &wm, record_pressure, &log) == 0);
+
+  //Blocks of 1/16 of the pool, the 13th allocation leaves 3/16 free
+  enum { N = 16 };
+  void *mem[N];
+  for (int i = 0; i < 12; i++)
+    mem[i] = buddy_malloc(&pool, bytes / 16 - BUDDY_HEADER);
+  assert(log.calls == 0);
+  mem[12] = buddy_malloc(&pool, bytes / 16 - BUDDY_HEADER);
+  assert(log.calls == 1 && log.level == BUDDY_PRESSURE_LOW);
+  assert(log.free_bytes == 3 * bytes / 16);
+  mem[13] = buddy_malloc(&pool, bytes / 16 - BUDDY_HEADER);
+  assert(log.calls == 1);
+
+  //Between the marks nothing happens, at the high mark we are ok again
+  for (int i = 13; i > 8; i--)
+    buddy_free(&pool, mem[i]);
+  assert(log.calls == 1);
+  buddy_free(&pool, mem[8]);
+  assert(log.calls == 2 && log.level == BUDDY_PRESSURE_OK);
+  struct buddy_stats st;
+  buddy_stats(&pool, &st);
+  assert(st.free_bytes == pool.free_bytes);
+
+  //The largest free block counts too, and crossings inside the interval
+  //wait for it to pass
+  wm.low_k = MIN_K - 1;
+  wm.high_k = MIN_K - 1;
+  wm.min_interval_ms = 60000;
+  assert(buddy_set_watermarks(&pool, &wm, record_pressure, &log) == 0);
+  mem[8] = buddy_malloc(&pool, bytes / 16 - BUDDY_HEADER);
+  assert(log.calls == 3 && log.level == BUDDY_PRESSURE_LOW);
+  for (int i = 0; i < 9; i++)
+    buddy_free(&pool, mem[i]);
+  assert(log.calls == 3);
+
+  //Blocks a child borrows and gives back count like any other
+  wm = (struct buddy_watermarks){.low_bytes = bytes / 4, .high_bytes = bytes / 2};
+  log = (struct pressure_log){0};
+  assert(buddy_set_watermarks(&pool, &wm, record_pressure, &log) == 0);
+  struct buddy_child child;
+  assert(buddy_child_init(&child, &pool, bytes, 0) == 0);
+  for (int i = 0; i < 13; i++)
+    mem[i] = buddy_child_malloc(&child, bytes / 16 - BUDDY_CHILD_HEADER);
+  assert(log.calls == 1 && log.level == BUDDY_PRESSURE_LOW);
+  for (int i = 0; i < 13; i++)
+    buddy_child_free(&child, mem[i]);
+  assert(log.calls == 2 && log.level == BUDDY_PRESSURE_OK);
+  buddy_child_destroy(&child);
+
+  assert(buddy_set_watermarks(&pool, NULL, NULL, NULL) == 0);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+struct delayed_free
+{
+  struct buddy_pool *pool;
+  void *ptr;
+  int delay_ms;
+};
+
+static void *free_after_delay(void *arg)
+{
+  struct delayed_free *df = arg;
+  struct timespec ts = {0, df->delay_ms * 1000000L};
+  nanosleep(&ts, NULL);
+  buddy_free(df->pool, df->ptr);
+  return NULL;
+}
+
+/**
+ * buddy_malloc_wait sleeps until another thread frees enough memory and
+ * gives up with ETIMEDOUT when nobody does.
+ */
+void test_buddy_malloc_wait(void)
+{
+  fprintf(stderr, "->Testing buddy_malloc_wait\n");
+  struct buddy_pool pool;
+  size_t bytes = UINT64_C(1) << MIN_K;
+  buddy_init(&pool, bytes);
+
+  //Requests that can never fit fail right away
+  assert(buddy_malloc_wait(&pool, bytes, -1) == NULL);
+  assert(errno == ENOMEM);
+
+  void *all = buddy_malloc(&pool, bytes - BUDDY_HEADER);
+  assert(all != NULL);
+  assert(buddy_malloc_wait(&pool, 100, 0) == NULL);
+  assert(errno == ETIMEDOUT);
+  assert(buddy_malloc_wait(&pool, 100, 20) == NULL);
+  assert(errno == ETIMEDOUT);
+  assert(pool.wait_mask == 0);
+
+  //The free from the other thread wakes us up
+  pthread_t tid;
+  struct delayed_free df = {&pool, all, 50};
+  assert(pthread_create(&tid, NULL, free_after_delay, &df) == 0);
+  void *mem = buddy_malloc_wait(&pool, 100, 5000);
+  assert(mem != NULL);
+  pthread_join(tid, NULL);
+  assert(pool.wait_mask == 0);
+  buddy_free(&pool, mem);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+ * With a rate of one byte every allocation is sampled, so the dumped
+ * profile must show exactly what is live and what was ever allocated.
+ */
+void test_buddy_prof(void)
+{
+  fprintf(stderr, "->Testing the heap profiler\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+  assert(buddy_prof_start(&pool, 0) == -1);
+  assert(buddy_prof_start(&pool, 1) == 0);
+
+  void *mem[10];
+  for (int i = 0; i < 10; i++)
+    mem[i] = buddy_malloc(&pool, 100);
+  for (int i = 0; i < 4; i++)
+    buddy_free(&pool, mem[i]);
+
+  FILE *out = tmpfile();
+  assert(out != NULL);
+  assert(buddy_prof_dump(&pool, out) == 0);
+  rewind(out);
+  size_t live, live_bytes, allocs, alloc_bytes, rate;
+  assert(fscanf(out, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu",
+                &live, &live_bytes, &allocs, &alloc_bytes, &rate) == 5);
+  assert(live == 6 && live_bytes == 600);
+  assert(allocs == 10 && alloc_bytes == 1000);
+  assert(rate == 1);
+
+  //The stack line and the mappings pprof needs to symbolize it
+  char line[4096];
+  bool found_stack = false, found_maps = false;
+  while (fgets(line, sizeof(line), out))
+    {
+      if (strstr(line, "] @ 0x"))
+        found_stack = true;
+      if (strcmp(line, "MAPPED_LIBRARIES:\n") == 0)
+        found_maps = true;
+    }
+  assert(found_stack && found_maps);
+  fclose(out);
+
+  for (int i = 4; i < 10; i++)
+    buddy_free(&pool, mem[i]);
+  buddy_prof_stop(&pool);
+  assert(buddy_prof_dump(&pool, stderr) == -1);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+ * Every USDT probe must show up as a stapsdt note of the buddy provider in
+ * this very binary.
+ */
+void test_buddy_sdt_notes(void)
+{
+  fprintf(stderr, "->Testing USDT probe notes\n");
+#ifndef BUDDY_HAVE_SDT
+  TEST_IGNORE_MESSAGE("built without <sys/sdt.h>");
+#else
+  static const char *probes[] = {
+    "malloc_entry", "malloc_split", "malloc_success", "malloc_failure", "malloc_wait",
+    "malloc_batch", "free_batch", "purge", "realloc",
+    "free_entry", "free_merge", "free_done", "init", "destroy",
+  };
+  enum { NPROBES = sizeof(probes) / sizeof(probes[0]) };
+  bool found[NPROBES] = {0};
+
+  FILE *f = fopen("/proc/self/exe", "rb");
+  assert(f != NULL);
+  fseek(f, 0, SEEK_END);
+  long len = ftell(f);
+  rewind(f);
+  char *elf = malloc(len);
+  assert(fread(elf, 1, len, f) == (size_t)len);
+  fclose(f);
+
+  Elf64_Ehdr *eh = (Elf64_Ehdr *)elf;
+  assert(memcmp(eh->e_ident, ELFMAG, SELFMAG) == 0);
+  Elf64_Shdr *sh = (Elf64_Shdr *)(elf + eh->e_shoff);
+  const char *names = elf + sh[eh->e_shstrndx].sh_offset;
+  for (int i = 0; i < eh->e_shnum; i++)
+    {
+      if (strcmp(names + sh[i].sh_name, ".note.stapsdt") != 0)
+        continue;
+      char *p = elf + sh[i].sh_offset;
+      char *end = p + sh[i].sh_size;
+      while (p < end)
+        {
+          Elf64_Nhdr *nh = (Elf64_Nhdr *)p;
+          char *owner = p + sizeof(Elf64_Nhdr);
+          char *desc = owner + ((nh->n_namesz + 3) & ~3u);
+          //The descriptor is pc, base and semaphore followed by the strings
+          const char *provider = desc + 3 * sizeof(uint64_t);
+          const char *probe = provider + strlen(provider) + 1;
+          if (strcmp(owner, "stapsdt") == 0 && strcmp(provider, "buddy") == 0)
+            {
+              for (int n = 0; n < NPROBES; n++)
+                found[n] |= strcmp(probe, probes[n]) == 0;
+            }
+          p = desc + ((nh->n_descsz + 3) & ~3u);
+        }
+    }
+  free(elf);
+  for (int n = 0; n < NPROBES; n++)
+    {
+      if (!found[n])
+        fprintf(stderr, "missing probe buddy:%s\n", probes[n]);
+      assert(found[n]);
+    }
+#endif
+}
 
 int main(void) {
   time_t t;
@@ -375,6 +2009,7 @@ int main(void) {
 
   UNITY_BEGIN();
   RUN_TEST(test_buddy_init);
+  RUN_TEST(test_buddy_init_opts);
   RUN_TEST(test_btok);
   RUN_TEST(test_buddy_calc);
   RUN_TEST(test_buddy_malloc_one_byte);
@@ -389,6 +2024,30 @@ int main(void) {
   RUN_TEST(test_buddy_malloc_free_multiple_blocks);
   RUN_TEST(test_buddy_malloc_power_of_two_sizes);
   RUN_TEST(test_buddy_fragmentation);
+  RUN_TEST(test_buddy_list_random);
+  RUN_TEST(test_buddy_tree_engine);
+  RUN_TEST(test_buddy_address_policy);
+  RUN_TEST(test_buddy_handles);
+  RUN_TEST(test_buddy_malloc_wait);
+  RUN_TEST(test_buddy_reserve);
+  RUN_TEST(test_buddy_child);
+  RUN_TEST(test_buddy_watermarks);
+  RUN_TEST(test_buddy_batch);
+  RUN_TEST(test_buddy_presplit);
+  RUN_TEST(test_buddy_calloc);
+  RUN_TEST(test_buddy_prezero);
+  RUN_TEST(test_buddy_realloc);
+  RUN_TEST(test_buddy_mmap_threshold);
+  RUN_TEST(test_buddy_color);
+  RUN_TEST(test_buddy_free_sized);
+  RUN_TEST(test_buddy_registry);
+  RUN_TEST(test_buddy_malloc_at_least);
+  RUN_TEST(test_buddy_exact_fit);
+  RUN_TEST(test_buddy_malloc_sg);
+  RUN_TEST(test_buddy_uring);
+  RUN_TEST(test_buddy_compact);
+  RUN_TEST(test_buddy_prof);
+  RUN_TEST(test_buddy_sdt_notes);
   
   
   return UNITY_END();